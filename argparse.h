@@ -204,23 +204,39 @@ class ArgParser {
         assert(found != opt_args_.end() && "Unknown opt arg.");
         const Argument &arg = *found->second;
 
+        // A value may also be given in the same argument, as in `-O2` or
+        // `--opt=val`.
+        std::string_view joined = getJoinedValue(cmd_arg);
+        bool has_joined = joined.data() != nullptr;
+
         if (arg.isStoreConst()) {
+          assert(!has_joined && "This optional argument takes no value.");
           ns.AddArg(arg.getName(), arg.getConstValue());
         } else if (arg.isAppend()) {
-          ++i;  // Advance past this argument.
-          ns.AppendStringArg(arg.getName(), argv[i]);
+          if (!has_joined)
+            joined = argv[++i];  // Advance past this argument.
+          ns.AppendStringArg(arg.getName(), joined);
         } else {
-          ++i;  // Advance past this argument.
-          assert(i < argc && "No optional store argument passed to this.");
+          if (!has_joined) {
+            ++i;  // Advance past this argument.
+            assert(i < argc && "No optional store argument passed to this.");
+            joined = argv[i];
+          }
 
-          ns.EmplaceArg(arg.getName(), argv[i]);
+          ns.EmplaceArg(arg.getName(), joined);
         }
       } else {
         assert(pos_arg_idx < pos_args_.size() &&
                "More than expected number of pos args.");
 
-        // Positional argument.
+        // Positional argument. One with APPEND takes all that are left.
         const Argument &arg = *pos_args_.at(pos_arg_idx);
+        if (arg.isAppend()) {
+          assert(pos_arg_idx + 1 == pos_args_.size() &&
+                 "Only the last pos arg can append.");
+          ns.AppendStringArg(arg.getName(), cmd_arg);
+          continue;
+        }
         assert(arg.isStore());
         ++pos_arg_idx;
 
@@ -363,7 +379,7 @@ class ArgParser {
   bool isShortOptArg(std::string_view arg) const {
     if (isLongOptArg(arg))
       return false;
-    return arg.starts_with('-') && arg.size() == 2;
+    return arg.starts_with('-') && arg.size() >= 2;
   }
 
   bool isOptArg(std::string_view arg) const {
@@ -380,11 +396,26 @@ class ArgParser {
     }
 
     if (isLongOptArg(cmd_arg))
-      return cmd_arg.substr(2);
+      return cmd_arg.substr(2, cmd_arg.find('=') - 2);
 
     __ARGPARSE_UNREACHABLE("%s is not an optional argument", cmd_arg.data());
   }
 
+  // The value after a short name (`-O2`) or after `=` in a long option
+  // (`--opt=val`). This is a null string_view if there is none.
+  std::string_view getJoinedValue(std::string_view cmd_arg) const {
+    if (isShortOptArg(cmd_arg)) {
+      if (cmd_arg.size() == 2)
+        return {};
+      return cmd_arg.substr(2);
+    }
+
+    size_t eq = cmd_arg.find('=');
+    if (eq == std::string_view::npos)
+      return {};
+    return cmd_arg.substr(eq + 1);
+  }
+
   std::string prog_;
   std::string description_;
   const std::string program_name_;
@@ -0,0 +1,251 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "libparen.h"
+
+// Run from the build directory (see the bench target), where init finds
+// library.paren. Paths into the build come from bench/CMakeLists.txt.
+
+namespace {
+
+using libparen::snode;
+
+std::string read_file(const std::string &path) {
+  std::string text;
+  if (!libparen::slurp(path, text))
+    fprintf(stderr, "Cannot open file: %s\n", path.c_str());
+  return text;
+}
+
+// Defines what a benchmark calls, once per run of it.
+void define(const char *code) { libparen::eval_string(code); }
+
+// Calls global fn `name` with `args`.
+snode call(const char *name, std::vector<snode> args = {}) {
+  snode func = libparen::get(name);
+  libparen::senvironment env;
+  return libparen::apply(func, args, env);
+}
+
+void BM_Init(benchmark::State &state) {
+  libparen::set_cache_dir("");
+  for (auto _ : state)
+    libparen::init();
+}
+BENCHMARK(BM_Init)->Unit(benchmark::kMillisecond);
+
+// Startup with library.paren loaded from its image (see eval_file).
+void BM_InitCached(benchmark::State &state) {
+  libparen::set_cache_dir("bench-cache");
+  libparen::init();  // makes the image
+  for (auto _ : state)
+    libparen::init();
+  libparen::set_cache_dir("");
+}
+BENCHMARK(BM_InitCached)->Unit(benchmark::kMillisecond);
+
+// What init makes, copied from an interpreter that has it; see fork.
+void BM_Fork(benchmark::State &state) {
+  libparen::set_cache_dir("");
+  libparen::Interpreter base;
+  base.init();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(base.fork());
+}
+BENCHMARK(BM_Fork)->Unit(benchmark::kMillisecond);
+
+void BM_Tokenize(benchmark::State &state) {
+  std::string source = read_file("library.paren");
+  for (auto _ : state)
+    benchmark::DoNotOptimize(libparen::tokenize(source));
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(source.size()));
+}
+BENCHMARK(BM_Tokenize);
+
+void BM_Parse(benchmark::State &state) {
+  std::string source = read_file("library.paren");
+  for (auto _ : state)
+    benchmark::DoNotOptimize(libparen::parse(source));
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(source.size()));
+}
+BENCHMARK(BM_Parse);
+
+// Macro expansion by compile, of forms using the macros of library.paren.
+void BM_Compile(benchmark::State &state) {
+  libparen::init();
+  std::string source;
+  for (int i = 0; i < 100; i++)
+    source += "(defn f (n) (for i 1 n 1 (when (> i 5) (prn i))))\n";
+  std::vector<snode> forms = libparen::parse(source);
+  for (auto _ : state) {
+    std::vector<snode> copy = forms;
+    benchmark::DoNotOptimize(libparen::compile_all(copy));
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(forms.size()));
+}
+BENCHMARK(BM_Compile);
+
+// Micro-ops: each fn does `n` of them in a loop.
+constexpr int kOps = 1000;
+
+void run_ops(benchmark::State &state, const char *definition,
+             const char *name) {
+  libparen::init();
+  define(definition);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(call(name, {libparen::make_snode(kOps)}));
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * kOps);
+}
+
+void BM_Arithmetic(benchmark::State &state) {
+  run_ops(state,
+          "(defn bench (n) (def acc 0) (def i 0)"
+          "  (while (< i n) (set acc (+ (* i 3) (- acc i))) (set i (+ i 1)))"
+          "  acc)",
+          "bench");
+}
+BENCHMARK(BM_Arithmetic);
+
+void BM_Lookup(benchmark::State &state) {
+  run_ops(state,
+          "(def g1 1) (def g2 2)"
+          "(defn bench (n) (def i 0) (def x 0)"
+          "  (while (< i n) (set x g1) (set x g2) (set i (+ i 1))) x)",
+          "bench");
+}
+BENCHMARK(BM_Lookup);
+
+void BM_Calls(benchmark::State &state) {
+  run_ops(state,
+          "(defn id (x) x)"
+          "(defn bench (n) (def i 0)"
+          "  (while (< i n) (id i) (set i (+ i 1))) i)",
+          "bench");
+}
+BENCHMARK(BM_Calls);
+
+void BM_Closures(benchmark::State &state) {
+  run_ops(state,
+          "(defn adder (k) (fn (x) (+ x k)))"
+          "(defn bench (n) (def i 0)"
+          "  (while (< i n) ((adder i) i) (set i (+ i 1))) i)",
+          "bench");
+}
+BENCHMARK(BM_Closures);
+
+void BM_StringBuild(benchmark::State &state) {
+  run_ops(state,
+          "(defn bench (n) (def s \"\") (def i 0)"
+          "  (while (< i n) (set s (string s \"x\")) (set i (+ i 1)))"
+          "  (strlen s))",
+          "bench");
+}
+BENCHMARK(BM_StringBuild);
+
+// map, fold and filter over a list of kListSize ints.
+constexpr int kListSize = 50000;
+
+void run_list(benchmark::State &state, const char *definition) {
+  libparen::init();
+  std::string xs =
+      "(def xs (apply list (range 1 " + std::to_string(kListSize) + ")))";
+  define(xs.c_str());
+  define(definition);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(call("bench", {libparen::get("xs")}));
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          kListSize);
+}
+
+void BM_Map(benchmark::State &state) {
+  run_list(state, "(defn bench (xs) (std::map inc xs))");
+}
+BENCHMARK(BM_Map)->Unit(benchmark::kMillisecond);
+
+void BM_Fold(benchmark::State &state) {
+  run_list(state, "(defn bench (xs) (fold + xs))");
+}
+BENCHMARK(BM_Fold)->Unit(benchmark::kMillisecond);
+
+void BM_Filter(benchmark::State &state) {
+  run_list(state,
+           "(defn bench (xs) (filter (fn (x) (== 0 (% x 3))) xs))");
+}
+BENCHMARK(BM_Filter)->Unit(benchmark::kMillisecond);
+
+// The same over a lazy sequence, fused into one pass.
+void BM_Pipeline(benchmark::State &state) {
+  run_list(state,
+           "(defn bench (xs)"
+           "  (fold + (map inc (filter (fn (x) (== 0 (% x 3))) (seq xs)))))");
+}
+BENCHMARK(BM_Pipeline)->Unit(benchmark::kMillisecond);
+
+// A list consed up, walked with first and rest.
+void BM_Cons(benchmark::State &state) {
+  run_list(state,
+           "(defn bench (xs) (def ys xs) (def acc nil)"
+           "  (while (< 0 (length ys))"
+           "    (set acc (cons (first ys) acc)) (set ys (rest ys)))"
+           "  (length acc))");
+}
+BENCHMARK(BM_Cons)->Unit(benchmark::kMillisecond);
+
+// Programs in bench/, run by paren as a separate process, or compiled by
+// paren -c into one.
+void run_command(benchmark::State &state, const std::string &command) {
+  for (auto _ : state) {
+    if (system(command.c_str()) != 0) {
+      state.SkipWithError(("Failed: " + command).c_str());
+      break;
+    }
+  }
+}
+
+void BM_Interpreted(benchmark::State &state, const std::string &program) {
+  run_command(state, std::string(PAREN_EXE) + " " + PAREN_BENCH_DIR + "/" +
+                         program + ".par > /dev/null");
+}
+
+void BM_Compiled(benchmark::State &state, const std::string &program) {
+  std::string exe = "bench-" + program;
+  std::string compile = std::string(PAREN_EXE) + " -c " + PAREN_BENCH_DIR +
+                        "/" + program + ".par -o " + exe + ".obj && " +
+                        PAREN_CXX + " " + exe + ".obj -o " + exe + " " +
+                        PAREN_LINK_FLAGS + " -Wl,--whole-archive -lparen -L" +
+                        PAREN_LIB_DIR + " -Wl,--no-whole-archive";
+  if (system(compile.c_str()) != 0) {
+    state.SkipWithError(("Failed: " + compile).c_str());
+    return;
+  }
+  run_command(state, "./" + exe + " > /dev/null");
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  for (const char *program : {"fib", "loops", "nbody", "strings"}) {
+    benchmark::RegisterBenchmark(
+        (std::string("BM_Interpreted/") + program).c_str(), BM_Interpreted,
+        std::string(program))
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+    benchmark::RegisterBenchmark(
+        (std::string("BM_Compiled/") + program).c_str(), BM_Compiled,
+        std::string(program))
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+  }
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
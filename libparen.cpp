@@ -1,949 +1,5683 @@
 #include "libparen.h"
 
+#include <fcntl.h>
+#include <sanitizer/asan_interface.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
 #include <sstream>
+#include <unordered_map>
 
 namespace libparen {
 
-senvironment global_env;  // variables
+// Dicts
+//
+// Keys that are numbers, bools, strings, symbols or nil compare by value, and
+// anything else by identity. A dict's table is shared by the copies def and
+// the like make of it until one of them is changed by put!.
 
-Node::Node() : type(T_NIL) {}
-Node::Node(int a) : type(T_INT), v_int(a) {}
-Node::Node(double a) : type(T_DOUBLE), v_double(a) {}
-Node::Node(bool a) : type(T_BOOL), v_bool(a) {}
-Node::Node(const std::string &a) : type(T_STRING), v_string(a) {}
-Node::Node(const std::vector<snode> &a) : type(T_LIST), v_list(a) {}
-Node::Node(builtin a) : type(T_BUILTIN), v_builtin(a) {}
-snode make_special(builtin a) {
-  Node n;
-  n.type = Node::T_SPECIAL;
-  n.v_builtin = a;
-  return std::make_shared<Node>(n);
+namespace {
+
+struct KeyHash {
+  size_t operator()(const snode &key) const {
+    const Node &n = *key;
+    switch (n.type) {
+      case Node::T_NIL:
+        return 0;
+      case Node::T_INT:
+        return std::hash<int>()(n.v_int);
+      case Node::T_DOUBLE:
+        return std::hash<double>()(n.v_double);
+      case Node::T_BOOL:
+        return n.v_bool ? 1 : 2;
+      case Node::T_STRING:
+        return std::hash<std::string_view>()(n.v_string);
+      case Node::T_SYMBOL:
+        return n.code ^ 0x5bd1e995;
+      default:
+        return std::hash<const Node *>()(&n);
+    }
+  }
+};
+
+struct KeyEq {
+  bool operator()(const snode &a, const snode &b) const {
+    if (a->type != b->type)
+      return false;
+    switch (a->type) {
+      case Node::T_NIL:
+        return true;
+      case Node::T_INT:
+        return a->v_int == b->v_int;
+      case Node::T_DOUBLE:
+        return a->v_double == b->v_double;
+      case Node::T_BOOL:
+        return a->v_bool == b->v_bool;
+      case Node::T_STRING:
+        return std::string_view(a->v_string) == std::string_view(b->v_string);
+      case Node::T_SYMBOL:
+        return a->code == b->code;
+      default:
+        return a == b;
+    }
+  }
+};
+
+typedef HashMap<snode, snode, KeyHash, KeyEq> Dict;
+
+Dict &dict_of(const Node &n) { return *static_cast<Dict *>(n.v_object.get()); }
+
+// Sequences
+//
+// (range START END STEP) makes a lazy sequence, which stands for the numbers
+// it would have and makes them one at a time as something goes through it. So
+// do map, filter and take of a sequence, going through theirs as they are gone
+// through, so that a pipeline of them runs in constant memory. A sequence never
+// changes, and nothing it makes is kept: going through it again makes its
+// elements again, and calls the fns in it again. Whatever takes a list takes a
+// sequence too, going through it to make one if it needs it whole.
+struct Seq {
+  enum Kind {
+    RANGE,
+    LIST,    // the elements of a list; (seq LIST)
+    MAP,     // f of each element of source
+    FILTER,  // the elements of source f is true of
+    TAKE     // the first count elements of source
+  } kind;
+  snode source;  // a list or sequence, unless RANGE
+  snode f;
+  // If RANGE: from start by step for as long as it is not past end. The
+  // elements are ints if these are, and kept as doubles, which hold any int.
+  bool ints = true;
+  double start = 0, end = 0, step = 0;
+  size_t count = 0;
+};
+
+const Seq &seq_of(const Node &n) {
+  return *static_cast<const Seq *>(n.v_object.get());
+}
+
+// Persistent lists
+//
+// cons makes a cell that shares the list it is consed onto, and pvec a vector
+// kept as a trie of 32-way nodes, of which assoc and push-back copy only the
+// path to the element they change, sharing the rest with the original. Neither
+// changes once made, so def and set copy no more than the node for one, and
+// rest of either shares it: that of a cell is the list it was consed onto, and
+// that of a vector is a window one element shorter on the same trie. Given a
+// list that is not persistent, these copy it into a vector first, once.
+struct Cons {
+  snode first;
+  snode rest;     // nil if empty, or else a cell or a vector
+  size_t length;  // of the list starting here
+
+  // Frees the cells only this one holds a cell at a time, rather than each
+  // freeing the next, which a long enough list would run out of stack doing.
+  ~Cons() {
+    snode next = std::move(rest);
+    while (next && next.use_count() == 1 && next->type == Node::T_CONS &&
+           next->v_object.use_count() == 1) {
+      snode after = std::move(static_cast<Cons *>(next->v_object.get())->rest);
+      next = std::move(after);
+    }
+  }
+};
+
+constexpr unsigned kTrieBits = 5;
+constexpr size_t kTrieWidth = size_t{1} << kTrieBits;
+constexpr size_t kTrieMask = kTrieWidth - 1;
+
+struct Trie {
+  std::vector<snode> items;                           // if a leaf
+  std::vector<std::shared_ptr<const Trie>> children;  // otherwise
+};
+
+struct PVec {
+  std::shared_ptr<const Trie> root;
+  unsigned shift = 0;  // of indexes into the children of root; 0 if a leaf
+  size_t start = 0;    // in the trie, of the first element
+  size_t size = 0;
+};
+
+bool is_persistent(const Node &n) {
+  return n.type == Node::T_CONS || n.type == Node::T_PVEC;
+}
+
+// A list of any kind: what a Cursor goes through and as_list makes a list of.
+bool is_list(const Node &n) {
+  return n.type == Node::T_LIST || n.type == Node::T_SEQ || is_persistent(n);
+}
+
+const Cons &cons_of(const Node &n) {
+  return *static_cast<const Cons *>(n.v_object.get());
+}
+
+const PVec &pvec_of(const Node &n) {
+  return *static_cast<const PVec *>(n.v_object.get());
+}
+
+size_t persistent_length(const Node &n) {
+  if (n.type == Node::T_CONS)
+    return cons_of(n).length;
+  if (n.type == Node::T_PVEC)
+    return pvec_of(n).size;
+  return 0;  // nil
+}
+
+const snode &pvec_at(const PVec &vec, size_t index) {
+  size_t at = vec.start + index;
+  const Trie *trie = vec.root.get();
+  for (unsigned shift = vec.shift; shift > 0; shift -= kTrieBits)
+    trie = trie->children[(at >> shift) & kTrieMask].get();
+  return trie->items[at & kTrieMask];
+}
+
+// `trie`, or a new one if there is none, with element `at` of it set to `x`.
+std::shared_ptr<const Trie> trie_with(const std::shared_ptr<const Trie> &trie,
+                                      unsigned shift, size_t at, snode x) {
+  auto copy = trie ? std::make_shared<Trie>(*trie) : std::make_shared<Trie>();
+  size_t i = (at >> shift) & kTrieMask;
+  if (shift == 0) {
+    if (copy->items.size() <= i)
+      copy->items.resize(i + 1);
+    copy->items[i] = std::move(x);
+  } else {
+    if (copy->children.size() <= i)
+      copy->children.resize(i + 1);
+    copy->children[i] =
+        trie_with(copy->children[i], shift - kTrieBits, at, std::move(x));
+  }
+  return copy;
+}
+
+PVec pvec_assoc(const PVec &vec, size_t index, snode x) {
+  PVec result = vec;
+  result.root = trie_with(vec.root, vec.shift, vec.start + index, std::move(x));
+  return result;
+}
+
+PVec pvec_push_back(const PVec &vec, snode x) {
+  PVec result = vec;
+  size_t at = vec.start + vec.size;
+  if (vec.root && (at >> vec.shift) >= kTrieWidth) {  // full; add a level
+    auto root = std::make_shared<Trie>();
+    root->children.push_back(vec.root);
+    result.root = std::move(root);
+    result.shift += kTrieBits;
+  }
+  result.root = trie_with(result.root, result.shift, at, std::move(x));
+  result.size++;
+  return result;
+}
+
+// A vector of `items`, built a level at a time from the leaves up.
+PVec make_pvec_of(std::vector<snode> items) {
+  PVec vec;
+  vec.size = items.size();
+  if (items.empty())
+    return vec;
+  std::vector<std::shared_ptr<const Trie>> level;
+  for (size_t i = 0; i < items.size(); i += kTrieWidth) {
+    auto leaf = std::make_shared<Trie>();
+    size_t end = std::min(i + kTrieWidth, items.size());
+    leaf->items.assign(std::make_move_iterator(items.begin() + ptrdiff_t(i)),
+                       std::make_move_iterator(items.begin() + ptrdiff_t(end)));
+    level.push_back(std::move(leaf));
+  }
+  while (level.size() > 1) {
+    std::vector<std::shared_ptr<const Trie>> up;
+    for (size_t i = 0; i < level.size(); i += kTrieWidth) {
+      auto branch = std::make_shared<Trie>();
+      size_t end = std::min(i + kTrieWidth, level.size());
+      branch->children.assign(level.begin() + ptrdiff_t(i),
+                              level.begin() + ptrdiff_t(end));
+      up.push_back(std::move(branch));
+    }
+    level = std::move(up);
+    vec.shift += kTrieBits;
+  }
+  vec.root = std::move(level[0]);
+  return vec;
+}
+
+// Calls `f` on each element of `n`, a cell, a vector or nil, in order.
+template <typename F>
+void each_persistent(const Node &n, F &&f) {
+  const Node *at = &n;
+  for (; at->type == Node::T_CONS; at = cons_of(*at).rest.get())
+    f(cons_of(*at).first);
+  if (at->type != Node::T_PVEC)
+    return;
+  const PVec &vec = pvec_of(*at);
+  for (size_t i = 0; i < vec.size; i++)
+    f(pvec_at(vec, i));
+}
+
+}  // namespace
+
+// Heap
+
+namespace {
+
+constexpr size_t kBlockAlign = 16;
+constexpr size_t kSizeClasses = 16;  // arenas serve blocks of up to 256 bytes
+constexpr size_t kChunkSize = 64 * 1024;
+constexpr size_t kMinCollectAllocs = 64 * 1024;
+
+// Blocks of one size class, bumped out of chunks and recycled through a free
+// list threaded through their first word. A block freed on another thread goes
+// to that thread's list. Chunks are never returned, so arenas have no dtor and
+// are usable during static initialization.
+struct Arena {
+  void *free;
+  char *next;
+  char *end;
+};
+
+thread_local Arena arenas[kSizeClasses];
+
+// Every chunk, linked through its first block, so they stay reachable.
+std::atomic<void *> chunks;
+
+char *new_chunk() {
+  char *chunk = static_cast<char *>(::operator new(kChunkSize));
+  void *head = chunks.load();
+  do {
+    *reinterpret_cast<void **>(chunk) = head;
+  } while (!chunks.compare_exchange_weak(head, chunk));
+  return chunk + kBlockAlign;
+}
+
+std::atomic<size_t> live_bytes;
+std::atomic<size_t> live_objects;
+
+constexpr uint64_t kFnvOffset = 14695981039346656037ull;
+
+}  // namespace
+
+// What an Interpreter has of its own. The thread running one reaches it
+// through `context`, and so do the threads and tasks its code starts; any
+// other thread is in default_context, which the API outside Interpreter acts
+// on.
+struct Macro;
+
+struct Context {
+  senvironment globals;  // the global table
+  // Indexed by symbol code. A macro being expanded stays alive if another
+  // thread redefines it.
+  std::vector<std::shared_ptr<const Macro>> macros;
+  std::shared_mutex macros_mutex;
+  // A hash of every defmacro run so far, in order. What a form expands to
+  // depends on nothing else (see eval_file).
+  uint64_t macro_state = kFnvOffset;
+
+  // Number of threads started by the thread special, and of tasks, that have
+  // not finished.
+  std::atomic<int> threads_running = 0;
+  // What threads are done tracking for collect; see Registry.
+  std::mutex orphaned_envs_mutex;
+  std::vector<std::weak_ptr<environment>> orphaned_envs;
+  std::atomic<size_t> allocs_since_collect = 0;
+  size_t collect_threshold = kMinCollectAllocs;
+  HeapStats stats = {};
+};
+
+namespace {
+
+Context default_context;
+thread_local Context *context = &default_context;
+
+// What this thread has allocated and freed but not yet added to the counts
+// above. It is added in batches, keeping atomic operations off the allocation
+// path. Frees make bytes and objects wrap below zero, which adding them back
+// undoes.
+struct PendingCounts {
+  size_t bytes;
+  size_t objects;
+  size_t allocs;
+  unsigned ops;
+};
+
+constexpr unsigned kCountBatch = 256;
+
+thread_local PendingCounts pending;
+thread_local size_t blocks_allocated;  // ever, by this thread; for profiling
+
+void flush_counts() {
+  live_bytes.fetch_add(pending.bytes, std::memory_order_relaxed);
+  live_objects.fetch_add(pending.objects, std::memory_order_relaxed);
+  context->allocs_since_collect.fetch_add(pending.allocs,
+                                          std::memory_order_relaxed);
+  pending = {};
+}
+
+// Weak references to every environment made by make_env on this thread, for
+// collect. Expired ones are pruned as it grows. They are handed over to the
+// orphaned_envs of the thread's context when the thread ends or stops running
+// in it, so that each interpreter collects only environments of its own.
+struct Registry {
+  std::vector<std::weak_ptr<environment>> envs;
+  size_t pruned_size = 0;
+  ~Registry() {
+    orphan();
+    flush_counts();  // the thread is done allocating
+  }
+  void orphan();  // hands envs over to whichever thread collects next
+};
+
+void Registry::orphan() {
+  if (envs.empty())
+    return;
+  std::lock_guard<std::mutex> lock(context->orphaned_envs_mutex);
+  for (auto &env : envs) {
+    if (!env.expired())
+      context->orphaned_envs.push_back(std::move(env));
+  }
+  envs.clear();
+  pruned_size = 0;
+}
+
+thread_local Registry registry;
+
+// Trial deletion, as in CPython's cycle collector. Every object reachable from
+// a tracked environment is traced. Its references from other traced objects
+// are subtracted from its use count; whatever is left comes from outside (the
+// global table, the VM stack and frames, C++ locals), which makes the
+// object a root. Objects no root reaches are garbage, only alive through
+// cycles, and are broken apart by dropping their references.
+class Tracer {
+ public:
+  explicit Tracer(std::vector<std::weak_ptr<environment>> &tracked) {
+    objects.reserve(2 * tracked.size());
+    for (auto &weak : tracked) {
+      if (senvironment env = weak.lock()) {
+        // Discount the reference we now hold.
+        objects.emplace(env.get(),
+                        Object{env.use_count() - 1, 0, false, true,
+                               envs.size()});
+        envs.push_back(std::move(env));
+      }
+    }
+  }
+
+  size_t collect() {
+    auto add = [this](auto &ref) { discover(ref); };
+    for (size_t i = 0; i < envs.size(); i++)
+      each_ref(*envs[i], add);
+    for (size_t i = 0; i < nodes.size(); i++)
+      each_ref(*nodes[i], add);
+
+    for (auto &[ptr, object] : objects) {
+      for_refs(object, [this](auto &ref) {
+        auto found = objects.find(ref.get());
+        if (found != objects.end())
+          found->second.internal++;
+      });
+    }
+
+    std::vector<Object *> work;
+    for (auto &[ptr, object] : objects) {
+      if (object.refs > object.internal) {
+        object.live = true;
+        work.push_back(&object);
+      }
+    }
+    while (!work.empty()) {
+      Object *object = work.back();
+      work.pop_back();
+      for_refs(*object, [&](auto &ref) {
+        auto found = objects.find(ref.get());
+        if (found != objects.end() && !found->second.live) {
+          found->second.live = true;
+          work.push_back(&found->second);
+        }
+      });
+    }
+
+    // Everything garbage is held by envs or nodes until this returns, so
+    // nothing is freed while its references are being dropped.
+    size_t freed = 0;
+    for (auto &[ptr, object] : objects) {
+      if (object.live)
+        continue;
+      freed++;
+      if (object.is_env) {
+        environment &env = *envs[object.index];
+        env.env.clear();
+        env.slots.clear();
+        env.outer.reset();
+        env.code.reset();
+      } else {
+        Node &node = *nodes[object.index];
+        node.v_list.clear();
+        node.outer_env.reset();
+        node.v_object.reset();
+      }
+    }
+    return freed;
+  }
+
+  size_t size() const { return objects.size(); }
+
+ private:
+  struct Object {
+    long refs;      // use count
+    long internal;  // references from traced objects
+    bool live;
+    bool is_env;
+    size_t index;  // in envs or nodes
+  };
+
+  template <typename F>
+  static void each_ref(environment &env, F &&f) {
+    for (auto &[code, value] : env.env)
+      f(value);
+    for (Value &value : env.slots) {
+      if (value.tag == Value::BOXED && value.box)
+        f(value.box);
+    }
+    if (env.outer)
+      f(env.outer);
+  }
+
+  template <typename F>
+  static void each_ref(Node &node, F &&f) {
+    for (snode &item : node.v_list) {
+      if (item)
+        f(item);
+    }
+    // A table shared by copies of a dict is left out, which keeps what is in
+    // it, as its entries would be counted as referenced once per copy.
+    if (node.type == Node::T_DICT && node.v_object.use_count() == 1) {
+      for (auto &[key, value] : dict_of(node)) {
+        f(key);
+        f(value);
+      }
+    }
+    // Likewise with a sequence, for the fn in it.
+    if (node.type == Node::T_SEQ && node.v_object.use_count() == 1) {
+      Seq &seq = *static_cast<Seq *>(node.v_object.get());
+      if (seq.source)
+        f(seq.source);
+      if (seq.f)
+        f(seq.f);
+    }
+    // And with a cell, and with whatever part of a vector's trie no other
+    // vector shares.
+    if (node.type == Node::T_CONS && node.v_object.use_count() == 1) {
+      const Cons &cell = cons_of(node);
+      f(cell.first);
+      f(cell.rest);
+    }
+    if (node.type == Node::T_PVEC && node.v_object.use_count() == 1)
+      each_unshared(pvec_of(node).root, f);
+    if (node.outer_env)
+      f(node.outer_env);
+  }
+
+  template <typename F>
+  static void each_unshared(const std::shared_ptr<const Trie> &trie, F &&f) {
+    if (!trie || trie.use_count() != 1)
+      return;
+    for (const snode &item : trie->items) {
+      if (item)
+        f(item);
+    }
+    for (const std::shared_ptr<const Trie> &child : trie->children)
+      each_unshared(child, f);
+  }
+
+  template <typename F>
+  void for_refs(const Object &object, F &&f) {
+    if (object.is_env)
+      each_ref(*envs[object.index], f);
+    else
+      each_ref(*nodes[object.index], f);
+  }
+
+  void discover(const snode &node) {
+    if (objects.count(node.get()))
+      return;
+    objects.emplace(node.get(),
+                    Object{node.use_count(), 0, false, false, nodes.size()});
+    nodes.push_back(node);
+  }
+
+  // Every environment that can be traced was added up front.
+  void discover(const senvironment &) {}
+
+  std::unordered_map<const void *, Object> objects;
+  std::vector<senvironment> envs;
+  std::vector<snode> nodes;
+};
+
+}  // namespace
+
+void *heap_allocate(size_t size) {
+  pending.bytes += size;
+  pending.objects++;
+  pending.allocs++;
+  blocks_allocated++;
+  if (++pending.ops == kCountBatch)
+    flush_counts();
+  size_t size_class = (size + kBlockAlign - 1) / kBlockAlign;
+  if (size_class == 0 || size_class > kSizeClasses)
+    return ::operator new(size);
+
+  Arena &arena = arenas[size_class - 1];
+  size_t block = size_class * kBlockAlign;
+  if (void *p = arena.free) {
+    ASAN_UNPOISON_MEMORY_REGION(p, block);
+    arena.free = *static_cast<void **>(p);
+    return p;
+  }
+  if (static_cast<size_t>(arena.end - arena.next) < block) {
+    arena.next = new_chunk();
+    arena.end = arena.next + (kChunkSize - kBlockAlign);
+  }
+  void *p = arena.next;
+  arena.next += block;
+  return p;
+}
+
+void heap_deallocate(void *p, size_t size) {
+  pending.bytes -= size;
+  pending.objects--;
+  if (++pending.ops == kCountBatch)
+    flush_counts();
+  size_t size_class = (size + kBlockAlign - 1) / kBlockAlign;
+  if (size_class == 0 || size_class > kSizeClasses) {
+    ::operator delete(p);
+    return;
+  }
+
+  Arena &arena = arenas[size_class - 1];
+  *static_cast<void **>(p) = arena.free;
+  arena.free = p;
+  ASAN_POISON_MEMORY_REGION(p, size_class * kBlockAlign);
+}
+
+void track(const senvironment &env) {
+  std::vector<std::weak_ptr<environment>> &envs = registry.envs;
+  if (envs.size() >= 2 * registry.pruned_size + 1024) {
+    std::erase_if(envs, [](auto &weak) { return weak.expired(); });
+    registry.pruned_size = envs.size();
+  }
+  envs.push_back(env);
+}
+
+bool gc_due() {
+  return context->allocs_since_collect.load(std::memory_order_relaxed) +
+             pending.allocs >=
+         context->collect_threshold;
+}
+
+size_t collect() {
+  Context &here = *context;
+  if (here.threads_running.load() > 0)
+    return 0;
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::weak_ptr<environment>> &envs = registry.envs;
+  {
+    std::lock_guard<std::mutex> lock(here.orphaned_envs_mutex);
+    for (auto &env : here.orphaned_envs)
+      envs.push_back(std::move(env));
+    here.orphaned_envs.clear();
+  }
+  size_t freed, traced;
+  {
+    Tracer tracer(envs);
+    freed = tracer.collect();
+    traced = tracer.size();
+  }
+  std::erase_if(envs, [](auto &weak) { return weak.expired(); });
+  registry.pruned_size = envs.size();
+
+  flush_counts();
+  here.allocs_since_collect.store(0, std::memory_order_relaxed);
+  here.collect_threshold = std::max(kMinCollectAllocs, 2 * (traced - freed));
+  std::chrono::duration<double, std::micro> pause =
+      std::chrono::steady_clock::now() - start;
+  HeapStats &stats = here.stats;
+  stats.collections++;
+  stats.freed_objects += freed;
+  stats.last_pause_us = pause.count();
+  stats.max_pause_us = std::max(stats.max_pause_us, pause.count());
+  stats.total_pause_us += pause.count();
+  return freed;
+}
+
+HeapStats heap_stats() {
+  flush_counts();
+  HeapStats current = context->stats;
+  current.allocated_bytes = live_bytes.load(std::memory_order_relaxed);
+  current.live_objects = live_objects.load(std::memory_order_relaxed);
+  return current;
+}
+
+// Threads
+//
+// (thread EXPR ..) evaluates EXPR .. on a thread of its own, with a VM, heap
+// arenas, and a frame for what it defines of its own, in the environment it is
+// started in. (spawn EXPR ..) does the same as a task on a pool of workers, and
+// returns a future for what EXPR .. evaluates to, which (await FUTURE) waits
+// for; tasks count as threads here. Threads share the global table, the frames
+// they close over, and the nodes bound to variables there. Each load, def and
+// set of a variable, and each ++, --, push-back! and pop-back! of a node,
+// happens at once with respect to the others; anything else reading a list or
+// string another thread updates in place should wait for it with join or
+// await.
+//
+// What threads share is locked, but only while any of them runs: a lone thread
+// never takes these locks. That thread is the one starting the others, so it
+// sees them running from then on, and once it sees none left, everything they
+// did happened before.
+
+namespace {
+
+constexpr size_t kLockStripes = 64;
+
+struct alignas(64) Stripe {
+  std::mutex mutex;
+};
+
+struct alignas(64) SharedStripe {
+  std::shared_mutex mutex;
+};
+
+// Frames, by address, and nodes updated in place, by address.
+Stripe env_stripes[kLockStripes];
+Stripe node_stripes[kLockStripes];
+// The global table, by symbol code. Growing it takes every stripe.
+SharedStripe global_stripes[kLockStripes];
+
+typedef std::unique_lock<std::mutex> Lock;
+typedef std::shared_lock<std::shared_mutex> ReadLock;
+typedef std::unique_lock<std::shared_mutex> WriteLock;
+
+bool threads_active() {
+  return context->threads_running.load(std::memory_order_acquire) > 0;
+}
+
+// `mutex`, locked unless this is the only thread of the current interpreter.
+// Only for state of its own: what all interpreters share is always locked.
+template <typename L, typename Mutex>
+L lock_shared_state(Mutex &mutex) {
+  return threads_active() ? L(mutex) : L();
+}
+
+size_t stripe_of(const void *p) {
+  return (reinterpret_cast<uintptr_t>(p) / kBlockAlign) % kLockStripes;
+}
+
+// Guards the slots and bindings of a frame.
+Lock lock_env(const environment *env) {
+  return lock_shared_state<Lock>(env_stripes[stripe_of(env)].mutex);
+}
+
+// Guards a node against being updated in place while it is updated or copied.
+Lock lock_node(const Node *n) {
+  return lock_shared_state<Lock>(node_stripes[stripe_of(n)].mutex);
+}
+
+// Both nodes, say to copy one into the other, in an order all threads agree
+// on.
+std::pair<Lock, Lock> lock_nodes(const Node *a, const Node *b) {
+  size_t i = stripe_of(a), j = stripe_of(b);
+  if (!threads_active())
+    return {};
+  if (i == j)
+    return {Lock(node_stripes[i].mutex), Lock()};
+  if (i > j)
+    std::swap(i, j);
+  Lock first(node_stripes[i].mutex);
+  return {std::move(first), Lock(node_stripes[j].mutex)};
+}
+
+ReadLock read_global(size_t code) {
+  return lock_shared_state<ReadLock>(global_stripes[code % kLockStripes].mutex);
+}
+
+WriteLock write_global(size_t code) {
+  return lock_shared_state<WriteLock>(
+      global_stripes[code % kLockStripes].mutex);
+}
+
+// Makes room for symbol `code` in `globals`, the global table.
+void grow_globals(environment &globals, size_t code) {
+  {
+    ReadLock lock = read_global(code);
+    if (code < globals.slots.size())
+      return;
+  }
+  std::vector<WriteLock> locks;
+  if (threads_active()) {
+    for (SharedStripe &stripe : global_stripes)
+      locks.emplace_back(stripe.mutex);
+  }
+  if (code >= globals.slots.size())
+    globals.slots.resize(code + 1);
+}
+
+// Profiling; see profile_start. A thread keeps counts of its own, which it
+// adds to profile_totals when a task or thread ends and when it reports. The
+// fns it is running are also kept in a fixed array, which the SIGPROF handler
+// of "sample" reads wherever the thread was interrupted.
+enum ProfileMode { PROFILE_OFF, PROFILE_CALLS, PROFILE_SAMPLE };
+
+std::atomic<int> profile_mode = PROFILE_OFF;
+std::atomic<unsigned> profile_generation = 0;  // bumped by profile_start
+
+struct CallStats {
+  scode code;  // keeps the body, and so its address, until the report
+  uint64_t calls = 0;
+  uint64_t inclusive_ns = 0;  // of the outermost calls of a recursion
+  uint64_t exclusive_ns = 0;
+  uint64_t allocs = 0;  // heap blocks, by the body itself
+  uint32_t running = 0;  // calls under way on this thread
+};
+
+typedef HashMap<const Code *, CallStats> ProfileStats;
+
+std::mutex profile_mutex;
+ProfileStats profile_totals;
+
+constexpr size_t kShadowDepth = 256;  // outermost fns a sample holds
+constexpr size_t kSampleWords = 1 << 20;
+constexpr int kSampleMicros = 1000;
+
+// Samples, one after the other: how many fns, then the fns, outermost first.
+std::unique_ptr<uintptr_t[]> samples;
+constexpr uintptr_t kNoSample = ~uintptr_t(0);
+std::atomic<bool> sampling = false;
+std::atomic<size_t> samples_used;
+std::atomic<int> sampling_handlers;
+
+struct ThreadProfile {
+  struct Call {
+    const Code *code;
+    uint64_t start;  // 0 if untimed
+    uint64_t children_ns = 0;
+    size_t allocs;  // blocks_allocated at the start
+    size_t children_allocs = 0;
+    bool outermost;
+  };
+
+  unsigned generation = profile_generation.load();
+  ProfileStats stats;
+  std::vector<Call> calls;
+  const Code *shadow[kShadowDepth];
+  std::atomic<uint32_t> depth = 0;  // of calls, of which shadow has the first
+
+  ~ThreadProfile();
+
+  // Drops what was recorded before the last profile_start; returns whether
+  // there was any.
+  bool stale() {
+    unsigned now = profile_generation.load(std::memory_order_relaxed);
+    if (generation == now)
+      return false;
+    generation = now;
+    stats.clear();
+    calls.clear();
+    depth.store(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Adds the counts to profile_totals, leaving the calls under way.
+  void merge() {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    if (stale())
+      return;
+    for (auto &[code, from] : stats) {
+      if (!from.calls)
+        continue;
+      CallStats &to = profile_totals[code];
+      if (!to.code)
+        to.code = from.code;
+      to.calls += from.calls;
+      to.inclusive_ns += from.inclusive_ns;
+      to.exclusive_ns += from.exclusive_ns;
+      to.allocs += from.allocs;
+      from.calls = from.inclusive_ns = from.exclusive_ns = from.allocs = 0;
+    }
+  }
+};
+
+thread_local ThreadProfile *thread_profile = nullptr;  // for take_sample
+
+ThreadProfile::~ThreadProfile() {
+  thread_profile = nullptr;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  merge();
+}
+
+// Adds this thread's counts to profile_totals.
+void merge_profile() {
+  if (thread_profile)
+    thread_profile->merge();
+}
+
+ThreadProfile &profile_of_thread() {
+  static thread_local ThreadProfile profile;
+  thread_profile = &profile;
+  return profile;
+}
+
+uint64_t now_ns() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+void profile_enter(const scode &code) {
+  ThreadProfile &profile = profile_of_thread();
+  profile.stale();
+  CallStats &stats = profile.stats[code.get()];
+  if (!stats.code)
+    stats.code = code;
+  stats.calls++;
+  bool timed = profile_mode.load(std::memory_order_relaxed) == PROFILE_CALLS;
+  profile.calls.push_back({code.get(), timed ? now_ns() : 0, 0,
+                           blocks_allocated, 0, stats.running++ == 0});
+  uint32_t depth = profile.depth.load(std::memory_order_relaxed);
+  if (depth < kShadowDepth)
+    profile.shadow[depth] = code.get();
+  std::atomic_signal_fence(std::memory_order_release);
+  profile.depth.store(depth + 1, std::memory_order_relaxed);
+}
+
+void profile_leave() {
+  ThreadProfile *profile = thread_profile;
+  if (!profile || profile->stale() || profile->calls.empty())
+    return;  // entered before profile_start
+  ThreadProfile::Call call = profile->calls.back();
+  profile->calls.pop_back();
+  profile->depth.store(static_cast<uint32_t>(profile->calls.size()),
+                       std::memory_order_relaxed);
+  CallStats &stats = *profile->stats.find(call.code);
+  stats.running--;
+  size_t allocs = blocks_allocated - call.allocs;
+  stats.allocs += allocs - call.children_allocs;
+  uint64_t elapsed = call.start ? now_ns() - call.start : 0;
+  if (call.outermost)
+    stats.inclusive_ns += elapsed;
+  stats.exclusive_ns += elapsed - std::min(elapsed, call.children_ns);
+  if (!profile->calls.empty()) {
+    profile->calls.back().children_ns += elapsed;
+    profile->calls.back().children_allocs += allocs;
+  }
+}
+
+// The SIGPROF handler: records which fns the interrupted thread is running.
+void take_sample(int) {
+  sampling_handlers.fetch_add(1);
+  if (sampling.load()) {
+    ThreadProfile *profile = thread_profile;
+    size_t depth = profile ? std::min<size_t>(profile->depth.load(
+                                                  std::memory_order_relaxed),
+                                              kShadowDepth)
+                           : 0;
+    std::atomic_signal_fence(std::memory_order_acquire);
+    size_t at = samples_used.fetch_add(depth + 1);
+    if (at + depth + 1 <= kSampleWords) {
+      samples[at] = depth;
+      for (size_t i = 0; i < depth; i++)
+        samples[at + 1 + i] = reinterpret_cast<uintptr_t>(profile->shadow[i]);
+    } else if (at < kSampleWords) {
+      samples[at] = kNoSample;  // the buffer is full from here
+    }
+  }
+  sampling_handlers.fetch_sub(1);
+}
+
+void set_sample_timer(int micros) {
+  itimerval timer = {{0, micros}, {0, micros}};
+  setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+// A fixed set of workers running tasks, for spawn. Each worker has a deque of
+// tasks: it runs the newest of its own first, and steals the oldest of
+// another's when it has none. Tasks submitted from outside go to the workers
+// in turn. Threads waiting for a task to finish (see wait) run others
+// meanwhile, so tasks can wait for tasks they submit without using up the
+// workers.
+class Pool {
+ public:
+  typedef std::function<void()> Task;
+
+  explicit Pool(size_t size) : queues(size) {
+    for (size_t i = 0; i < size; i++)
+      workers.emplace_back([this, i] { work(i); });
+  }
+
+  ~Pool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers)
+      worker.join();
+  }
+
+  void submit(Task task) {
+    size_t i = worker_index >= 0 ? static_cast<size_t>(worker_index)
+                                 : next_queue++ % queues.size();
+    {
+      std::lock_guard<std::mutex> lock(queues[i].mutex);
+      queues[i].tasks.push_back(std::move(task));
+    }
+    queued.fetch_add(1);
+    notify(/*all=*/false);
+  }
+
+  // Runs tasks until `done` returns true.
+  template <typename F>
+  void wait(F &&done) {
+    while (!done()) {
+      if (run_one())
+        continue;
+      std::unique_lock<std::mutex> lock(sleep_mutex);
+      wake.wait(lock, [&] { return queued.load() > 0 || done(); });
+    }
+  }
+
+  size_t size() const { return workers.size(); }
+  static bool on_worker() { return worker_index >= 0; }
+
+  // Wakes whoever waits, eg. for a task that has finished.
+  void notify(bool all = true) {
+    { std::lock_guard<std::mutex> lock(sleep_mutex); }
+    if (all)
+      wake.notify_all();
+    else
+      wake.notify_one();
+  }
+
+ private:
+  struct alignas(64) Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<Queue> queues;  // one per worker
+  std::vector<std::thread> workers;
+  std::atomic<size_t> next_queue = 0;
+  std::atomic<size_t> queued = 0;
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+  static thread_local int worker_index;  // -1 outside the pool
+
+  bool take(size_t i, bool newest, Task &task) {
+    std::lock_guard<std::mutex> lock(queues[i].mutex);
+    std::deque<Task> &tasks = queues[i].tasks;
+    if (tasks.empty())
+      return false;
+    if (newest) {
+      task = std::move(tasks.back());
+      tasks.pop_back();
+    } else {
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    queued.fetch_sub(1);
+    return true;
+  }
+
+  // Runs a task, if any is queued, and returns whether it did.
+  bool run_one() {
+    if (queued.load() == 0)
+      return false;
+    Task task;
+    size_t self = worker_index >= 0 ? static_cast<size_t>(worker_index) : 0;
+    bool found = worker_index >= 0 && take(self, /*newest=*/true, task);
+    for (size_t k = 0; k < queues.size() && !found; k++)
+      found = take((self + k) % queues.size(), /*newest=*/false, task);
+    if (found)
+      task();
+    return found;
+  }
+
+  void work(size_t i) {
+    worker_index = static_cast<int>(i);
+    for (;;) {
+      if (run_one())
+        continue;
+      std::unique_lock<std::mutex> lock(sleep_mutex);
+      wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+      if (stopping && queued.load() == 0)
+        return;
+    }
+  }
+};
+
+thread_local int Pool::worker_index = -1;
+
+// The pool, started on first use with a worker per hardware thread, or
+// $PAREN_THREADS of them.
+Pool &pool() {
+  static Pool pool([] {
+    const char *threads = getenv("PAREN_THREADS");
+    int n = threads ? atoi(threads) : 0;
+    if (n <= 0)
+      n = static_cast<int>(std::thread::hardware_concurrency());
+    return static_cast<size_t>(std::max(n, 1));
+  }());
+  return pool;
+}
+
+// Makes this thread run in `to`, handing what it tracked and counted in the
+// one it was in over to that. Returns that one.
+Context *enter(Context *to) {
+  Context *from = context;
+  if (to != from) {
+    flush_counts();
+    registry.orphan();
+    context = to;
+  }
+  return from;
+}
+
+// Submits `task` to the pool as paren code of this thread's interpreter, which
+// counts as a running thread there until the task and what it holds are gone.
+// What the submitter printed comes out before what the task prints.
+template <typename F>
+void submit_task(F task) {
+  flush_output();
+  Context *here = context;
+  here->threads_running.fetch_add(1, std::memory_order_relaxed);
+  pool().submit([task = std::move(task), here]() mutable {
+    Context *outer = enter(here);
+    {
+      F run = std::move(task);
+      run();
+    }
+    flush_output();
+    merge_profile();
+    if (Pool::on_worker())
+      registry.orphan();
+    enter(outer);
+    here->threads_running.fetch_sub(1, std::memory_order_release);
+    pool().notify();
+  });
+}
+
+// Calls body(begin, end) for chunks of [0, n) as tasks, and returns when all
+// are done.
+template <typename F>
+void parallel_chunks(size_t n, const F &body) {
+  size_t chunks = std::min(n, 4 * pool().size());
+  std::atomic<size_t> left = chunks;
+  for (size_t c = 0; c < chunks; c++) {
+    size_t begin = n * c / chunks, end = n * (c + 1) / chunks;
+    submit_task([&body, &left, begin, end] {
+      body(begin, end);
+      left.fetch_sub(1, std::memory_order_release);
+    });
+  }
+  pool().wait([&] { return left.load(std::memory_order_acquire) == 0; });
+}
+
+}  // namespace
+
+// The result of (spawn EXPR ..), once done.
+struct Future {
+  std::atomic<bool> done = false;
+  snode value;
+};
+
+// Vectors
+//
+// An f64vec or i32vec keeps its elements unboxed in one block, aligned for
+// vector loads and shared by every copy of the node, since it never changes.
+
+template <typename T>
+struct AlignedAllocator {
+  typedef T value_type;
+  static constexpr std::align_val_t kAlignment{64};
+
+  AlignedAllocator() = default;
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(::operator new(n * sizeof(T), kAlignment));
+  }
+  void deallocate(T *p, size_t) { ::operator delete(p, kAlignment); }
+
+  template <typename U>
+  bool operator==(const AlignedAllocator<U> &) const {
+    return true;
+  }
+};
+
+template <typename T>
+using Elements = std::vector<T, AlignedAllocator<T>>;
+
+template <typename T>
+constexpr decltype(Node::type) vector_type =
+    std::is_same_v<T, double> ? Node::T_F64VEC : Node::T_I32VEC;
+
+template <typename T>
+const Elements<T> &elements_of(const Node &n) {
+  return *static_cast<const Elements<T> *>(n.v_object.get());
+}
+
+template <typename T>
+snode make_vector(std::shared_ptr<const Elements<T>> items) {
+  Node n;
+  n.type = vector_type<T>;
+  n.v_object = std::const_pointer_cast<Elements<T>>(std::move(items));
+  return make_snode(n);
+}
+
+template <typename T>
+snode make_vector(Elements<T> items) {
+  return make_vector(std::make_shared<const Elements<T>>(std::move(items)));
+}
+
+String::String(std::string_view s) : size_(s.size()) {
+  if (size_ > kInline) {
+    chunk_ = make_chunk(size_);
+    memcpy(chunk_->bytes(), s.data(), size_);
+    chunk_->used.store(size_, std::memory_order_relaxed);
+  } else {
+    memcpy(inline_, s.data(), size_);
+  }
+}
+
+String::Chunk *String::make_chunk(size_t capacity) {
+  void *p = ::operator new(sizeof(Chunk) + capacity);
+  Chunk *chunk = new (p) Chunk;
+  chunk->refs.store(1, std::memory_order_relaxed);
+  chunk->used.store(0, std::memory_order_relaxed);
+  chunk->capacity = capacity;
+  chunk->text = chunk->bytes();
+  return chunk;
+}
+
+void String::release(Chunk *chunk) {
+  if (chunk->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    chunk->~Chunk();
+    ::operator delete(chunk);
+  }
+}
+
+String String::borrow(std::string_view bytes,
+                      std::shared_ptr<const void> owner) {
+  if (bytes.size() <= kInline)
+    return String(bytes);
+  String s;
+  s.chunk_ = make_chunk(0);  // so nothing is appended in place
+  s.chunk_->text = bytes.data();
+  s.chunk_->owner = std::move(owner);
+  s.chunk_->used.store(bytes.size(), std::memory_order_relaxed);
+  s.size_ = bytes.size();
+  return s;
+}
+
+String String::append(std::string_view tail) const {
+  size_t size = size_ + tail.size();
+  if (size <= kInline) {
+    String ret;
+    memcpy(ret.inline_, inline_, size_);
+    memcpy(ret.inline_ + size_, tail.data(), tail.size());
+    ret.size_ = size;
+    return ret;
+  }
+  String ret;
+  size_t end = size_;
+  // Whoever first appends at the end of what the buffer holds can do it in
+  // place; bytes before the end are never written, so this String and any
+  // other sharing them still read what they did.
+  if (size_ > kInline && size <= chunk_->capacity &&
+      chunk_->used.compare_exchange_strong(end, size,
+                                           std::memory_order_acq_rel)) {
+    memcpy(chunk_->bytes() + size_, tail.data(), tail.size());
+    ret.chunk_ = chunk_;
+    chunk_->refs.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    ret.chunk_ = make_chunk(2 * size);
+    memcpy(ret.chunk_->bytes(), data(), size_);
+    memcpy(ret.chunk_->bytes() + size_, tail.data(), tail.size());
+    ret.chunk_->used.store(size, std::memory_order_relaxed);
+  }
+  ret.size_ = size;
+  return ret;
+}
+
+String intern(std::string_view s) {
+  if (s.size() <= String::kInline)
+    return String(s);
+  static std::mutex mutex;
+  // Keys point into the interned Strings' buffers, which never move.
+  static HashMap<std::string_view, String> interned;
+  // Always locked: every interpreter interns here, each maybe on its own
+  // thread, which threads_active of one does not count.
+  Lock lock(mutex);
+  if (String *found = interned.find(s))
+    return *found;
+  String string(s);
+  interned.emplace(string, string);
+  return string;
+}
+
+Node::Node() : type(T_NIL) {}
+Node::Node(int a) : type(T_INT), v_int(a) {}
+Node::Node(double a) : type(T_DOUBLE), v_double(a) {}
+Node::Node(bool a) : type(T_BOOL), v_bool(a) {}
+Node::Node(String a) : type(T_STRING), v_string(std::move(a)) {}
+Node::Node(const std::vector<snode> &a) : type(T_LIST), v_list(a) {}
+Node::Node(builtin a) : type(T_BUILTIN), v_builtin(a) {}
+snode make_special(builtin a) {
+  Node n;
+  n.type = Node::T_SPECIAL;
+  n.v_builtin = a;
+  return make_snode(n);
+}
+
+snode node_true(make_snode(Node(true)));
+snode node_false(make_snode(Node(false)));
+snode node_0(make_snode(Node(0)));
+snode node_1(make_snode(Node(1)));
+snode nil(make_snode(Node()));
+
+snode builtin_prn(std::vector<snode> &args, senvironment &env);
+snode special_begin(std::vector<snode> &raw_args, senvironment &env);
+namespace {
+Code &ensure_code(Node &func);
+}  // namespace
+
+inline int Node::to_int() {
+  switch (type) {
+    case T_INT:
+      return v_int;
+    case T_DOUBLE:
+      return (int)v_double;
+    case T_BOOL:
+      return (int)v_bool;
+    case T_STRING:
+      return atoi(v_string.str().c_str());
+    default:
+      return 0;
+  }
+}
+
+inline double Node::to_double() {
+  switch (type) {
+    case T_INT:
+      return v_int;
+    case T_DOUBLE:
+      return v_double;
+    case T_BOOL:
+      return v_bool;
+    case T_STRING:
+      return atof(v_string.str().c_str());
+    default:
+      return 0.0;
+  }
+}
+namespace {
+
+void write_number(std::string &out, int x) {
+  char buf[16];
+  out.append(buf, std::to_chars(buf, buf + sizeof(buf), x).ptr);
+}
+
+void write_number(std::string &out, double x) {  // as "%.16g"
+  char buf[32];
+  out.append(buf, std::to_chars(buf, buf + sizeof(buf), x,
+                                std::chars_format::general, 16)
+                      .ptr);
+}
+
+template <typename T>
+void write_vector(std::string &out, const char *prefix,
+                  const Elements<T> &items) {
+  out += prefix;
+  for (size_t i = 0; i < items.size(); i++) {
+    if (i > 0)
+      out += ' ';
+    write_number(out, items[i]);
+  }
+  out += ')';
+}
+
+void write_seq(std::string &out, const snode &seq);  // as the list it makes
+
+}  // namespace
+
+inline std::string Node::to_string() {
+  std::string ret;
+  write_to(ret);
+  return ret;
+}
+
+// Formats straight into out, lists and all, so that printing makes no
+// strings of its own.
+void Node::write_to(std::string &out) {
+  char buf[32];
+  switch (type) {
+    case T_NIL:
+      break;
+    case T_INT:
+      write_number(out, v_int);
+      break;
+    case T_BUILTIN:
+    case T_SPECIAL:
+      out.append(buf, static_cast<size_t>(snprintf(
+                          buf, sizeof(buf), "#<builtin:%p>", v_builtin)));
+      break;
+    case T_FUTURE:
+      out += "#<future>";
+      break;
+    case T_FILE:
+      out += "#<file>";
+      break;
+    case T_SEQ:
+      write_seq(out, make_snode(*this));
+      break;
+    case T_CONS:
+    case T_PVEC: {
+      out += '(';
+      bool first = true;
+      each_persistent(*this, [&](const snode &item) {
+        if (!first)
+          out += ' ';
+        first = false;
+        item->write_to(out);
+      });
+      out += ')';
+      break;
+    }
+    case T_F64VEC:
+      write_vector(out, "#f64(", elements_of<double>(*this));
+      break;
+    case T_I32VEC:
+      write_vector(out, "#i32(", elements_of<int32_t>(*this));
+      break;
+    case T_DICT: {
+      out += "#dict(";
+      bool first = true;
+      for (auto &[key, value] : dict_of(*this)) {
+        if (!first)
+          out += ' ';
+        first = false;
+        key->write_to(out);
+        out += ' ';
+        value->write_to(out);
+      }
+      out += ')';
+      break;
+    }
+    case T_DOUBLE:
+      write_number(out, v_double);
+      break;
+    case T_BOOL:
+      out += v_bool ? "true" : "false";
+      break;
+    case T_STRING:
+    case T_SYMBOL:
+      out += std::string_view(v_string);
+      break;
+    case T_FN:
+    case T_LIST: {
+      out += '(';
+      for (std::vector<snode>::iterator iter = v_list.begin();
+           iter != v_list.end(); iter++) {
+        if (iter != v_list.begin())
+          out += ' ';
+        (*iter)->write_to(out);
+      }
+      out += ')';
+      break;
+    }
+    default:;
+  }
+}
+inline std::string Node::type_str() {
+  switch (type) {
+    case T_NIL:
+      return "nil";
+    case T_INT:
+      return "int";
+    case T_DOUBLE:
+      return "double";
+    case T_BOOL:
+      return "bool";
+    case T_STRING:
+      return "std::string";
+    case T_SYMBOL:
+      return "symbol";
+    case T_LIST:
+      return "list";
+    case T_BUILTIN:
+      return "builtin";
+    case T_SPECIAL:
+      return "special";
+    case T_FN:
+      return "fn";
+    case T_THREAD:
+      return "std::thread";
+    case T_FUTURE:
+      return "future";
+    case T_F64VEC:
+      return "f64vec";
+    case T_I32VEC:
+      return "i32vec";
+    case T_DICT:
+      return "dict";
+    case T_FILE:
+      return "file";
+    case T_SEQ:
+      return "seq";
+    case T_CONS:
+      return "cons";
+    case T_PVEC:
+      return "pvec";
+    default:
+      return "invalid type";
+  }
+}
+inline std::string Node::str_with_type() {
+  return to_string() + " : " + type_str();
+}
+
+inline double rand_double() {
+  return (double)rand() / ((double)RAND_MAX + 1.0);
+}
+
+// Splits source into tokens, which are views into it: parentheses, atoms
+// (numbers and symbols) and the contents of strings, escapes and all.
+class Lexer {
+ public:
+  enum Kind { END, OPEN, CLOSE, STRING, ATOM };
+  struct Token {
+    Kind kind;
+    std::string_view text;
+  };
+
+  explicit Lexer(std::string_view s) : s(s) {}
+
+  Token next() {
+    while (pos < s.size()) {
+      char c = s[pos];
+      if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+        pos++;
+      } else if (comment_at(pos)) {  // end-of-line comment: ; or #!
+        comment_start = pos;
+        while (pos < s.size() && s[pos] != '\n')
+          pos++;
+        open_comment = pos == s.size();
+      } else if (c == '"') {
+        return string();
+      } else if (c == '(') {
+        depth++;
+        pos++;
+        return {OPEN, s.substr(pos - 1, 1)};
+      } else if (c == ')') {
+        depth--;
+        pos++;
+        return {CLOSE, s.substr(pos - 1, 1)};
+      } else {
+        size_t start = pos;
+        while (pos < s.size() && !ends_atom(pos))
+          pos++;
+        return {ATOM, s.substr(start, pos - start)};
+      }
+    }
+    return {END, {}};
+  }
+
+  // Number of parentheses and quotations left open by the tokens so far.
+  int unclosed() const { return depth + (open_string ? 1 : 0); }
+
+  size_t position() const { return pos; }  // in s, of what is lexed next
+
+  // Continues lexing `s`, which has what was lexed so far as a prefix. A string
+  // or comment left open is lexed again.
+  void resume(std::string_view more) {
+    s = more;
+    if (open_string) {
+      pos = string_start;
+      open_string = false;
+    } else if (open_comment) {
+      pos = comment_start;
+      open_comment = false;
+    }
+  }
+
+  // Lexes `more` from `at` on, outside of any list.
+  void restart(std::string_view more, size_t at) {
+    *this = Lexer(more);
+    pos = at;
+  }
+
+  // Continues in `more`, which is what was lexed so far less its first `n`
+  // bytes, none of which are to be lexed again.
+  void drop(std::string_view more, size_t n) {
+    s = more;
+    pos -= n;
+    string_start -= n;
+    comment_start -= n;
+  }
+
+ private:
+  bool comment_at(size_t i) const {
+    return s[i] == ';' || (s[i] == '#' && i + 1 < s.size() && s[i + 1] == '!');
+  }
+
+  bool ends_atom(size_t i) const {
+    char c = s[i];
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '"' ||
+           c == '(' || c == ')' || comment_at(i);
+  }
+
+  Token string() {
+    string_start = pos++;
+    size_t start = pos;
+    while (pos < s.size() && s[pos] != '"')
+      pos += s[pos] == '\\' ? 2 : 1;
+    if (pos >= s.size()) {  // runs to the end
+      open_string = true;
+      pos = s.size();
+      return {STRING, s.substr(start)};
+    }
+    return {STRING, s.substr(start, pos++ - start)};
+  }
+
+  std::string_view s;
+  size_t pos = 0;
+  int depth = 0;
+  bool open_string = false;
+  size_t string_start = 0;
+  bool open_comment = false;  // runs to the end of s
+  size_t comment_start = 0;
+};
+
+// The string a string token stands for.
+std::string unescape(std::string_view text) {
+  std::string ret;
+  ret.reserve(text.size());
+  for (size_t i = 0; i < text.size(); i++) {
+    char c = text[i];
+    if (c == '\\' && i + 1 < text.size()) {
+      c = text[++i];
+      if (c == 'r')
+        c = '\r';
+      else if (c == 'n')
+        c = '\n';
+      else if (c == 't')
+        c = '\t';
+    }
+    ret += c;
+  }
+  return ret;
+}
+
+std::vector<std::string> tokenize(std::string_view s) {
+  std::vector<std::string> ret;
+  Lexer lexer(s);
+  for (Lexer::Token tok = lexer.next(); tok.kind != Lexer::END;
+       tok = lexer.next()) {
+    if (tok.kind == Lexer::STRING)
+      ret.push_back('"' + unescape(tok.text));
+    else
+      ret.emplace_back(tok.text);
+  }
+  return ret;
+}
+
+namespace {
+
+// Symbols are interned in shards, each with its lock, and named by code from
+// a table of fixed-size chunks, which never move once made, so names are read
+// without locking. A code is only ever seen after its name was written. The
+// symbols are those of every interpreter, so a shard is locked even when
+// threads_active is false: other interpreters may be running on other threads.
+constexpr size_t kSymbolShards = 16;
+constexpr size_t kNameChunkSize = 4096;
+constexpr size_t kNameChunks = 4096;
+
+struct alignas(64) SymbolShard {
+  std::mutex mutex;
+  HashMap<std::string_view, size_t> codes;  // views into names
+};
+
+SymbolShard symbol_shards[kSymbolShards];
+std::atomic<std::string *> name_chunks[kNameChunks];
+std::atomic<size_t> symbol_count;
+
+std::string &name_slot(size_t code) {
+  std::atomic<std::string *> &chunk = name_chunks[code / kNameChunkSize];
+  std::string *names = chunk.load(std::memory_order_acquire);
+  if (!names) {
+    std::string *made = new std::string[kNameChunkSize];
+    if (chunk.compare_exchange_strong(names, made))
+      names = made;
+    else
+      delete[] made;
+  }
+  return names[code % kNameChunkSize];
+}
+
+}  // namespace
+
+size_t ToCode(std::string_view name) {
+  SymbolShard &shard =
+      symbol_shards[std::hash<std::string_view>()(name) % kSymbolShards];
+  Lock lock(shard.mutex);
+  if (size_t *found = shard.codes.find(name))
+    return *found;
+  size_t code = symbol_count.fetch_add(1);
+  assert(code < kNameChunkSize * kNameChunks && "too many symbols");
+  std::string &slot = name_slot(code);
+  slot = name;
+  shard.codes.emplace(slot, code);
+  return code;
+}
+
+const std::string &SymbolName(size_t code) { return name_slot(code); }
+
+class Parser {
+ private:
+  Lexer lexer;
+
+  static bool is_number(std::string_view tok) {
+    return isdigit(tok[0]) ||
+           (tok[0] == '-' && tok.length() >= 2 && isdigit(tok[1]));
+  }
+
+  static snode number(std::string_view tok) {
+    const char *end = tok.data() + tok.size();
+    if (tok.find('.') != std::string_view::npos ||
+        tok.find('e') != std::string_view::npos) {  // double
+      double d = 0;
+      std::from_chars(tok.data(), end, d);
+      return make_snode(d);
+    }
+    int i = 0;
+    std::from_chars(tok.data(), end, i);
+    return make_snode(i);
+  }
+
+ public:
+  Parser(std::string_view s) : lexer(s) {}
+
+  // Parses up to the end of the list being parsed, or of the input.
+  std::vector<snode> parse() {
+    std::vector<snode> ret;
+    for (;;) {
+      Lexer::Token tok = lexer.next();
+      switch (tok.kind) {
+        case Lexer::END:
+        case Lexer::CLOSE:
+          return ret;
+        case Lexer::OPEN:
+          ret.push_back(make_snode(parse()));
+          break;
+        case Lexer::STRING:
+          ret.push_back(make_snode(intern(unescape(tok.text))));
+          break;
+        case Lexer::ATOM: {
+          if (tok.text[0] < 0)
+            return ret;  // MSVC bug fix
+          if (is_number(tok.text)) {
+            ret.push_back(number(tok.text));
+            break;
+          }
+          Node n;  // symbol
+          n.type = Node::T_SYMBOL;
+          n.v_string = intern(tok.text);
+          n.code = ToCode(tok.text);
+          ret.push_back(make_snode(n));
+          break;
+        }
+      }
+    }
+  }
+};
+
+std::vector<snode> parse(std::string_view s) { return Parser(s).parse(); }
+
+struct Reader::State {
+  std::string buffer;  // from the start of the form being read
+  Lexer lexer{buffer};
+  size_t form_start = 0;  // in buffer, after the last form complete
+  bool atom = false;      // the form being read is an atom run to the end
+  std::deque<std::string> forms;  // complete and not yet handed out
+};
+
+Reader::Reader() : state(std::make_unique<State>()) {}
+Reader::~Reader() = default;
+
+void Reader::feed(std::string_view piece) {
+  State &st = *state;
+  st.buffer += piece;
+  Lexer &lexer = st.lexer;
+  lexer.resume(st.buffer);
+  st.atom = false;
+  for (;;) {
+    size_t before = lexer.position();
+    Lexer::Kind kind = lexer.next().kind;
+    if (kind == Lexer::END)
+      break;
+    int unclosed = lexer.unclosed();
+    if (unclosed > 0)
+      continue;
+    size_t end = lexer.position();
+    if (kind == Lexer::ATOM && end == st.buffer.size()) {
+      // It may go on in the next piece.
+      lexer.restart(st.buffer, before);
+      st.atom = true;
+      break;
+    }
+    st.forms.push_back(st.buffer.substr(st.form_start, end - st.form_start));
+    st.form_start = end;
+    if (unclosed < 0)  // by a stray ), which ends the form before
+      lexer.restart(st.buffer, end);
+  }
+  // Keep only what is still to be read.
+  if (lexer.unclosed() == 0 && st.form_start > 0) {
+    st.buffer.erase(0, st.form_start);
+    lexer.drop(st.buffer, st.form_start);
+    st.form_start = 0;
+  }
+}
+
+bool Reader::next(std::string &form) {
+  if (state->forms.empty())
+    return false;
+  form = std::move(state->forms.front());
+  state->forms.pop_front();
+  return true;
+}
+
+bool Reader::partial() const {
+  return state->atom || state->lexer.unclosed() > 0;
+}
+
+std::string Reader::finish() {
+  std::string rest = state->buffer.substr(state->form_start);
+  *state = State();
+  return rest;
+}
+
+environment::environment() : outer(NULL) {}
+environment::environment(senvironment outer) : outer(outer) {}
+
+Value *environment::slot(size_t code) {
+  if (global) {
+    if (code < slots.size() && slots[code])
+      return &slots[code];
+  } else if (this->code) {
+    std::vector<size_t> &locals = this->code->locals;
+    for (size_t i = 0; i < locals.size(); i++) {
+      if (locals[i] == code)
+        return slots[i] ? &slots[i] : nullptr;
+    }
+  }
+  return nullptr;
+}
+
+snode *environment::find(size_t code) {
+  // Whoever asks by name may update the node in place, so box it.
+  if (Value *found = slot(code))
+    return &found->boxed();
+  if (global)
+    return nullptr;
+  return env.find(code);
+}
+
+snode environment::get(size_t code) {
+  for (environment *e = this; e != NULL; e = e->outer.get()) {
+    // find may box the slot it finds.
+    Lock frame_lock;
+    WriteLock global_lock;
+    if (e->global)
+      global_lock = write_global(code);
+    else
+      frame_lock = lock_env(e);
+    if (snode *found = e->find(code))
+      return *found;
+  }
+  return nil;
+}
+
+snode environment::get(snode &k) { return get(k->code); }
+
+snode environment::set(size_t code, const snode &v) {
+  if (global) {
+    grow_globals(*this, code);
+    WriteLock lock = write_global(code);
+    slots[code] = v;
+    return v;
+  }
+  Lock lock = lock_env(this);
+  if (this->code) {
+    std::vector<size_t> &locals = this->code->locals;
+    for (size_t i = 0; i < locals.size(); i++) {
+      if (locals[i] == code) {
+        slots[i] = v;
+        return v;
+      }
+    }
+  }
+  return env[code] = v;
+}
+
+snode environment::set(snode &k, snode &v) { return set(k->code, v); }
+
+snode Value::to_snode() const {
+  switch (tag) {
+    case INT:
+      return make_snode(v_int);
+    case DOUBLE:
+      return make_snode(v_double);
+    case BOOL:
+      return make_snode(v_bool);
+    case BOXED:
+      return box;
+    default:
+      return make_snode();
+  }
+}
+
+snode &Value::boxed() {
+  if (tag != BOXED) {
+    box = to_snode();
+    tag = BOXED;
+  }
+  return box;
+}
+
+snode fn(snode n, std::shared_ptr<environment> outer_env) {
+  snode n2(n);
+  n2->type = Node::T_FN;
+  n2->outer_env = outer_env;
+  return n2;
+}
+
+// A macro as defmacro compiles it. Its parameters are resolved to argument
+// indices and its body turned into a plan, a preorder walk of the body that
+// expansion follows to copy it.
+struct MacroStep {
+  enum Kind : uint8_t {
+    ATOM,   // a node of the body, used as is
+    PARAM,  // argument `index`
+    REST,   // the arguments after the fixed ones, spliced in (...)
+    BEGIN,  // start of a list
+    END,    // end of the list begun last
+  } kind;
+  uint32_t index;
+  snode atom;
+};
+
+struct Macro {
+  size_t nparams = 0;  // before ..., if any
+  bool variadic = false;
+  std::vector<MacroStep> plan;
+};
+
+std::shared_ptr<const Macro> find_macro(const Node &head) {
+  if (head.type != Node::T_SYMBOL)
+    return nullptr;
+  Context &here = *context;
+  ReadLock lock = lock_shared_state<ReadLock>(here.macros_mutex);
+  return head.code < here.macros.size() ? here.macros[head.code] : nullptr;
+}
+
+const size_t ellipsis_code = ToCode("...");
+
+void plan_macro(Macro &macro, const std::vector<size_t> &params,
+                const snode &n) {
+  std::vector<MacroStep> &plan = macro.plan;
+  if (n->type == Node::T_LIST) {
+    plan.push_back({MacroStep::BEGIN, 0, nullptr});
+    for (const snode &b : n->v_list) {
+      if (macro.variadic && b->type == Node::T_SYMBOL &&
+          b->code == ellipsis_code)
+        plan.push_back({MacroStep::REST, 0, nullptr});
+      else
+        plan_macro(macro, params, b);
+    }
+    plan.push_back({MacroStep::END, 0, nullptr});
+    return;
+  }
+
+  if (n->type == Node::T_SYMBOL) {
+    if (macro.variadic && n->code == ellipsis_code) {
+      // Outside a list, ... stands for the list of the rest.
+      plan.push_back({MacroStep::BEGIN, 0, nullptr});
+      plan.push_back({MacroStep::REST, 0, nullptr});
+      plan.push_back({MacroStep::END, 0, nullptr});
+      return;
+    }
+    // The last of parameters of the same name wins.
+    for (size_t i = params.size(); i-- > 0;) {
+      if (params[i] == n->code) {
+        plan.push_back({MacroStep::PARAM, static_cast<uint32_t>(i), nullptr});
+        return;
+      }
+    }
+  }
+  plan.push_back({MacroStep::ATOM, 0, n});
+}
+
+uint64_t fnv1a(std::string_view bytes, uint64_t h = kFnvOffset) {
+  for (char c : bytes) {
+    h ^= static_cast<uint8_t>(c);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+template <typename T>
+uint64_t fnv1a_of(const T &x, uint64_t h) {
+  return fnv1a(std::string_view(reinterpret_cast<const char *>(&x), sizeof(x)),
+               h);
+}
+
+// Hashes the source form `n` into `h`, with symbols by name.
+uint64_t hash_node(const Node &n, uint64_t h) {
+  h = fnv1a_of(n.type, h);
+  switch (n.type) {
+    case Node::T_INT:
+      return fnv1a_of(n.v_int, h);
+    case Node::T_DOUBLE:
+      return fnv1a_of(n.v_double, h);
+    case Node::T_BOOL:
+      return fnv1a_of(n.v_bool, h);
+    case Node::T_STRING:
+      return fnv1a(n.v_string, h);
+    case Node::T_SYMBOL:
+      return fnv1a(SymbolName(n.code), h);
+    case Node::T_LIST:
+      for (const snode &item : n.v_list)
+        h = hash_node(*item, h);
+      return fnv1a(")", h);
+    default:
+      return h;
+  }
+}
+
+// Collects the defmacro forms this thread runs, if set.
+thread_local std::vector<snode> *macro_log = nullptr;
+
+uint64_t current_macro_state() {
+  ReadLock lock = lock_shared_state<ReadLock>(context->macros_mutex);
+  return context->macro_state;
+}
+
+// (defmacro NAME (PARAM ..) BODY)
+void define_macro(const snode &n) {
+  std::vector<snode> &form = n->v_list;
+  if (macro_log)
+    macro_log->push_back(n);
+
+  auto macro = std::make_shared<Macro>();
+  std::vector<size_t> params;
+  for (const snode &param : form[2]->v_list) {
+    if (param->code == ellipsis_code) {
+      macro->variadic = true;
+      break;
+    }
+    params.push_back(param->code);
+  }
+  macro->nparams = params.size();
+  plan_macro(*macro, params, form[3]);
+
+  size_t code = form[1]->code;
+  Context &here = *context;
+  WriteLock lock = lock_shared_state<WriteLock>(here.macros_mutex);
+  here.macro_state = hash_node(*n, here.macro_state);
+  if (code >= here.macros.size())
+    here.macros.resize(code + 1);
+  here.macros[code] = std::move(macro);
+}
+
+// Expands `form`, a call of `macro`. Arguments are used as they are, and
+// missing ones are nil.
+snode macroexpand(const Macro &macro, const std::vector<snode> &form) {
+  std::vector<snode> stack;
+  std::vector<size_t> starts;  // of the lists being built, on stack
+  for (const MacroStep &step : macro.plan) {
+    switch (step.kind) {
+      case MacroStep::ATOM:
+        stack.push_back(step.atom);
+        break;
+      case MacroStep::PARAM:
+        stack.push_back(step.index + 1 < form.size() ? form[step.index + 1]
+                                                     : nil);
+        break;
+      case MacroStep::REST:
+        for (size_t i = macro.nparams + 1; i < form.size(); i++)
+          stack.push_back(form[i]);
+        break;
+      case MacroStep::BEGIN:
+        starts.push_back(stack.size());
+        break;
+      case MacroStep::END: {
+        auto begin = stack.begin() + static_cast<ptrdiff_t>(starts.back());
+        snode list = make_snode(std::vector<snode>());
+        list->v_list.assign(std::make_move_iterator(begin),
+                            std::make_move_iterator(stack.end()));
+        stack.erase(begin, stack.end());
+        starts.pop_back();
+        stack.push_back(std::move(list));
+        break;
+      }
+    }
+  }
+  return stack.back();
+}
+
+snode compile(snode &n) {
+  switch (n->type) {
+    case Node::T_LIST:  // function (FUNCTION ARGUMENT ..)
+    {
+      if (n->v_list.size() == 0)
+        return n;
+      static const size_t defmacro_code = ToCode("defmacro");
+      static const size_t quote_code = ToCode("quote");
+      snode func = compile(n->v_list[0]);
+      if (func->type == Node::T_SYMBOL &&
+          func->code ==
+              defmacro_code) {  // (defmacro add (a b) (+ a b)) ; define macro
+        define_macro(n);
+        return nil;
+      } else if (func->type == Node::T_SYMBOL &&
+                 func->code == quote_code) {  // ignore macro
+        return n;
+      } else {
+        if (std::shared_ptr<const Macro> macro = find_macro(*func)) {
+          snode expanded = macroexpand(*macro, n->v_list);
+          return compile(expanded);
+        } else {
+          std::vector<snode> r;
+          for (std::vector<snode>::iterator i = n->v_list.begin();
+               i != n->v_list.end(); i++) {
+            r.push_back(compile(*i));
+          }
+          return make_snode(r);
+        }
+      }
+    }
+    default:
+      return n;
+  }
+}
+
+snode eval(snode &n, senvironment &env) {
+  switch (n->type) {
+    case Node::T_SYMBOL: {
+      // snode n2 = env.get(n);
+      // if (n2->type != Node::T_NIL) {
+      //	return n2;
+      // }
+      // else {
+      //	cerr << "Unknown variable: " << n->v_string << endl;
+      //	return nil;
+      // }
+      return env->get(n);
+    }
+    case Node::T_LIST:  // function (FUNCTION ARGUMENT ..)
+    {
+      auto &list = n->v_list;
+      if (list.empty())
+        return nil;
+
+      snode func = eval(n->v_list[0], env);
+      switch (func->type) {
+        case Node::T_SPECIAL: {
+          return func->v_builtin(n->v_list, env);
+        }
+        case Node::T_BUILTIN:
+        case Node::T_FN: {
+          // evaluate arguments
+          std::vector<snode> args;
+          args.reserve(n->v_list.size() - 1);
+          for (auto i = n->v_list.begin() + 1; i != n->v_list.end(); i++) {
+            args.push_back(eval(*i, env));
+          }
+          // A builtin runs in the caller's environment, as it does from the
+          // VM; a fn gets its own frame there.
+          return apply(func, args, env);
+        }
+        default:
+          return nil;
+      }  // end switch (func->type)
+    }
+    default:
+      return n;
+  }
+}
+
+std::vector<snode> compile_all(std::vector<snode> &lst) {
+  std::vector<snode> compiled;
+  for (size_t i = 0; i < lst.size(); i++) {
+    compiled.push_back(compile(lst[i]));
+  }
+  return compiled;
+}
+
+snode eval_all(std::vector<snode> &lst) {
+  snode ret = nil;
+  for (snode &n : lst) {
+    // Lower each form right before running it so specials bound by earlier
+    // forms (eg. `(def define def)`) are compiled as specials.
+    scode code = lower(n);
+    ret = run(code, context->globals);
+    if (gc_due())
+      collect();
+  }
+  return ret;
+}
+
+void print_names(std::vector<std::string> names) {
+  sort(names.begin(), names.end());
+  int i = 0;
+  for (const std::string &name : names) {
+    printf(" %s", name.c_str());
+    i++;
+    if (i % 10 == 0)
+      puts("");
+  }
+  puts("");
+}
+
+void print_logo() {
+  printf(
+      "Paren %s (C) 2013-2014 Kim, Taegyoon "
+      "(https://bitbucket.org/ktg/paren)\n",
+      PAREN_VERSION);
+  printf("Predefined Symbols:");
+  std::vector<std::string> v;
+  for (size_t code = 0; code < context->globals->slots.size(); code++) {
+    if (context->globals->slots[code])
+      v.push_back(SymbolName(code));
+  }
+  sort(v.begin(), v.end());
+  for (std::vector<std::string>::iterator iter = v.begin(); iter != v.end();
+       iter++) {
+    printf(" %s", (*iter).c_str());
+  }
+  puts("");
+
+  puts("Macros:");
+  std::vector<std::string> macro_names;
+  for (size_t code = 0; code < context->macros.size(); code++) {
+    if (context->macros[code])
+      macro_names.push_back(SymbolName(code));
+  }
+  print_names(macro_names);
+}
+
+void prompt() {
+  flush_output();
+  printf("> ");
+}
+
+void prompt2() {
+  flush_output();
+  printf("  ");
+}
+
+snode eval_string(std::string &s) {
+  std::vector<snode> vec = parse(s);
+  std::vector<snode> compiled = compile_all(vec);
+  return eval_all(compiled);
+}
+
+snode eval_string(const char *s) {
+  std::string s2(s);
+  return eval_string(s2);
+}
+
+inline void eval_print(std::string &s) {
+  std::string result = eval_string(s)->str_with_type();
+  flush_output();
+  puts(result.c_str());
+}
+
+// read-eval-print loop
+void repl() {
+  Reader reader;
+  std::string line;
+  while (true) {
+    if (reader.partial())
+      prompt2();
+    else
+      prompt();
+    if (!getline(std::cin, line)) {  // EOF
+      std::string rest = reader.finish();
+      eval_print(rest);
+      return;
+    }
+    line += '\n';
+    reader.feed(line);
+    for (std::string form; reader.next(form);)
+      eval_print(form);
+  }
+}
+
+void serve(int in, int out) {
+  Reader reader;
+  std::string result;
+  char buf[64 * 1024];
+  for (;;) {
+    ssize_t n = read(in, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n > 0) {
+      reader.feed(std::string_view(buf, static_cast<size_t>(n)));
+    } else if (reader.partial()) {
+      reader.feed("\n");  // ends an atom
+    }
+    for (std::string form; reader.next(form);) {
+      result = eval_string(form)->to_string();
+      result += '\n';
+      flush_output();  // what it printed comes first
+      fflush(stdout);
+      for (size_t done = 0; done < result.size();) {
+        ssize_t written =
+            write(out, result.data() + done, result.size() - done);
+        if (written < 0 && errno == EINTR)
+          continue;
+        if (written <= 0)
+          return;
+        done += static_cast<size_t>(written);
+      }
+    }
+    if (n <= 0)
+      return;
+  }
+}
+
+snode get(const char *name) {
+  std::string s(name);
+  return context->globals->get(ToCode(s));
+}
+
+void set(const char *name, Node value) {
+  std::string s(name);
+  context->globals->set(ToCode(s), make_snode(value));
+}
+
+// extracts characters from filename and stores them into str
+bool slurp(std::string_view filename, std::string &str) {
+  int fd = open(std::string(filename).c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  // Read straight into str: one more byte than the file has, to see the end
+  // without growing it.
+  struct stat st;
+  bool sized = fstat(fd, &st) == 0 && st.st_size > 0;
+  str.resize(sized ? static_cast<size_t>(st.st_size) + 1 : 4096);
+  size_t got = 0;
+  for (;;) {
+    if (got == str.size())
+      str.resize(2 * str.size());
+    ssize_t n = read(fd, str.data() + got, str.size() - got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    got += static_cast<size_t>(n);
+  }
+  close(fd);
+  str.resize(got);
+  return true;
+}
+
+// Opposite of slurp. Writes str to filename.
+int spit(std::string_view filename, std::string_view str) {
+  std::ofstream output(filename.data());
+  if (!output)
+    return -1;
+
+  output << str;
+  return static_cast<int>(str.size());
+}
+
+namespace {
+
+// A file mapped into memory, read-only.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      size_t length = static_cast<size_t>(st.st_size);
+      void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data = static_cast<const char *>(p);
+        size = length;
+      }
+    }
+    close(fd);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() {
+    if (data)
+      munmap(const_cast<char *>(data), size);
+  }
+
+  explicit operator bool() const { return data != nullptr; }
+  std::string_view view() const { return {data, size}; }
+
+ private:
+  const char *data = nullptr;
+  size_t size = 0;
+};
+
+// An open file; see builtin_open. Copies of its node share it.
+struct File {
+  std::mutex mutex;
+  FILE *stream = nullptr;  // null once closed
+  std::unique_ptr<char[]> buffer;
+  char *line = nullptr;  // for getline
+  size_t line_size = 0;
+
+  ~File() {
+    if (stream)
+      fclose(stream);
+    free(line);
+  }
+};
+
+constexpr size_t kFileBuffer = 256 * 1024;
+constexpr size_t kMapSlurp = 1024 * 1024;  // files slurp maps rather than reads
+
+File *file_of(const snode &n) {
+  return n->type == Node::T_FILE ? static_cast<File *>(n->v_object.get())
+                                 : nullptr;
+}
+
+snode as_list(const snode &n, senvironment &env);
+
+// What a name, a parameter or a list keeps of `n`: for a sequence, the list
+// it stands for, so it is gone through once, then and there, however often
+// it is used after. Only a sequence on its way into a builtin stays lazy.
+snode kept(const snode &n) {
+  if (n->type == Node::T_SEQ)
+    return as_list(n, context->globals);
+  return n;
+}
+
+}  // namespace
+
+// A copy of `n` as def and set store it.
+snode copy_node(const snode &n) {
+  if (n->type == Node::T_SEQ)
+    return kept(n);  // a list of its own already
+  Lock lock = lock_node(n.get());
+  return make_snode(*n);
+}
+
+snode special_def(
+    std::vector<snode> &raw_args,
+    senvironment &env) {  // (def SYMBOL VALUE) ; set in the current environment
+  snode value = copy_node(eval(raw_args[2], env));
+  return env->set(raw_args[1], value);
+}
+
+snode special_if(std::vector<snode> &raw_args,
+                 senvironment &env) {  // (if CONDITION THEN_EXPR {ELSE_EXPR})
+  snode &cond = raw_args[1];
+  if (eval(cond, env)->v_bool) {
+    return eval(raw_args[2], env);
+  } else {
+    if (raw_args.size() < 4)
+      return nil;
+    return eval(raw_args[3], env);
+  }
+}
+
+snode special_set(std::vector<snode> &raw_args,
+                  senvironment &env) {  // (set SYMBOL-OR-PLACE VALUE)
+  snode var = eval(raw_args[1], env);
+  snode value = copy_node(eval(raw_args[2], env));
+  if (raw_args[1]->type == Node::T_SYMBOL && var == nil) {  // new variable
+    return env->set(raw_args[1], value);
+  } else {
+    Lock lock = lock_node(var.get());
+    *var = *value;
+    return var;
+  }
+}
+
+snode special_fn(
+    std::vector<snode> &raw_args,
+    senvironment &env) {  // (fn (ARGUMENT ..) BODY) => lexical closure
+  snode n2 = fn(make_snode(raw_args), make_env(env));
+  ensure_code(*n2);
+  return n2;
+}
+
+namespace {
+
+// Vector kernels. Each works a register of lanes at a time and finishes the
+// tail one element at a time. On x86-64 they are also built for AVX2, picked
+// at load time when the CPU has it. Not under TSan, whose runtime is not up
+// yet when the ifunc resolvers that pick them run.
+#if defined(__SANITIZE_THREAD__)
+#define PAREN_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define PAREN_TSAN 1
+#endif
+#endif
+#if defined(__x86_64__) && !defined(PAREN_TSAN)
+#define PAREN_VECTOR_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define PAREN_VECTOR_CLONES
+#endif
+
+enum class VecOp { ADD, SUB, MUL, DIV, LT, EQ };
+
+template <typename T>
+using Lanes [[gnu::vector_size(32)]] = T;
+
+template <typename T>
+constexpr size_t kLanes = sizeof(Lanes<T>) / sizeof(T);
+
+// A comparison of Lanes<T> gives one int32_t per lane.
+template <typename T>
+using MaskLanes [[gnu::vector_size(kLanes<T> * sizeof(int32_t))]] = int32_t;
+
+// Lanes are passed by reference: passing them by value without AVX would
+// change the calling convention between the clones.
+template <typename V, typename T>
+[[gnu::always_inline]] inline void load_lanes(V &v, const T *p) {
+  memcpy(&v, p, sizeof(v));
+}
+
+template <VecOp op, typename A, typename R>
+[[gnu::always_inline]] inline void lane_op(const A &a, const A &b, R &r) {
+  if constexpr (op == VecOp::ADD)
+    r = a + b;
+  else if constexpr (op == VecOp::SUB)
+    r = a - b;
+  else if constexpr (op == VecOp::MUL)
+    r = a * b;
+  else if constexpr (op == VecOp::DIV)
+    r = a / b;
+  else if constexpr (op == VecOp::LT)
+    r = a < b;
+  else
+    r = a == b;
+}
+
+// out[i] = x[i] OP y[i] for i < n. A scalar operand, x_scalar or y_scalar, is
+// *x or *y throughout. Comparisons store 1 or 0.
+template <VecOp op, typename T, typename R>
+[[gnu::always_inline]] inline void map_lanes(const T *x, bool x_scalar,
+                                             const T *y, bool y_scalar, R *out,
+                                             size_t n) {
+  size_t i = 0;
+  if (n >= kLanes<T>) {
+    Lanes<T> xs = Lanes<T>{} + *x, ys = Lanes<T>{} + *y, a = xs, b = ys;
+    for (; i + kLanes<T> <= n; i += kLanes<T>) {
+      if (!x_scalar)
+        load_lanes(a, x + i);
+      if (!y_scalar)
+        load_lanes(b, y + i);
+      if constexpr (op == VecOp::LT || op == VecOp::EQ) {
+        decltype(a < b) r;
+        lane_op<op>(a, b, r);
+        MaskLanes<T> m = __builtin_convertvector(r, MaskLanes<T>) & 1;
+        memcpy(out + i, &m, sizeof(m));
+      } else {
+        Lanes<T> r;
+        lane_op<op>(a, b, r);
+        memcpy(out + i, &r, sizeof(r));
+      }
+    }
+  }
+  for (; i < n; i++)
+    lane_op<op>(x_scalar ? *x : x[i], y_scalar ? *y : y[i], out[i]);
+}
+
+template <bool compare, typename T, typename R>
+[[gnu::always_inline]] inline void map_any(VecOp op, const T *x, bool x_scalar,
+                                           const T *y, bool y_scalar, R *out,
+                                           size_t n) {
+  if constexpr (compare) {
+    if (op == VecOp::LT)
+      return map_lanes<VecOp::LT>(x, x_scalar, y, y_scalar, out, n);
+    return map_lanes<VecOp::EQ>(x, x_scalar, y, y_scalar, out, n);
+  } else {
+    switch (op) {
+      case VecOp::ADD:
+        return map_lanes<VecOp::ADD>(x, x_scalar, y, y_scalar, out, n);
+      case VecOp::SUB:
+        return map_lanes<VecOp::SUB>(x, x_scalar, y, y_scalar, out, n);
+      case VecOp::MUL:
+        return map_lanes<VecOp::MUL>(x, x_scalar, y, y_scalar, out, n);
+      default:
+        return map_lanes<VecOp::DIV>(x, x_scalar, y, y_scalar, out, n);
+    }
+  }
+}
+
+// The reductions keep one partial result per lane and combine the lanes at
+// the end, so a sum of doubles is not added in the same order as a loop would.
+template <typename T>
+[[gnu::always_inline]] inline T dot_lanes(const T *x, const T *y, size_t n) {
+  Lanes<T> acc{}, a, b;
+  size_t i = 0;
+  for (; i + kLanes<T> <= n; i += kLanes<T>) {
+    load_lanes(a, x + i);
+    if (y) {
+      load_lanes(b, y + i);
+      a *= b;
+    }
+    acc += a;
+  }
+  T ret = 0;
+  for (size_t j = 0; j < kLanes<T>; j++)
+    ret += acc[j];
+  for (; i < n; i++)
+    ret += y ? x[i] * y[i] : x[i];
+  return ret;
+}
+
+// n must be positive.
+template <typename T>
+[[gnu::always_inline]] inline T extreme_lanes(bool max, const T *x, size_t n) {
+  size_t i = 0;
+  T ret = *x;
+  if (n >= kLanes<T>) {
+    Lanes<T> acc, v;
+    load_lanes(acc, x);
+    for (i = kLanes<T>; i + kLanes<T> <= n; i += kLanes<T>) {
+      load_lanes(v, x + i);
+      acc = max ? (v > acc ? v : acc) : (v < acc ? v : acc);
+    }
+    ret = acc[0];
+    for (size_t j = 1; j < kLanes<T>; j++)
+      ret = max ? std::max(ret, acc[j]) : std::min(ret, acc[j]);
+  }
+  for (; i < n; i++)
+    ret = max ? std::max(ret, x[i]) : std::min(ret, x[i]);
+  return ret;
+}
+
+PAREN_VECTOR_CLONES void map_f64(VecOp op, const double *x, bool x_scalar,
+                                 const double *y, bool y_scalar, double *out,
+                                 size_t n) {
+  map_any<false>(op, x, x_scalar, y, y_scalar, out, n);
+}
+
+PAREN_VECTOR_CLONES void map_i32(VecOp op, const int32_t *x, bool x_scalar,
+                                 const int32_t *y, bool y_scalar, int32_t *out,
+                                 size_t n) {
+  map_any<false>(op, x, x_scalar, y, y_scalar, out, n);
+}
+
+PAREN_VECTOR_CLONES void compare_f64(VecOp op, const double *x, bool x_scalar,
+                                     const double *y, bool y_scalar,
+                                     int32_t *out, size_t n) {
+  map_any<true>(op, x, x_scalar, y, y_scalar, out, n);
+}
+
+PAREN_VECTOR_CLONES void compare_i32(VecOp op, const int32_t *x, bool x_scalar,
+                                     const int32_t *y, bool y_scalar,
+                                     int32_t *out, size_t n) {
+  map_any<true>(op, x, x_scalar, y, y_scalar, out, n);
+}
+
+// With y null, the sum of x.
+PAREN_VECTOR_CLONES double dot_f64(const double *x, const double *y,
+                                   size_t n) {
+  return dot_lanes(x, y, n);
+}
+
+PAREN_VECTOR_CLONES int32_t dot_i32(const int32_t *x, const int32_t *y,
+                                    size_t n) {
+  return dot_lanes(x, y, n);
+}
+
+PAREN_VECTOR_CLONES double extreme_f64(bool max, const double *x, size_t n) {
+  return extreme_lanes(max, x, n);
+}
+
+PAREN_VECTOR_CLONES int32_t extreme_i32(bool max, const int32_t *x, size_t n) {
+  return extreme_lanes(max, x, n);
+}
+
+// out[i] = x[i] OP y[i], by the kernel for the element and result types.
+template <typename T, typename R>
+void map_kernel(VecOp op, const T *x, bool x_scalar, const T *y, bool y_scalar,
+                R *out, size_t n) {
+  bool compare = op == VecOp::LT || op == VecOp::EQ;
+  if constexpr (std::is_same_v<T, double>) {
+    if constexpr (std::is_same_v<R, double>)
+      map_f64(op, x, x_scalar, y, y_scalar, out, n);
+    else
+      compare_f64(op, x, x_scalar, y, y_scalar, out, n);
+  } else if (compare) {
+    compare_i32(op, x, x_scalar, y, y_scalar, out, n);
+  } else {
+    map_i32(op, x, x_scalar, y, y_scalar, out, n);
+  }
+}
+
+bool is_vector(const Node &n) {
+  return n.type == Node::T_F64VEC || n.type == Node::T_I32VEC;
+}
+
+bool any_vector(const std::vector<snode> &args) {
+  for (const snode &n : args) {
+    if (is_vector(*n))
+      return true;
+  }
+  return false;
+}
+
+// Arithmetic is done on ints if its first argument is one, as for numbers.
+bool int_elements(const Node &first) {
+  return first.type == Node::T_INT || first.type == Node::T_I32VEC;
+}
+
+template <typename T>
+T number_of(Node &n) {
+  if constexpr (std::is_same_v<T, double>)
+    return n.to_double();
+  else
+    return n.to_int();
+}
+
+template <typename T>
+void append_converted(Elements<T> &items, const Node &vec) {
+  auto append = [&](const auto &from) {
+    items.reserve(items.size() + from.size());
+    for (auto x : from)
+      items.push_back(static_cast<T>(x));
+  };
+  if (vec.type == Node::T_F64VEC)
+    append(elements_of<double>(vec));
+  else
+    append(elements_of<int32_t>(vec));
+}
+
+// One side of vector arithmetic: the elements of a vector, converted to T if
+// need be, or a number that stands for every element.
+template <typename T>
+struct Operand {
+  std::shared_ptr<const Elements<T>> vec;  // null for a number
+  T value = 0;
+
+  explicit Operand(Node &n) {
+    if (n.type == vector_type<T>) {
+      vec = std::static_pointer_cast<const Elements<T>>(n.v_object);
+    } else if (is_vector(n)) {
+      Elements<T> items;
+      append_converted(items, n);
+      vec = std::make_shared<const Elements<T>>(std::move(items));
+    } else {
+      value = number_of<T>(n);
+    }
+  }
+
+  const T *data() const { return vec ? vec->data() : &value; }
+};
+
+// The length of x OP y: that of the shorter vector.
+template <typename T>
+size_t common_length(const Operand<T> &x, const Operand<T> &y) {
+  if (!x.vec)
+    return y.vec->size();
+  if (!y.vec)
+    return x.vec->size();
+  return std::min(x.vec->size(), y.vec->size());
+}
+
+template <typename T>
+snode vector_fold(VecOp op, std::vector<snode> &args) {
+  Operand<T> acc(*args[0]);
+  for (size_t i = 1; i < args.size(); i++) {
+    Operand<T> y(*args[i]);
+    if (!acc.vec && !y.vec) {
+      T r;
+      map_kernel(op, &acc.value, true, &y.value, true, &r, 1);
+      acc.value = r;
+      continue;
+    }
+    Elements<T> out(common_length(acc, y));
+    map_kernel(op, acc.data(), !acc.vec, y.data(), !y.vec, out.data(),
+               out.size());
+    acc.vec = std::make_shared<const Elements<T>>(std::move(out));
+  }
+  return acc.vec ? make_vector(std::move(acc.vec)) : make_snode(acc.value);
+}
+
+// (OP X ..) where some X is a vector: element by element, a number standing
+// for each element, giving a vector as long as the shortest one.
+snode vector_arith(VecOp op, std::vector<snode> &args) {
+  if (int_elements(*args[0]))
+    return vector_fold<int32_t>(op, args);
+  return vector_fold<double>(op, args);
+}
+
+template <typename T>
+snode vector_mask(VecOp op, std::vector<snode> &args) {
+  Operand<T> x(*args[0]), y(*args[1]);
+  Elements<int32_t> out(common_length(x, y));
+  map_kernel(op, x.data(), !x.vec, y.data(), !y.vec, out.data(), out.size());
+  return make_vector(std::move(out));
+}
+
+// (< X Y) or (== X Y) where X or Y is a vector: an i32vec of 1 where the
+// comparison holds and 0 where it does not.
+snode vector_compare(VecOp op, std::vector<snode> &args) {
+  if (int_elements(*args[0]))
+    return vector_mask<int32_t>(op, args);
+  return vector_mask<double>(op, args);
+}
+
+template <typename T>
+snode make_vector_of(std::vector<snode> &args, senvironment &env) {
+  Elements<T> items;
+  for (snode &n : args) {
+    if (is_vector(*n)) {
+      append_converted(items, *n);
+    } else if (is_list(*n)) {
+      snode list = as_list(n, env);
+      for (snode &item : list->v_list)
+        items.push_back(number_of<T>(*item));
+    } else {
+      items.push_back(number_of<T>(*n));
+    }
+  }
+  return make_vector(std::move(items));
+}
+
+template <typename T>
+snode make_vector_range(std::vector<snode> &args) {
+  T start = number_of<T>(*args[0]), end = number_of<T>(*args[1]);
+  T step = args.size() > 2 ? number_of<T>(*args[2]) : 1;
+  Elements<T> items;
+  if (step != 0 && (step > 0 ? start <= end : start >= end)) {
+    double span = (static_cast<double>(end) - start) / step;
+    items.resize(static_cast<size_t>(span) + 1);
+    for (size_t i = 0; i < items.size(); i++)
+      items[i] = static_cast<T>(start + static_cast<T>(i) * step);
+  }
+  return make_vector(std::move(items));
+}
+
+template <typename T>
+snode vector_dot(Node &a, Node &b) {
+  Operand<T> x(a), y(b);
+  if (!x.vec || !y.vec)
+    return nil;
+  size_t n = common_length(x, y);
+  if constexpr (std::is_same_v<T, double>)
+    return make_snode(dot_f64(x.data(), y.data(), n));
+  else
+    return make_snode(dot_i32(x.data(), y.data(), n));
+}
+
+snode vector_extreme(bool max, const Node &vec) {
+  if (vec.type == Node::T_F64VEC) {
+    const Elements<double> &items = elements_of<double>(vec);
+    if (items.empty())
+      return nil;
+    return make_snode(extreme_f64(max, items.data(), items.size()));
+  }
+  const Elements<int32_t> &items = elements_of<int32_t>(vec);
+  if (items.empty())
+    return nil;
+  return make_snode(extreme_i32(max, items.data(), items.size()));
+}
+
+snode extreme_of(bool max, const std::vector<snode> &items) {
+  if (items.empty())
+    return nil;
+  snode best = items[0];
+  for (size_t i = 1; i < items.size(); i++) {
+    double x = items[i]->to_double(), y = best->to_double();
+    if (max ? x > y : x < y)
+      best = items[i];
+  }
+  return make_snode(*best);
+}
+
+// (min X ..) or (max X ..): of numbers, or of the elements of one vector or
+// list.
+snode extreme(bool max, std::vector<snode> &args, senvironment &env) {
+  if (args.size() == 1 && is_vector(*args[0]))
+    return vector_extreme(max, *args[0]);
+  if (args.size() == 1 && is_list(*args[0])) {
+    snode list = as_list(args[0], env);
+    return extreme_of(max, list->v_list);
+  }
+  return extreme_of(max, args);
+}
+
+}  // namespace
+
+snode builtin_plus(std::vector<snode> &args, senvironment &env) {  // (+ X ..)
+  size_t len = args.size();
+  if (len <= 0)
+    return node_0;
+  if (any_vector(args))
+    return vector_arith(VecOp::ADD, args);
+  snode first = args[0];
+  if (first->type == Node::T_INT) {
+    int sum = first->v_int;
+    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
+         i++) {
+      sum += (*i)->to_int();
+    }
+    return make_snode(sum);
+  } else {
+    double sum = first->v_double;
+    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
+         i++) {
+      sum += (*i)->to_double();
+    }
+    return make_snode(sum);
+  }
+}
+
+snode builtin_minus(std::vector<snode> &args, senvironment &env) {  // (- X ..)
+  size_t len = args.size();
+  if (len <= 0)
+    return node_0;
+  if (any_vector(args))
+    return vector_arith(VecOp::SUB, args);
+  snode first = args[0];
+  if (first->type == Node::T_INT) {
+    int sum = first->v_int;
+    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
+         i++) {
+      sum -= (*i)->to_int();
+    }
+    return make_snode(sum);
+  } else {
+    double sum = first->v_double;
+    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
+         i++) {
+      sum -= (*i)->to_double();
+    }
+    return make_snode(sum);
+  }
+}
+
+snode builtin_mul(std::vector<snode> &args, senvironment &env) {  // (* X ..)
+  size_t len = args.size();
+  if (len <= 0)
+    return node_1;
+  if (any_vector(args))
+    return vector_arith(VecOp::MUL, args);
+  snode first = args[0];
+  if (first->type == Node::T_INT) {
+    int sum = first->v_int;
+    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
+         i++) {
+      sum *= (*i)->to_int();
+    }
+    return make_snode(sum);
+  } else {
+    double sum = first->v_double;
+    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
+         i++) {
+      sum *= (*i)->to_double();
+    }
+    return make_snode(sum);
+  }
+}
+
+snode builtin_div(std::vector<snode> &args, senvironment &env) {  // (/ X ..)
+  size_t len = args.size();
+  if (len <= 0)
+    return node_1;
+  if (any_vector(args))
+    return vector_arith(VecOp::DIV, args);
+  snode first = args[0];
+  if (first->type == Node::T_INT) {
+    int sum = first->v_int;
+    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
+         i++) {
+      sum /= (*i)->to_int();
+    }
+    return make_snode(sum);
+  } else {
+    double sum = first->v_double;
+    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
+         i++) {
+      sum /= (*i)->to_double();
+    }
+    return make_snode(sum);
+  }
+}
+
+snode builtin_lt(std::vector<snode> &args, senvironment &env) {  // (< X Y)
+  if (is_vector(*args[0]) || is_vector(*args[1]))
+    return vector_compare(VecOp::LT, args);
+  if (args[0]->type == Node::T_INT) {
+    return make_snode(args[0]->v_int < args[1]->to_int());
+  } else {
+    return make_snode(args[0]->v_double < args[1]->to_double());
+  }
+}
+
+snode builtin_caret(std::vector<snode> &args,
+                    senvironment &env) {  // (^ BASE EXPONENT)
+  return make_snode(pow(args[0]->to_double(), args[1]->to_double()));
+}
+
+snode builtin_percent(std::vector<snode> &args,
+                      senvironment &env) {  // (% DIVIDEND DIVISOR)
+  return make_snode(args[0]->to_int() % args[1]->to_int());
+}
+
+snode builtin_sqrt(std::vector<snode> &args, senvironment &env) {  // (sqrt X)
+  return make_snode(sqrt(args[0]->to_double()));
+}
+
+snode builtin_plusplus(std::vector<snode> &args, senvironment &env) {  // (++ X)
+  size_t len = args.size();
+  if (len <= 0)
+    return make_snode(0);
+  snode first = args[0];
+  Lock lock = lock_node(first.get());
+  if (first->type == Node::T_INT) {
+    first->v_int++;
+  } else {
+    first->v_double++;
+  }
+  return first;
+}
+
+snode builtin_minusminus(std::vector<snode> &args,
+                         senvironment &env) {  // (-- X)
+  size_t len = args.size();
+  if (len <= 0)
+    return make_snode(0);
+  snode first = args[0];
+  Lock lock = lock_node(first.get());
+  if (first->type == Node::T_INT) {
+    first->v_int--;
+  } else {
+    first->v_double--;
+  }
+  return first;
+}
+
+snode builtin_floor(std::vector<snode> &args, senvironment &env) {  // (floor X)
+  return make_snode(floor(args[0]->to_double()));
+}
+
+snode builtin_ceil(std::vector<snode> &args, senvironment &env) {  // (ceil X)
+  return make_snode(ceil(args[0]->to_double()));
+}
+
+snode builtin_ln(std::vector<snode> &args, senvironment &env) {  // (ln X)
+  return make_snode(log(args[0]->to_double()));
+}
+
+snode builtin_log10(std::vector<snode> &args, senvironment &env) {  // (log10 X)
+  return make_snode(log10(args[0]->to_double()));
+}
+
+snode builtin_rand(std::vector<snode> &args, senvironment &env) {  // (rand)
+  return make_snode(rand_double());
+}
+
+snode builtin_eqeq(std::vector<snode> &args,
+                   senvironment &env) {  // (== X ..) short-circuit
+  if (args.size() == 2 && (is_vector(*args[0]) || is_vector(*args[1])))
+    return vector_compare(VecOp::EQ, args);
+  snode first = args[0];
+  if (first->type == Node::T_INT) {
+    int firstv = first->v_int;
+    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
+         i++) {
+      if ((*i)->to_int() != firstv) {
+        return node_false;
+      }
+    }
+  } else {
+    double firstv = first->v_double;
+    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
+         i++) {
+      if ((*i)->to_double() != firstv) {
+        return node_false;
+      }
+    }
+  }
+  return node_true;
+}
+
+snode special_andand(std::vector<snode> &raw_args,
+                     senvironment &env) {  // (&& X ..) short-circuit
+  for (std::vector<snode>::iterator i = raw_args.begin() + 1;
+       i != raw_args.end(); i++) {
+    if (!(eval(*i, env))->v_bool) {
+      return node_false;
+    }
+  }
+  return node_true;
+}
+
+snode special_oror(std::vector<snode> &raw_args,
+                   senvironment &env) {  // (|| X ..) short-circuit
+  for (std::vector<snode>::iterator i = raw_args.begin() + 1;
+       i != raw_args.end(); i++) {
+    if ((eval(*i, env))->v_bool) {
+      return node_true;
+    }
+  }
+  return node_false;
+}
+
+snode builtin_not(std::vector<snode> &args, senvironment &env) {  // (! X)
+  return make_snode(!(args[0]->v_bool));
+}
+
+snode special_while(std::vector<snode> &raw_args,
+                    senvironment &env) {  // (while CONDITION EXPR ..)
+  snode &cond = raw_args[1];
+  size_t len = raw_args.size();
+  while (eval(cond, env)->v_bool) {
+    for (size_t i = 2; i < len; i++) {
+      eval(raw_args[i], env);
+    }
+  }
+  return nil;
+}
+
+snode builtin_strlen(std::vector<snode> &args,
+                     senvironment &env) {  // (strlen X)
+  return make_snode((int)args[0]->v_string.size());
+}
+
+snode builtin_string(std::vector<snode> &args,
+                     senvironment &env) {  // (std::string X ..)
+  size_t len = args.size();
+  if (len <= 1)
+    return make_snode(std::string());
+  // Strings are appended as they are, so the first one can grow in place.
+  String acc;
+  for (std::vector<snode>::iterator i = args.begin(); i != args.end(); i++) {
+    if ((*i)->type == Node::T_STRING)
+      acc = i == args.begin() ? (*i)->v_string : acc.append((*i)->v_string);
+    else
+      acc = acc.append((*i)->to_string());
+  }
+  return make_snode(std::move(acc));
+}
+
+snode builtin_char_at(std::vector<snode> &args,
+                      senvironment &env) {  // (char-at X)
+  int i = args[1]->to_int();
+  assert(i >= 0 && "Negative string indexing");
+  return make_snode(args[0]->v_string[static_cast<size_t>(i)]);
+}
+
+snode builtin_chr(std::vector<snode> &args, senvironment &env) {  // (chr X)
+  char temp[2] = " ";
+  temp[0] = (char)args[0]->to_int();
+  return make_snode(std::string(temp));
+}
+
+void import_impl(const std::string &path) {
+  if (!eval_file(path)) {
+    std::cerr << "Unable to read file `" << path << "`" << std::endl;
+  }
+}
+
+// (import X)
+snode builtin_import(std::vector<snode> &args, senvironment &env) {
+  std::string filename = args[0]->to_string();
+  import_impl(filename);
+  return nil;
+}
+
+snode builtin_double(std::vector<snode> &args,
+                     senvironment &env) {  // (double X)
+  return make_snode(args[0]->to_double());
+}
+
+snode builtin_int(std::vector<snode> &args, senvironment &env) {  // (int X)
+  return make_snode(args[0]->to_int());
+}
+
+snode builtin_read_string(std::vector<snode> &args,
+                          senvironment &env) {  // (read-std::string X)
+  return parse(args[0]->to_string())[0];
+}
+
+snode builtin_type(std::vector<snode> &args, senvironment &env) {  // (type X)
+  return make_snode(args[0]->type_str());
+}
+
+// `n` as code, with its persistent lists made lists, as parse makes.
+snode as_code(const snode &n) {
+  if (!is_persistent(*n))
+    return n;
+  std::vector<snode> items;
+  each_persistent(*n,
+                  [&](const snode &item) { items.push_back(as_code(item)); });
+  return make_snode(items);
+}
+
+snode builtin_eval(std::vector<snode> &args, senvironment &env) {  // (eval X)
+  snode code = as_code(args[0]);
+  return eval(code, env);
+}
+
+snode special_quote(std::vector<snode> &raw_args,
+                    senvironment &env) {  // (quote X)
+  return raw_args[1];
+}
+
+snode builtin_list(std::vector<snode> &args,
+                   senvironment &env) {  // (list X ..)
+  std::vector<snode> ret;
+  ret.reserve(args.size());
+  for (auto &n : args) {
+    ret.push_back(kept(n));
+  }
+  return make_snode(ret);
+}
+
+namespace {
+
+// Sets code.leaf; see there. A call reaching a special or eval through another
+// name, or a guard falling back on its form, can still capture a frame, which
+// then is not recycled, but cannot be collected if it ends up in a cycle
+// either.
+void mark_leaf(Code &code) {
+  static const size_t eval_code = ToCode("eval");
+  code.leaf = true;
+  for (const Instr &in : code.ops) {
+    size_t sym = SIZE_MAX;
+    if (in.op == OP_LOAD_GLOBAL || in.op == OP_REF_GLOBAL)
+      sym = in.a;
+    else if (in.op == OP_LOAD || in.op == OP_REF)
+      sym = code.bindings[in.a].code;
+    if (in.op == OP_CLOSURE || in.op == OP_SPECIAL || sym == eval_code) {
+      code.leaf = false;
+      return;
+    }
+  }
+}
+
+// Lowers a compiled (macro-expanded) form into bytecode. One instance handles
+// one Code; fn bodies get their own instance linked through `outer`, which is
+// also how symbols are resolved to (depth, slot) addresses.
+// Builtins without side effects, which lowering may run on constants.
+bool is_pure(builtin f) {
+  return f == builtin_plus || f == builtin_minus || f == builtin_mul ||
+         f == builtin_div || f == builtin_percent || f == builtin_lt ||
+         f == builtin_eqeq || f == builtin_not || f == builtin_caret ||
+         f == builtin_sqrt || f == builtin_floor || f == builtin_ceil ||
+         f == builtin_ln || f == builtin_log10 || f == builtin_double;
+}
+
+// Whether the pure builtin `f` can be run at lowering time on `args`: these
+// are numbers it takes, and it neither fails nor overflows on them.
+bool foldable(builtin f, const std::vector<snode> &args) {
+  size_t nargs = args.size();
+  if (f == builtin_not)
+    return nargs == 1 && args[0]->type == Node::T_BOOL;
+  for (const snode &arg : args) {
+    if (arg->type != Node::T_INT && arg->type != Node::T_DOUBLE)
+      return false;
+  }
+  if (f == builtin_sqrt || f == builtin_floor || f == builtin_ceil ||
+      f == builtin_ln || f == builtin_log10 || f == builtin_double)
+    return nargs == 1;
+  if (f == builtin_caret)
+    return nargs == 2;
+  if (nargs == 0 || ((f == builtin_lt || f == builtin_percent) && nargs != 2))
+    return false;
+  if (args[0]->type != Node::T_INT && f != builtin_percent)
+    return true;
+
+  // Runs int arithmetic in 64 bits to see that it stays in range.
+  int64_t acc = 0;
+  for (size_t i = 0; i < nargs; i++) {
+    int64_t x;
+    if (args[i]->type == Node::T_INT) {
+      x = args[i]->v_int;
+    } else {
+      double d = args[i]->v_double;
+      if (!(d > INT_MIN - 1.0 && d < INT_MAX + 1.0))
+        return false;
+      x = static_cast<int64_t>(d);
+    }
+    if (i == 0) {
+      acc = x;
+    } else if (f == builtin_plus) {
+      acc += x;
+    } else if (f == builtin_minus) {
+      acc -= x;
+    } else if (f == builtin_mul) {
+      acc *= x;
+    } else if (f == builtin_div || f == builtin_percent) {
+      if (x == 0)
+        return false;
+      acc = f == builtin_div ? acc / x : acc % x;
+    }
+    if (acc < INT_MIN || acc > INT_MAX)
+      return false;
+  }
+  return true;
+}
+
+// What OP_GUARD compares a binding with: the part of `n` telling what it is.
+snode snapshot(const Node &n) {
+  Node seen;
+  seen.type = n.type;
+  switch (n.type) {
+    case Node::T_INT:
+      seen.v_int = n.v_int;
+      break;
+    case Node::T_DOUBLE:
+      seen.v_double = n.v_double;
+      break;
+    case Node::T_BOOL:
+      seen.v_bool = n.v_bool;
+      break;
+    case Node::T_BUILTIN:
+      seen.v_builtin = n.v_builtin;
+      break;
+    case Node::T_FN:
+      seen.v_code = n.v_code;
+      break;
+    default:
+      break;
+  }
+  return make_snode(seen);
+}
+
+bool same_binding(const Node &now, const Node &seen) {
+  if (now.type != seen.type)
+    return false;
+  switch (seen.type) {
+    case Node::T_INT:
+      return now.v_int == seen.v_int;
+    case Node::T_DOUBLE:
+      return now.v_double == seen.v_double;
+    case Node::T_BOOL:
+      return now.v_bool == seen.v_bool;
+    case Node::T_BUILTIN:
+      return now.v_builtin == seen.v_builtin;
+    case Node::T_FN:
+      return now.v_code == seen.v_code;
+    default:
+      return false;
+  }
+}
+
+// Whether global `sym` is bound as `seen`, a snapshot, says.
+bool bound_as(size_t sym, const Node &seen) {
+  ReadLock lock = read_global(sym);
+  Value *now = context->globals->slot(sym);
+  return now && now->tag == Value::BOXED && same_binding(*now->box, seen);
+}
+
+class BytecodeCompiler {
+ public:
+  BytecodeCompiler(Code &code, const BytecodeCompiler *outer)
+      : code(code), outer(outer) {}
+
+  // With `tail`, `n` is in tail position: its value is what the fn body being
+  // lowered returns.
+  void compile_expr(snode &n, bool tail = false) {
+    switch (n->type) {
+      case Node::T_SYMBOL:
+        compile_symbol(n->code, /*ref=*/false);
+        return;
+      case Node::T_LIST:
+        compile_list(n, tail);
+        return;
+      case Node::T_INT:
+        emit(OP_CONST, add_const(n->v_int));
+        return;
+      case Node::T_DOUBLE:
+        emit(OP_CONST, add_const(n->v_double));
+        return;
+      case Node::T_BOOL:
+        emit(OP_CONST, add_const(n->v_bool));
+        return;
+      default:
+        emit(OP_CONST, add_const(n));
+        return;
+    }
+  }
+
+  // Lowers the body of (fn (ARGUMENT ..) BODY ..).
+  void compile_fn(std::vector<snode> &f) {
+    for (snode &param : f[1]->v_list)
+      code.locals.push_back(param->code);
+    code.nparams = code.locals.size();
+    for (size_t i = 2; i < f.size(); i++)
+      collect_locals(f[i]);
+    compile_sequence(f, 2, /*tail=*/true);
+    emit(OP_RETURN);
+    mark_leaf(code);
+  }
+
+ private:
+  Code &code;
+  const BytecodeCompiler *outer;  // enclosing fn body, if any
+
+  size_t here() const { return code.ops.size(); }
+
+  size_t emit(Opcode op, size_t a = 0, size_t b = 0) {
+    code.ops.push_back(
+        {op, static_cast<uint32_t>(a), static_cast<uint32_t>(b)});
+    return code.ops.size() - 1;
+  }
+
+  // Points the jump emitted at `at` to the next instruction.
+  void patch(size_t at) { code.ops[at].a = static_cast<uint32_t>(here()); }
+
+  size_t add_const(Value v) {
+    code.consts.push_back(std::move(v));
+    return code.consts.size() - 1;
+  }
+
+  size_t add_binding(Binding b) {
+    code.bindings.push_back(std::move(b));
+    return code.bindings.size() - 1;
+  }
+
+  // Finds the frame slots `sym` may be bound in. The search stops at an
+  // argument since those are always bound.
+  Binding resolve(size_t sym, bool &always_bound) const {
+    Binding b{sym, {}};
+    always_bound = false;
+    uint32_t depth = 0;
+    for (const BytecodeCompiler *c = this; c && !always_bound;
+         c = c->outer, depth++) {
+      std::vector<size_t> &locals = c->code.locals;
+      auto found = std::find(locals.begin(), locals.end(), sym);
+      if (found != locals.end()) {
+        size_t slot = size_t(found - locals.begin());
+        b.slots.push_back({depth, static_cast<uint32_t>(slot)});
+        always_bound = slot < c->code.nparams;
+      }
+    }
+    return b;
+  }
+
+  // Returns the global node `head` names right now, unless a local shadows
+  // it or it is not boxed.
+  snode static_global(snode &head) const {
+    if (head->type != Node::T_SYMBOL)
+      return nullptr;
+    bool always_bound;
+    if (!resolve(head->code, always_bound).slots.empty())
+      return nullptr;
+    ReadLock lock = read_global(head->code);
+    Value *value = context->globals->slot(head->code);
+    return value && value->tag == Value::BOXED ? value->box : nullptr;
+  }
+
+  snode static_special(snode &head) const {
+    snode value = static_global(head);
+    return value && value->type == Node::T_SPECIAL ? value : nullptr;
+  }
+
+  // Gives a slot to each symbol bound by def or set in this body, leaving out
+  // nested fn bodies and quoted data.
+  void collect_locals(snode &n) {
+    if (n->type != Node::T_LIST || n->v_list.empty())
+      return;
+    std::vector<snode> &list = n->v_list;
+    if (snode special = static_special(list[0])) {
+      builtin f = special->v_builtin;
+      if (f == special_quote || f == special_fn)
+        return;
+      if ((f == special_def || f == special_set) && list.size() >= 2 &&
+          list[1]->type == Node::T_SYMBOL) {
+        size_t sym = list[1]->code;
+        auto &locals = code.locals;
+        if (std::find(locals.begin(), locals.end(), sym) == locals.end())
+          locals.push_back(sym);
+      }
+    }
+    for (snode &item : list)
+      collect_locals(item);
+  }
+
+  // With `ref`, the variable is boxed so the callee can update it.
+  void compile_symbol(size_t sym, bool ref) {
+    bool always_bound;
+    Binding b = resolve(sym, always_bound);
+    if (b.slots.empty())
+      emit(ref ? OP_REF_GLOBAL : OP_LOAD_GLOBAL, sym);
+    else if (always_bound && b.slots.size() == 1)
+      emit(ref ? OP_REF_LOCAL : OP_LOAD_LOCAL, b.slots[0].first,
+           b.slots[0].second);
+    else
+      emit(ref ? OP_REF : OP_LOAD, add_binding(std::move(b)));
+  }
+
+  void compile_sequence(std::vector<snode> &list, size_t first,
+                        bool tail = false) {
+    if (first >= list.size()) {
+      emit(OP_NIL);
+      return;
+    }
+    for (size_t i = first; i < list.size(); i++) {
+      if (i != first)
+        emit(OP_POP);
+      compile_expr(list[i], tail && i + 1 == list.size());
+    }
+  }
+
+  void compile_list(snode &n, bool tail) {
+    std::vector<snode> &list = n->v_list;
+    size_t len = list.size();
+    if (len == 0) {
+      emit(OP_NIL);
+      return;
+    }
+
+    snode special = static_special(list[0]);
+    if (!special) {
+      std::vector<snode> assumed;
+      if (snode value = constant(n, assumed))
+        guarded(n, assumed, [&] { compile_expr(value); });
+      else
+        compile_call(n, tail);
+      return;
+    }
+
+    builtin f = special->v_builtin;
+    if (f == special_quote && len >= 2) {
+      emit(OP_CONST, add_const(list[1]));
+    } else if (f == special_def && len >= 3 &&
+               list[1]->type == Node::T_SYMBOL) {
+      compile_expr(list[2]);
+      auto &locals = code.locals;
+      auto found = std::find(locals.begin(), locals.end(), list[1]->code);
+      if (found != locals.end())
+        emit(OP_DEF_LOCAL, size_t(found - locals.begin()));
+      else
+        emit(OP_DEF, list[1]->code);
+    } else if (f == special_set && len >= 3) {
+      if (list[1]->type == Node::T_SYMBOL) {
+        compile_expr(list[2]);
+        bool always_bound;
+        emit(OP_SET, add_binding(resolve(list[1]->code, always_bound)));
+      } else {
+        compile_expr(list[1]);
+        compile_expr(list[2]);
+        emit(OP_SET_PLACE);
+      }
+    } else if (f == special_if && len >= 3) {
+      std::vector<snode> assumed;
+      snode cond = constant(list[1], assumed);
+      if (cond && cond->type == Node::T_BOOL) {
+        guarded(n, assumed, [&] {
+          if (cond->v_bool)
+            compile_expr(list[2], tail);
+          else if (len >= 4)
+            compile_expr(list[3], tail);
+          else
+            emit(OP_NIL);
+        });
+        return;
+      }
+      compile_expr(list[1]);
+      size_t to_else = emit(OP_JUMP_IF_FALSE);
+      compile_expr(list[2], tail);
+      size_t to_end = emit(OP_JUMP);
+      patch(to_else);
+      if (len >= 4)
+        compile_expr(list[3], tail);
+      else
+        emit(OP_NIL);
+      patch(to_end);
+    } else if (f == special_begin) {
+      compile_sequence(list, 1, tail);
+    } else if (f == special_while && len >= 2) {
+      size_t top = here();
+      compile_expr(list[1]);
+      size_t to_end = emit(OP_JUMP_IF_FALSE);
+      for (size_t i = 2; i < len; i++) {
+        compile_expr(list[i]);
+        emit(OP_POP);
+      }
+      emit(OP_JUMP, top);
+      patch(to_end);
+      emit(OP_NIL);
+    } else if (f == special_andand || f == special_oror) {
+      // These yield true or false rather than the deciding operand. Constant
+      // operands are left out, up to one deciding it.
+      bool is_and = f == special_andand;
+      std::vector<snode> assumed;
+      std::vector<snode> values(len);
+      for (size_t i = 1; i < len; i++) {
+        size_t mark = assumed.size();
+        values[i] = constant(list[i], assumed);
+        if (!values[i] || values[i]->type != Node::T_BOOL) {
+          values[i] = nullptr;
+          assumed.resize(mark);
+        } else if (values[i]->v_bool != is_and) {
+          break;
+        }
+      }
+      guarded(n, assumed, [&] {
+        std::vector<size_t> decided;
+        for (size_t i = 1; i < len; i++) {
+          if (values[i] && values[i]->v_bool == is_and)
+            continue;
+          if (values[i]) {
+            if (!is_and)
+              emit(OP_CONST, add_const(true));
+            decided.push_back(emit(OP_JUMP));
+            break;
+          }
+          compile_expr(list[i]);
+          size_t next = emit(OP_JUMP_IF_FALSE);
+          if (is_and) {
+            decided.push_back(next);
+          } else {
+            emit(OP_CONST, add_const(true));
+            decided.push_back(emit(OP_JUMP));
+            patch(next);
+          }
+        }
+        emit(OP_CONST, add_const(is_and));
+        size_t to_end = emit(OP_JUMP);
+        for (size_t at : decided)
+          patch(at);
+        if (is_and)
+          emit(OP_CONST, add_const(false));
+        patch(to_end);
+      });
+    } else if (f == special_fn && len >= 2 &&
+               list[1]->type == Node::T_LIST) {
+      scode proto(std::make_shared<Code>());
+      BytecodeCompiler(*proto, this).compile_fn(list);
+      code.protos.push_back(proto);
+      emit(OP_CLOSURE, code.protos.size() - 1, add_const(n));
+    } else {  // other specials and malformed forms are run as they are
+      emit(OP_SPECIAL, add_const(special), add_const(n));
+    }
+  }
+
+  void compile_call(snode &n, bool tail) {
+    std::vector<snode> &list = n->v_list;
+    size_t nargs = list.size() - 1;
+    snode head = static_global(list[0]);
+    if (snode body = head ? inline_body(*head, n) : nullptr) {
+      std::vector<snode> assumed;
+      assume(assumed, list[0], *head);
+      guarded(n, assumed, [&] { compile_expr(body); });
+      return;
+    }
+    if (head && head->type == Node::T_BUILTIN) {
+      Opcode op = primitive_op(head->v_builtin, nargs);
+      if (op != OP_CALL) {
+        for (size_t i = 1; i < list.size(); i++)
+          compile_expr(list[i]);
+        emit(op, nargs, list[0]->code);
+        return;
+      }
+    }
+
+    compile_expr(list[0]);
+    size_t prepare = emit(OP_PREPARE_CALL, add_const(n));
+    for (size_t i = 1; i < list.size(); i++) {
+      if (list[i]->type == Node::T_SYMBOL)
+        compile_symbol(list[i]->code, /*ref=*/true);
+      else
+        compile_expr(list[i]);
+    }
+    emit(tail ? OP_TAIL_CALL : OP_CALL, nargs);
+    code.ops[prepare].b = static_cast<uint32_t>(here());
+  }
+
+  // Notes that what is being lowered relies on `sym` being bound to `value`.
+  static void assume(std::vector<snode> &assumed, const snode &sym,
+                     const Node &value) {
+    assumed.push_back(sym);
+    assumed.push_back(snapshot(value));
+  }
+
+  // Lowers `form` with lower(), behind a guard on the bindings `assumed` if
+  // there are any.
+  template <typename Lower>
+  void guarded(snode &form, const std::vector<snode> &assumed, Lower lower) {
+    if (assumed.empty()) {
+      lower();
+      return;
+    }
+    std::vector<snode> guard{form};
+    guard.insert(guard.end(), assumed.begin(), assumed.end());
+    size_t at = emit(OP_GUARD, add_const(make_snode(guard)));
+    lower();
+    code.ops[at].b = static_cast<uint32_t>(here());
+  }
+
+  // The value of `n` if it can be worked out now: a literal, a constant global
+  // such as true, or a call of a pure builtin, directly or through a wrapper
+  // (see inline_body), on such values. The bindings relied on are added to
+  // `assumed`, which is left as it was if there is no value.
+  snode constant(snode &n, std::vector<snode> &assumed) const {
+    switch (n->type) {
+      case Node::T_INT:
+      case Node::T_DOUBLE:
+      case Node::T_BOOL:
+        return n;
+      case Node::T_SYMBOL: {
+        // Not other globals: one that is set would fail the guard on every
+        // run after, each then going through eval.
+        if (!is_constant_global(n->code))
+          return nullptr;
+        snode value = static_global(n);
+        if (!value || (value->type != Node::T_INT &&
+                       value->type != Node::T_DOUBLE &&
+                       value->type != Node::T_BOOL))
+          return nullptr;
+        assume(assumed, n, *value);
+        return snapshot(*value);
+      }
+      case Node::T_LIST:
+        break;
+      default:
+        return nullptr;
+    }
+
+    std::vector<snode> &list = n->v_list;
+    snode head = list.empty() ? nullptr : static_global(list[0]);
+    if (!head)
+      return nullptr;
+    size_t mark = assumed.size();
+    snode value;
+    if (head->type == Node::T_BUILTIN) {
+      std::vector<snode> args;
+      for (size_t i = 1; i < list.size(); i++) {
+        snode arg = constant(list[i], assumed);
+        if (!arg)
+          break;
+        args.push_back(std::move(arg));
+      }
+      builtin f = head->v_builtin;
+      if (args.size() + 1 != list.size())
+        value = nullptr;
+      else if (f == builtin_eval && args.size() == 1)
+        value = args[0];  // a constant evaluates to itself
+      else if (is_pure(f) && foldable(f, args))
+        value = f(args, context->globals);
+    } else if (snode body = inline_body(*head, n)) {
+      value = constant(body, assumed);
+    }
+    if (!value) {
+      assumed.resize(mark);
+      return nullptr;
+    }
+    assume(assumed, list[0], *head);
+    return value;
+  }
+
+  // The globals init_builtins binds to constants, which nothing is expected to
+  // rebind.
+  static bool is_constant_global(size_t code) {
+    static const size_t codes[] = {ToCode("true"), ToCode("false"),
+                                   ToCode("E"), ToCode("PI")};
+    return std::find(std::begin(codes), std::end(codes), code) !=
+           std::end(codes);
+  }
+
+  // If `func` is a wrapper of pure builtins, like inc or >, the call `call` of
+  // it with its body's parameters replaced by the arguments; or else nullptr.
+  // That is, its body is a single expression of calls of pure builtins on its
+  // parameters and literals, each parameter used once and in order unless
+  // every argument is a symbol or a literal, so calls and side effects in the
+  // arguments happen as in the call.
+  snode inline_body(const Node &func, snode &call) const {
+    if (func.type != Node::T_FN || func.outer_env != context->globals)
+      return nullptr;
+    const std::vector<snode> &f = func.v_list;
+    std::vector<snode> &args = call->v_list;
+    if (f.size() != 3 || f[1]->type != Node::T_LIST)
+      return nullptr;
+    const std::vector<snode> &params = f[1]->v_list;
+    if (params.size() + 1 != args.size())
+      return nullptr;
+    for (size_t i = 0; i < params.size(); i++) {
+      if (params[i]->type != Node::T_SYMBOL || params[i]->code == ellipsis_code)
+        return nullptr;
+      for (size_t j = 0; j < i; j++) {
+        if (params[j]->code == params[i]->code)
+          return nullptr;
+      }
+    }
+    std::vector<size_t> uses;
+    size_t budget = kInlineNodes;
+    if (!wrapper_body(f[2], params, uses, budget))
+      return nullptr;
+    bool in_order = uses.size() == params.size();
+    for (size_t i = 0; i < uses.size() && in_order; i++)
+      in_order = uses[i] == i;
+    for (size_t i = 1; i < args.size() && !in_order; i++) {
+      if (args[i]->type == Node::T_LIST)
+        return nullptr;
+    }
+    return substitute(f[2], params, args);
+  }
+
+  static constexpr size_t kInlineNodes = 8;  // the most in a wrapper's body
+
+  // Whether `n` can be the body of a wrapper; see inline_body. Appends the
+  // index of each parameter it uses, in the order they are used.
+  bool wrapper_body(const snode &n, const std::vector<snode> &params,
+                    std::vector<size_t> &uses, size_t &budget) const {
+    if (budget-- == 0)
+      return false;
+    switch (n->type) {
+      case Node::T_INT:
+      case Node::T_DOUBLE:
+      case Node::T_BOOL:
+        return true;
+      case Node::T_SYMBOL:
+        for (size_t i = 0; i < params.size(); i++) {
+          if (params[i]->code == n->code) {
+            uses.push_back(i);
+            return true;
+          }
+        }
+        return false;
+      case Node::T_LIST: {
+        const std::vector<snode> &list = n->v_list;
+        if (list.empty() || list[0]->type != Node::T_SYMBOL)
+          return false;
+        for (const snode &param : params) {
+          if (param->code == list[0]->code)
+            return false;
+        }
+        snode head = list[0];
+        snode value = static_global(head);
+        if (!value || value->type != Node::T_BUILTIN ||
+            !is_pure(value->v_builtin))
+          return false;
+        for (size_t i = 1; i < list.size(); i++) {
+          if (!wrapper_body(list[i], params, uses, budget))
+            return false;
+        }
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+
+  static snode substitute(const snode &n, const std::vector<snode> &params,
+                          const std::vector<snode> &args) {
+    if (n->type == Node::T_SYMBOL) {
+      for (size_t i = 0; i < params.size(); i++) {
+        if (params[i]->code == n->code)
+          return args[i + 1];
+      }
+    }
+    if (n->type != Node::T_LIST)
+      return n;
+    std::vector<snode> list;
+    for (const snode &item : n->v_list)
+      list.push_back(substitute(item, params, args));
+    return make_snode(list);
+  }
+
+  // The inline opcode for calling `f` with `nargs` arguments, or OP_CALL.
+  static Opcode primitive_op(builtin f, size_t nargs) {
+    if (f == builtin_plus)
+      return OP_ADD;
+    if (f == builtin_minus)
+      return OP_SUB;
+    if (f == builtin_mul)
+      return OP_MUL;
+    if (f == builtin_div)
+      return OP_DIV;
+    if (f == builtin_percent && nargs == 2)
+      return OP_MOD;
+    if (f == builtin_lt && nargs == 2)
+      return OP_LT;
+    if (f == builtin_eqeq && nargs >= 1)
+      return OP_EQ;
+    if (f == builtin_not && nargs >= 1)
+      return OP_NOT;
+    return OP_CALL;
+  }
+};
+
+// T_FN nodes not made by OP_CLOSURE (eg. by special_fn under eval) are lowered
+// before they can be called, by special_fn. Their free symbols are looked up by
+// name.
+Code &ensure_code(Node &func) {
+  if (!func.v_code) {
+    scode code(std::make_shared<Code>());
+    BytecodeCompiler(*code, nullptr).compile_fn(func.v_list);
+    func.v_code = code;
+  }
+  return *func.v_code;
+}
+
+jit_compiler jit = nullptr;
+size_t jit_threshold = 0;
+
+// Counts a call of the fn body `code`, which is compiled once it is hot, by
+// whichever thread makes the call that gets it there.
+void count_call(Code &code) {
+  if (jit && !code.native.load(std::memory_order_acquire) &&
+      code.calls.fetch_add(1, std::memory_order_relaxed) + 1 == jit_threshold)
+    code.native.store(jit(code), std::memory_order_release);
+}
+
+// A copy of `v` as def and set store it. Numbers, bools and nil are unboxed.
+Value copy_of(const Value &v) {
+  if (v.tag != Value::BOXED)
+    return v;
+  if (v.box->type == Node::T_SEQ)
+    return kept(v.box);
+  Node &n = *v.box;
+  Lock lock = lock_node(&n);
+  switch (n.type) {
+    case Node::T_NIL: {
+      Value copy;
+      copy.tag = Value::NIL;
+      return copy;
+    }
+    case Node::T_INT:
+      return n.v_int;
+    case Node::T_DOUBLE:
+      return n.v_double;
+    case Node::T_BOOL:
+      return n.v_bool;
+    default:
+      return make_snode(n);
+  }
+}
+
+// Assigns `v` to the node `n` in place, as set does to bound variables.
+void store_into(const Value &v, Node &n) {
+  if (v.tag == Value::BOXED && v.box->type == Node::T_SEQ) {
+    store_into(kept(v.box), n);
+    return;
+  }
+  auto locks = v.tag == Value::BOXED ? lock_nodes(v.box.get(), &n)
+                                     : std::pair(lock_node(&n), Lock());
+  switch (v.tag) {
+    case Value::INT:
+      n = Node(v.v_int);
+      return;
+    case Value::DOUBLE:
+      n = Node(v.v_double);
+      return;
+    case Value::BOOL:
+      n = Node(v.v_bool);
+      return;
+    case Value::BOXED:
+      n = *v.box;
+      return;
+    default:
+      n = Node();
+      return;
+  }
 }
 
-snode node_true(std::make_shared<Node>(Node(true)));
-snode node_false(std::make_shared<Node>(Node(false)));
-snode node_0(std::make_shared<Node>(Node(0)));
-snode node_1(std::make_shared<Node>(Node(1)));
-snode nil(std::make_shared<Node>(Node()));
+// Conditions read v_bool whatever the type, as the tree walker does.
+bool truthy(const Value &v) {
+  return v.tag == Value::BOXED ? v.box->v_bool : v.v_bool;
+}
 
-snode builtin_prn(std::vector<snode> &args, senvironment &env);
+bool is_int(const Value &v) {
+  return v.tag == Value::INT ||
+         (v.tag == Value::BOXED && v.box->type == Node::T_INT);
+}
 
-inline int Node::to_int() {
-  switch (type) {
-    case T_INT:
-      return v_int;
-    case T_DOUBLE:
-      return (int)v_double;
-    case T_BOOL:
-      return (int)v_bool;
-    case T_STRING:
-      return atoi(v_string.c_str());
+bool is_number(const Value &v) {
+  return is_int(v) || v.tag == Value::DOUBLE ||
+         (v.tag == Value::BOXED && v.box->type == Node::T_DOUBLE);
+}
+
+int int_of(const Value &v) {
+  switch (v.tag) {
+    case Value::INT:
+      return v.v_int;
+    case Value::DOUBLE:
+      return (int)v.v_double;
     default:
-      return 0;
+      return v.box->to_int();
   }
 }
 
-inline double Node::to_double() {
-  switch (type) {
-    case T_INT:
-      return v_int;
-    case T_DOUBLE:
-      return v_double;
-    case T_BOOL:
-      return v_bool;
-    case T_STRING:
-      return atof(v_string.c_str());
+double double_of(const Value &v) {
+  switch (v.tag) {
+    case Value::INT:
+      return v.v_int;
+    case Value::DOUBLE:
+      return v.v_double;
     default:
-      return 0.0;
+      return v.box->to_double();
   }
 }
-inline std::string Node::to_string() {
-  char buf[32];
-  std::string ret;
-  switch (type) {
-    case T_NIL:
-      break;
-    case T_INT:
-      sprintf(buf, "%d", v_int);
-      ret = buf;
-      break;
-    case T_BUILTIN:
-      sprintf(buf, "#<builtin:%p>", v_builtin);
-      ret = buf;
-      break;
-    case T_SPECIAL:
-      sprintf(buf, "#<builtin:%p>", v_builtin);
-      ret = buf;
-      break;
-    case T_DOUBLE:
-      sprintf(buf, "%.16g", v_double);
-      ret = buf;
-      break;
-    case T_BOOL:
-      return (v_bool ? "true" : "false");
-    case T_STRING:
-    case T_SYMBOL:
-      return v_string;
-    case T_FN:
-    case T_LIST: {
-      ret = '(';
-      for (std::vector<snode>::iterator iter = v_list.begin();
-           iter != v_list.end(); iter++) {
-        if (iter != v_list.begin())
-          ret += ' ';
-        ret += (*iter)->to_string();
-      }
-      ret += ')';
-      break;
-    }
-    default:;
+
+template <typename T>
+T arith(Opcode op, T x, T y) {
+  switch (op) {
+    case OP_ADD:
+      return x + y;
+    case OP_SUB:
+      return x - y;
+    case OP_MUL:
+      return x * y;
+    default:
+      return x / y;
   }
-  return ret;
 }
-inline std::string Node::type_str() {
-  switch (type) {
-    case T_NIL:
-      return "nil";
-    case T_INT:
-      return "int";
-    case T_DOUBLE:
-      return "double";
-    case T_BOOL:
-      return "bool";
-    case T_STRING:
-      return "std::string";
-    case T_SYMBOL:
-      return "symbol";
-    case T_LIST:
-      return "list";
-    case T_BUILTIN:
-      return "builtin";
-    case T_SPECIAL:
-      return "special";
-    case T_FN:
-      return "fn";
-    case T_THREAD:
-      return "std::thread";
+
+template <typename T>
+Value binary(Opcode op, T x, T y) {
+  switch (op) {
+    case OP_MOD:
+      return static_cast<int>(x) % static_cast<int>(y);
+    case OP_LT:
+      return x < y;
+    case OP_EQ:
+      return x == y;
     default:
-      return "invalid type";
+      return arith(op, x, y);
   }
 }
-inline std::string Node::str_with_type() {
-  return to_string() + " : " + type_str();
+
+bool int_operand(const Value &v, int &out) {
+  if (v.tag == Value::INT) {
+    out = v.v_int;
+    return true;
+  }
+  if (v.tag == Value::BOXED && v.box->type == Node::T_INT) {
+    out = v.box->v_int;
+    return true;
+  }
+  return false;
 }
 
-inline double rand_double() {
-  return (double)rand() / ((double)RAND_MAX + 1.0);
+bool double_operand(const Value &v, double &out) {
+  if (v.tag == Value::DOUBLE) {
+    out = v.v_double;
+    return true;
+  }
+  if (v.tag == Value::BOXED && v.box->type == Node::T_DOUBLE) {
+    out = v.box->v_double;
+    return true;
+  }
+  return false;
 }
 
-class Tokenizer {
- private:
-  std::vector<std::string> ret;
-  std::string acc;  // accumulator
-  std::string s;
-  void emit() {  // add accumulated std::string to token list
-    if (acc.length() > 0) {
-      ret.push_back(acc);
-      acc = "";
-    }
+// Instructions are shared by every thread running their code.
+std::atomic_ref<uint8_t> hint_of(const Instr &in) {
+  return std::atomic_ref<uint8_t>(in.hint);
+}
+
+// Notes that arithmetic opcode `in` ran inline on `x` and `y`.
+void observe(const Instr &in, const Value &x, const Value &y) {
+  int i;
+  double d;
+  ArithHint seen = HINT_GENERIC;
+  if (int_operand(x, i) && int_operand(y, i))
+    seen = HINT_INT;
+  else if (double_operand(x, d) && is_number(y))
+    seen = HINT_DOUBLE;
+  std::atomic_ref<uint8_t> hint = hint_of(in);
+  uint8_t old = hint.load(std::memory_order_relaxed);
+  uint8_t now = old == HINT_NONE || old == seen ? seen : HINT_GENERIC;
+  if (now != old)
+    hint.store(now, std::memory_order_relaxed);
+}
+
+builtin primitive_builtin(Opcode op) {
+  switch (op) {
+    case OP_ADD:
+      return builtin_plus;
+    case OP_SUB:
+      return builtin_minus;
+    case OP_MUL:
+      return builtin_mul;
+    case OP_DIV:
+      return builtin_div;
+    case OP_MOD:
+      return builtin_percent;
+    case OP_LT:
+      return builtin_lt;
+    case OP_EQ:
+      return builtin_eqeq;
+    default:
+      return builtin_not;
   }
+}
 
+class VM {
  public:
-  int unclosed;  // number of unclosed parenthesis ( or quotation "
-  Tokenizer(const std::string &s) : s(s), unclosed(0) {}
+  // Runs `entry` in a frame of its own, that of a call of its fn if `fn`.
+  snode run(scode &entry, senvironment &env, bool fn = false);
 
-  std::vector<std::string> tokenize() {
-    size_t last = s.length() - 1;
-    for (size_t pos = 0; pos <= last; pos++) {
-      char c = s.at(pos);
-      if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
-        emit();
-      } else if (c == ';' ||
-                 (pos < last && c == '#' &&
-                  s[pos + 1] == '!')) {  // end-of-line comment: ; or #!
-        emit();
-        do
-          pos++;
-        while (pos <= last && s.at(pos) != '\n');
-      } else if (c == '"') {  // beginning of std::string
-        unclosed++;
-        emit();
-        acc += '"';
-        pos++;
-        while (pos <= last) {
-          if (s.at(pos) == '"') {
-            unclosed--;
-            break;
-          }
-          if (s.at(pos) == '\\') {  // escape
-            char next = s.at(pos + 1);
-            if (next == 'r')
-              next = '\r';
-            else if (next == 'n')
-              next = '\n';
-            else if (next == 't')
-              next = '\t';
-            acc += next;
-            pos += 2;
-          } else {
-            acc += s.at(pos);
-            pos++;
-          }
-        }
-        emit();
-      } else if (c == '(') {
-        unclosed++;
-        emit();
-        acc += c;
-        emit();
-      } else if (c == ')') {
-        unclosed--;
-        emit();
-        acc += c;
-        emit();
-      } else {
-        acc += c;
-      }
+  snode call(snode &func, std::vector<snode> &args) {
+    count_call(ensure_code(*func));
+    scode body = func->v_code;
+    senvironment local =
+        bind(*func, args.size(), [&](size_t i) { return Value(args[i]); });
+    return run(body, local, /*fn=*/true);
+  }
+
+  // What native code (see paren_rt_exec and friends) does for the
+  // instruction at `pc` in the current frame.
+  void exec(uint32_t pc);
+  bool pop_truthy();
+  bool prepare_call(uint32_t pc);
+  bool guard(uint32_t pc);
+  void call(uint32_t pc);
+  bool tail_call(uint32_t pc);
+  bool intact(uint32_t pc) { return intact(frames.back().code->ops[pc]); }
+  void push(Value value) { stack.push_back(std::move(value)); }
+  Value *slots() { return frames.back().env->slots.data(); }
+
+ private:
+  struct Frame {
+    scode code;  // keeps the body alive if the fn node is overwritten
+    const Instr *ip;
+    senvironment env;
+    bool profiled = false;  // a call entered while profiling
+  };
+
+  std::vector<Value> stack;
+  std::vector<Frame> frames;
+  bool handed_over = false;  // native code tail called; see run_native
+
+  // Environments of returned leaf frames, for the next ones; see Code::leaf.
+  std::vector<senvironment> spare_frames;
+  static constexpr size_t kSpareFrames = 256;
+
+  // What a parameter is bound to for the argument `v`; see kept.
+  static Value bound(Value v) {
+    if (v.tag == Value::BOXED && v.box->type == Node::T_SEQ)
+      return kept(v.box);
+    return v;
+  }
+
+  // The frame of a call of `func` with `nargs` arguments, argument i being
+  // arg(i).
+  template <typename Arg>
+  senvironment bind(Node &func, size_t nargs, Arg arg) {
+    Code &code = *func.v_code;
+    senvironment local;
+    if (!code.leaf) {
+      local = make_env(func.outer_env);
+    } else if (spare_frames.empty()) {
+      local = std::allocate_shared<environment>(HeapAllocator<environment>(),
+                                                func.outer_env);
+    } else {
+      local = std::move(spare_frames.back());
+      spare_frames.pop_back();
+      local->outer = func.outer_env;
     }
-    emit();
-    return ret;
+    local->code = func.v_code;
+    local->slots.resize(code.locals.size());
+    for (size_t i = 0; i < code.nparams; i++) {
+      local->slots[i] = i < nargs ? bound(arg(i)) : Value(nil);
+    }
+    return local;
   }
-};
 
-std::vector<std::string> tokenize(const std::string &s) {
-  return Tokenizer(s).tokenize();
-}
+  // Argument vectors for builtins, which keep their capacity from call to
+  // call. A builtin may call back into the VM, so each level of nesting has
+  // its own; a deque leaves the outer ones where they are as it grows.
+  std::deque<std::vector<snode>> builtin_args;
+  size_t builtin_depth = 0;
 
-std::map<std::string, size_t, std::less<>> symcode;
-std::vector<std::string> symname;
+  // A call's frame has been pushed, or is being popped.
+  static void entered(Frame &frame) {
+    if (profile_mode.load(std::memory_order_relaxed) != PROFILE_OFF) {
+      frame.profiled = true;
+      profile_enter(frame.code);
+    }
+  }
+  static void leaving(const Frame &frame) {
+    if (frame.profiled)
+      profile_leave();
+  }
 
-size_t ToCode(std::string_view name) {
-  auto found = symcode.find(name);
-  if (found != symcode.end()) {
-    return found->second;
-  } else {
-    size_t r = symcode.size();
-    symcode[std::string(name)] = r;
-    symname.emplace_back(name);
-    return r;
+  // Done with the environment of a frame: keeps it for another if it is a
+  // leaf frame nothing else holds on to.
+  void retire(senvironment &env) {
+    if (env->code && env->code->leaf && env.use_count() == 1 &&
+        spare_frames.size() < kSpareFrames) {
+      env->slots.clear();
+      env->env.clear();
+      env->outer.reset();
+      spare_frames.push_back(std::move(env));
+    }
   }
-}
 
-class Parser {
- private:
-  size_t pos;
-  std::vector<std::string> tokens;
+  static environment *up(environment *env, uint32_t depth) {
+    for (; depth > 0; depth--)
+      env = env->outer.get();
+    return env;
+  }
 
- public:
-  Parser(const std::vector<std::string> &tokens) : pos(0), tokens(tokens) {}
-  std::vector<snode> parse() {
-    std::vector<snode> ret;
-    for (; pos < tokens.size(); pos++) {
-      std::string tok = tokens.at(pos);
-      if (tok[0] < 0)
-        break;                 // MSVC bug fix
-      if (tok.at(0) == '"') {  // double-quoted std::string
-        ret.push_back(std::make_shared<Node>(tok.substr(1)));
-      } else if (tok == "(") {  // list
-        pos++;
-        ret.push_back(std::make_shared<Node>(parse()));
-      } else if (tok == ")") {  // end of list
-        break;
-      } else if (isdigit(tok.at(0)) || (tok.at(0) == '-' && tok.length() >= 2 &&
-                                        isdigit(tok.at(1)))) {  // number
-        if (tok.find('.') != std::string::npos ||
-            tok.find('e') != std::string::npos) {  // double
-          ret.push_back(std::make_shared<Node>(atof(tok.c_str())));
-        } else {
-          ret.push_back(std::make_shared<Node>(atoi(tok.c_str())));
-        }
-      } else {  // symbol
-        Node n;
-        n.type = Node::T_SYMBOL;
-        n.v_string = tok;
-        n.code = ToCode(tok);
-        ret.push_back(std::make_shared<Node>(n));
+  // Where a binding is, locked for as long as this is kept.
+  struct Place {
+    Value *value = nullptr;  // if bound
+    Lock frame_lock;
+    WriteLock global_lock;
+  };
+
+  // Finds where `b` is bound as seen from `env`: in one of its slots or in the
+  // global table.
+  static Place lookup(environment *env, const Binding &b) {
+    Place place;
+    for (auto [depth, slot] : b.slots) {
+      environment *e = up(env, depth);
+      Lock lock = lock_env(e);
+      Value &value = e->slots[slot];
+      if (value) {
+        place.value = &value;
+        place.frame_lock = std::move(lock);
+        return place;
       }
     }
-    return ret;
+    place.global_lock = write_global(b.code);
+    place.value = context->globals->slot(b.code);
+    return place;
   }
-};
 
-std::vector<snode> parse(const std::string &s) {
-  return Parser(tokenize(s)).parse();
-}
+  // The value of global `code`, if bound.
+  static Value global(size_t code) {
+    ReadLock lock = read_global(code);
+    Value *found = context->globals->slot(code);
+    return found ? *found : Value();
+  }
 
-environment::environment() : outer(NULL) {}
-environment::environment(senvironment outer) : outer(outer) {}
+  // Binds `code` in `env`, which has no slot for it, and returns the binding.
+  static Value define(environment &env, size_t code, Value value) {
+    if (env.global) {
+      grow_globals(env, code);
+      WriteLock lock = write_global(code);
+      return env.slots[code] = std::move(value);
+    }
+    return env.set(code, value.to_snode());
+  }
 
-snode environment::get(size_t code) {
-  auto found = env.find(code);
-  if (found != env.end()) {
-    return found->second;
-  } else {
-    if (outer != NULL) {
-      return outer->get(code);
+  void execute(size_t depth);
+  void step(Frame &frame, const Instr &in);
+  void special(const Instr &in);
+  bool skip_call(const Instr &in);
+  bool fall_back(const Instr &in);
+  void invoke(size_t nargs, bool tail = false);
+  void run_native(const scode &code, senvironment env, bool fn = true);
+  bool intact(const Instr &in);
+  bool hinted(const Instr &in);
+  bool primitive(const Instr &in);
+  void run_arith(const Instr &in);
+};
+
+// Calls the callee below the top `nargs` values. An interpreted fn gets a new
+// frame, which the caller continues with, or with `tail` takes over the current
+// one; for anything else the call is replaced with its result.
+void VM::invoke(size_t nargs, bool tail) {
+  size_t base = stack.size() - nargs - 1;
+  snode func = stack[base].tag == Value::BOXED ? stack[base].box : nil;
+  if (func->type == Node::T_FN) {
+    // A safe point: whatever is in use is on the stack or in frames.
+    if (gc_due())
+      collect();
+    count_call(ensure_code(*func));
+    Value *args = &stack[base + 1];
+    senvironment local =
+        bind(*func, nargs, [&](size_t i) { return std::move(args[i]); });
+    stack.resize(base);
+    const scode &code = func->v_code;
+    const Instr *start = code->native ? nullptr : code->ops.data();
+    if (tail && !frames.back().ip) {  // from native code; see run_native
+      leaving(frames.back());
+      retire(frames.back().env);
+      frames.back() = {code, start, std::move(local)};
+      entered(frames.back());
+      handed_over = true;
+    } else if (!start) {
+      run_native(code, std::move(local));
+    } else if (tail) {
+      leaving(frames.back());
+      retire(frames.back().env);
+      frames.back() = {code, start, std::move(local)};
+      entered(frames.back());
     } else {
-      return nil;
+      frames.push_back({code, start, std::move(local)});
+      entered(frames.back());
+    }
+  } else if (func->type == Node::T_BUILTIN) {
+    if (builtin_depth == builtin_args.size())
+      builtin_args.emplace_back();
+    std::vector<snode> &args = builtin_args[builtin_depth++];
+    for (size_t i = base + 1; i < stack.size(); i++) {
+      Value &arg = stack[i];
+      args.push_back(arg.tag == Value::BOXED ? std::move(arg.box)
+                                             : arg.to_snode());
     }
+    stack.resize(base);
+    // The frame's environment is copied: the builtin may grow frames.
+    senvironment local_env = frames.back().env;
+    snode result = func->v_builtin(args, local_env);
+    args.clear();
+    builtin_depth--;
+    stack.push_back(std::move(result));
+  } else {
+    stack.resize(base);
+    stack.push_back(nil);
   }
 }
 
-snode environment::get(snode &k) { return get(k->code); }
+// Runs compiled `code` in a frame of its own, leaving its result on the stack.
+// A tail call out of native code hands the frame over to the callee and
+// returns, so the callee is run from here instead of deeper in the C++ stack.
+void VM::run_native(const scode &code, senvironment env, bool fn) {
+  size_t depth = frames.size();
+  frames.push_back({code, nullptr, std::move(env)});
+  if (fn)
+    entered(frames.back());
+  while (true) {
+    scode current = frames.back().code;
+    current->native.load(std::memory_order_acquire)(this);
+    if (!handed_over)
+      break;
+    handed_over = false;
+    if (frames.back().ip) {
+      execute(depth);
+      return;
+    }
+  }
+  leaving(frames.back());
+  retire(frames.back().env);
+  frames.pop_back();
+}
 
-snode environment::set(snode &k, snode &v) { return env[k->code] = v; }
+// Whether the symbol of arithmetic opcode `in` is still bound to its builtin.
+bool VM::intact(const Instr &in) {
+  ReadLock lock = read_global(in.b);
+  Value *f = context->globals->slot(in.b);
+  return f && f->tag == Value::BOXED && f->box->type == Node::T_BUILTIN &&
+         f->box->v_builtin == primitive_builtin(in.op);
+}
 
-snode fn(snode n, std::shared_ptr<environment> outer_env) {
-  snode n2(n);
-  n2->type = Node::T_FN;
-  n2->outer_env = outer_env;
-  return n2;
+// Runs the arithmetic opcode `in` on two operands of the types its hint names,
+// replacing them with the result. Returns false, leaving the stack alone, if
+// they are not of those types or its symbol was rebound.
+bool VM::hinted(const Instr &in) {
+  uint8_t hint = hint_of(in).load(std::memory_order_relaxed);
+  if (hint != HINT_INT && hint != HINT_DOUBLE)
+    return false;
+  Value &x = stack.end()[-2];
+  Value &y = stack.end()[-1];
+  Value result;
+  if (hint == HINT_INT) {
+    int i, j;
+    if (!int_operand(x, i) || !int_operand(y, j) || !intact(in))
+      return false;
+    result = binary(in.op, i, j);
+  } else {
+    double d;
+    if (!double_operand(x, d) || !is_number(y) || !intact(in))
+      return false;
+    result = binary(in.op, d, double_of(y));
+  }
+  stack.pop_back();
+  stack.back() = std::move(result);
+  return true;
 }
 
-std::map<std::string, std::vector<snode>> macros;
+// Runs the arithmetic opcode `in` inline, replacing its arguments with the
+// result. Returns false, leaving the stack alone, if its symbol was rebound or
+// an argument is not of a type handled here.
+bool VM::primitive(const Instr &in) {
+  if (!intact(in))
+    return false;
 
-snode apply_macro(snode body, std::map<std::string, snode> vars) {
-  if (body->type == Node::T_LIST) {
-    std::vector<snode> &bvec = body->v_list;
-    std::vector<snode> ret;
-    for (unsigned int i = 0; i < bvec.size(); i++) {
-      snode b = bvec.at(i);
-      if (b->v_string == "...") {
-        snode &vargs = vars[b->v_string];
-        ret.insert(ret.end(), vargs->v_list.begin(), vargs->v_list.end());
-      } else
-        ret.push_back(apply_macro(bvec.at(i), vars));
-    }
-    return std::make_shared<Node>(ret);
-  } else {
-    std::string &bstr = body->v_string;
-    if (vars.find(bstr) != vars.end())
-      return vars[bstr];
+  size_t nargs = in.a;
+  Value *args = stack.data() + (stack.size() - nargs);
+  Value result;
+  if (in.op == OP_NOT) {
+    Value &x = args[0];
+    if (x.tag == Value::BOOL)
+      result = !x.v_bool;
+    else if (x.tag == Value::BOXED && x.box->type == Node::T_BOOL)
+      result = !x.box->v_bool;
     else
-      return body;
-  }
-}
-
-snode macroexpand(snode n) {
-  std::vector<snode> nList = n->v_list;
-  if (macros.find(nList[0]->v_string) != macros.end()) {
-    std::vector<snode> &macro = macros[nList[0]->v_string];
-    std::map<std::string, snode> macrovars;
-    std::vector<snode> &argsyms = macro[0]->v_list;
-    for (unsigned int i = 0; i < argsyms.size(); i++) {
-      std::string argsym = argsyms.at(i)->v_string;
-      if (argsym == "...") {
-        std::vector<snode> ellipsis;
-        snode n2(std::make_shared<Node>(ellipsis));
-        std::vector<snode> &ellipsis2 = n2->v_list;
-        for (unsigned int i2 = i + 1; i2 < nList.size(); i2++)
-          ellipsis2.push_back(nList.at(i2));
-        macrovars[argsym] = n2;
+      return false;
+  } else {
+    for (size_t i = 0; i < nargs; i++) {
+      if (!is_number(args[i]))
+        return false;
+    }
+    switch (in.op) {
+      case OP_MOD:
+        result = int_of(args[0]) % int_of(args[1]);
+        break;
+      case OP_LT:
+        result = is_int(args[0]) ? int_of(args[0]) < int_of(args[1])
+                                 : double_of(args[0]) < double_of(args[1]);
+        break;
+      case OP_EQ: {
+        bool eq = true;
+        for (size_t i = 1; i < nargs && eq; i++) {
+          eq = is_int(args[0]) ? int_of(args[i]) == int_of(args[0])
+                               : double_of(args[i]) == double_of(args[0]);
+        }
+        result = eq;
         break;
-      } else {
-        macrovars[argsyms.at(i)->v_string] = nList.at(i + 1);
       }
-    }
-    return apply_macro(macro[1], macrovars);
-  } else
-    return n;
-}
-
-snode compile(snode &n) {
-  switch (n->type) {
-    case Node::T_LIST:  // function (FUNCTION ARGUMENT ..)
-    {
-      if (n->v_list.size() == 0)
-        return n;
-      snode func = compile(n->v_list[0]);
-      if (func->type == Node::T_SYMBOL &&
-          func->v_string ==
-              "defmacro") {  // (defmacro add (a b) (+ a b)) ; define macro
-        std::vector<snode> v;
-        v.push_back(n->v_list[2]);
-        v.push_back(n->v_list[3]);
-        macros[n->v_list[1]->v_string] = v;
-        return nil;
-      } else if (func->type == Node::T_SYMBOL &&
-                 func->v_string == "quote") {  // ignore macro
-        return n;
-      } else {
-        if (macros.find(func->v_string) != macros.end()) {
-          snode expanded = macroexpand(n);
-          return compile(expanded);
+      default:
+        if (nargs == 0) {
+          result = in.op == OP_ADD || in.op == OP_SUB ? 0 : 1;
+        } else if (is_int(args[0])) {
+          int acc = int_of(args[0]);
+          for (size_t i = 1; i < nargs; i++)
+            acc = arith(in.op, acc, int_of(args[i]));
+          result = acc;
         } else {
-          std::vector<snode> r;
-          for (std::vector<snode>::iterator i = n->v_list.begin();
-               i != n->v_list.end(); i++) {
-            r.push_back(compile(*i));
-          }
-          return std::make_shared<Node>(r);
+          double acc = double_of(args[0]);
+          for (size_t i = 1; i < nargs; i++)
+            acc = arith(in.op, acc, double_of(args[i]));
+          result = acc;
         }
-      }
+        break;
     }
-    default:
-      return n;
   }
+  if (nargs == 2)
+    observe(in, args[0], args[1]);
+  stack.resize(stack.size() - nargs);
+  stack.push_back(std::move(result));
+  return true;
 }
 
-snode eval(snode &n, senvironment &env) {
-  switch (n->type) {
-    case Node::T_SYMBOL: {
-      // snode n2 = env.get(n);
-      // if (n2->type != Node::T_NIL) {
-      //	return n2;
-      // }
-      // else {
-      //	cerr << "Unknown variable: " << n->v_string << endl;
-      //	return nil;
-      // }
-      return env->get(n);
-    }
-    case Node::T_LIST:  // function (FUNCTION ARGUMENT ..)
-    {
-      auto &list = n->v_list;
-      if (list.empty())
-        return nil;
+// Runs the arithmetic opcode `in`, inline if possible, or else by calling
+// whatever its symbol is bound to.
+void VM::run_arith(const Instr &in) {
+  if (hinted(in) || primitive(in))
+    return;
+  Value callee = global(in.b);
+  if (!callee)
+    callee = frames.back().env->get(in.b);
+  stack.insert(stack.end() - in.a, std::move(callee));
+  invoke(in.a);
+}
 
-      snode func = eval(n->v_list[0], env);
-      switch (func->type) {
-        case Node::T_SPECIAL: {
-          return func->v_builtin(n->v_list, env);
+// The instructions which neither jump nor call.
+void VM::step(Frame &frame, const Instr &in) {
+  switch (in.op) {
+    case OP_NIL:
+      stack.push_back(nil);
+      break;
+    case OP_CONST:
+      stack.push_back(frame.code->consts[in.a]);
+      break;
+    case OP_LOAD_LOCAL: {
+      environment *env = up(frame.env.get(), in.a);
+      Lock lock = lock_env(env);
+      stack.push_back(env->slots[in.b]);
+      break;
+    }
+    case OP_LOAD_GLOBAL: {
+      // Symbols nothing binds lexically may still be bound by name, eg.
+      // through eval, so fall back to a lookup in that case.
+      Value found = global(in.a);
+      stack.push_back(found ? std::move(found) : Value(frame.env->get(in.a)));
+      break;
+    }
+    case OP_LOAD: {
+      const Binding &b = frame.code->bindings[in.a];
+      Value found;
+      if (Place place = lookup(frame.env.get(), b); place.value)
+        found = *place.value;
+      stack.push_back(found ? std::move(found) : Value(frame.env->get(b.code)));
+      break;
+    }
+    case OP_REF_LOCAL: {
+      environment *env = up(frame.env.get(), in.a);
+      Lock lock = lock_env(env);
+      stack.push_back(env->slots[in.b].boxed());
+      break;
+    }
+    case OP_REF_GLOBAL: {
+      snode found;
+      if (WriteLock lock = write_global(in.a);
+          Value *value = context->globals->slot(in.a))
+        found = value->boxed();
+      stack.push_back(found ? std::move(found) : frame.env->get(in.a));
+      break;
+    }
+    case OP_REF: {
+      const Binding &b = frame.code->bindings[in.a];
+      snode found;
+      if (Place place = lookup(frame.env.get(), b); place.value)
+        found = place.value->boxed();
+      stack.push_back(found ? std::move(found) : frame.env->get(b.code));
+      break;
+    }
+    case OP_DEF_LOCAL: {
+      Value value = copy_of(stack.back());
+      Lock lock = lock_env(frame.env.get());
+      frame.env->slots[in.a] = value;
+      stack.back() = std::move(value);
+      break;
+    }
+    case OP_DEF:
+      stack.back() = define(*frame.env, in.a, copy_of(stack.back()));
+      break;
+    case OP_SET: {
+      const Binding &b = frame.code->bindings[in.a];
+      snode var = nil;
+      if (Place place = lookup(frame.env.get(), b); place.value) {
+        Value &found = *place.value;
+        if (found.tag != Value::BOXED) {
+          found = copy_of(stack.back());
+          stack.back() = found;
+          break;
         }
-        case Node::T_BUILTIN:
-        case Node::T_FN: {
-          // evaluate arguments
-          std::vector<snode> args;
-          environment env2(func->outer_env);
-          args.reserve(n->v_list.size() - 1);
-          for (auto i = n->v_list.begin() + 1; i != n->v_list.end(); i++) {
-            args.push_back(eval(*i, env));
-          }
-          senvironment senv2(std::make_shared<environment>(env2));
-          return apply(func, args, senv2);
+        var = found.box;
+      }
+      // Bound to nil itself, which set never updates, or else maybe bound by
+      // name, eg. through eval.
+      if (var == nil)
+        var = frame.env->get(b.code);
+      if (var == nil) {  // new variable
+        Value value = copy_of(stack.back());
+        if (!b.slots.empty() && b.slots[0].first == 0) {
+          Lock lock = lock_env(frame.env.get());
+          frame.env->slots[b.slots[0].second] = value;
+        } else {
+          value = define(*frame.env, b.code, std::move(value));
         }
-        default:
-          return nil;
-      }  // end switch (func->type)
+        stack.back() = std::move(value);
+      } else {
+        store_into(stack.back(), *var);
+        stack.back() = var;
+      }
+      break;
+    }
+    case OP_SET_PLACE: {
+      Value value = std::move(stack.back());
+      stack.pop_back();
+      Value &place = stack.back();
+      if (place.tag == Value::BOXED && place.box != nil)
+        store_into(value, *place.box);
+      else
+        place = std::move(value);
+      break;
+    }
+    case OP_POP:
+      stack.pop_back();
+      break;
+    case OP_CLOSURE: {
+      Node n(frame.code->consts[in.b].box->v_list);
+      n.type = Node::T_FN;
+      n.outer_env = frame.env;
+      n.v_code = frame.code->protos[in.a];
+      stack.push_back(make_snode(std::move(n)));
+      break;
     }
     default:
-      return n;
+      assert(false && "not a straight-line instruction");
   }
 }
 
-std::vector<snode> compile_all(std::vector<snode> &lst) {
-  std::vector<snode> compiled;
-  for (size_t i = 0; i < lst.size(); i++) {
-    compiled.push_back(compile(lst[i]));
-  }
-  return compiled;
+void VM::special(const Instr &in) {
+  // The special may re-enter the VM, so nothing can point into frames.
+  scode code = frames.back().code;
+  senvironment local_env = frames.back().env;
+  builtin special = code->consts[in.a].box->v_builtin;
+  snode result = special(code->consts[in.b].box->v_list, local_env);
+  stack.push_back(std::move(result));
 }
 
-snode eval_all(std::vector<snode> &lst) {
-  if (lst.empty())
-    return nil;
-  size_t last = lst.size() - 1;
-  for (size_t i = 0; i < last; i++) {
-    eval(lst[i], global_env);
+// OP_PREPARE_CALL. Returns true if the call is to be skipped.
+bool VM::skip_call(const Instr &in) {
+  Value &callee = stack.back();
+  if (callee.tag == Value::BOXED && (callee.box->type == Node::T_BUILTIN ||
+                                     callee.box->type == Node::T_FN))
+    return false;
+  if (callee.tag == Value::BOXED && callee.box->type == Node::T_SPECIAL) {
+    builtin special = callee.box->v_builtin;
+    scode code = frames.back().code;
+    senvironment local_env = frames.back().env;
+    snode result = special(code->consts[in.a].box->v_list, local_env);
+    stack.back() = std::move(result);
+  } else {
+    stack.back() = nil;
   }
-  return eval(lst[last], global_env);
+  return true;
 }
 
-template <typename T>
-void print_map_keys(std::map<std::string, T> &m) {
-  int i = 0;
-  for (typename std::map<std::string, T>::iterator iter = m.begin();
-       iter != m.end(); iter++) {
-    printf(" %s", iter->first.c_str());
-    i++;
-    if (i % 10 == 0)
-      puts("");
+// OP_GUARD. Returns true if a binding changed, having run the form instead.
+bool VM::fall_back(const Instr &in) {
+  scode code = frames.back().code;
+  const std::vector<snode> &guard = code->consts[in.a].box->v_list;
+  for (size_t i = 1; i + 1 < guard.size(); i += 2) {
+    if (!bound_as(guard[i]->code, *guard[i + 1])) {
+      senvironment local_env = frames.back().env;
+      snode form = guard[0];
+      stack.push_back(eval(form, local_env));
+      return true;
+    }
   }
-  puts("");
+  return false;
 }
 
-void print_logo() {
-  printf(
-      "Paren %s (C) 2013-2014 Kim, Taegyoon "
-      "(https://bitbucket.org/ktg/paren)\n",
-      PAREN_VERSION);
-  printf("Predefined Symbols:");
-  std::vector<std::string> v;
-  for (auto iter = global_env->env.begin(); iter != global_env->env.end();
-       iter++) {
-    v.push_back(symname[iter->first]);
+snode VM::run(scode &entry, senvironment &env, bool fn) {
+  if (entry->native) {
+    run_native(entry, env, fn);
+  } else {
+    size_t depth = frames.size();
+    frames.push_back({entry, entry->ops.data(), env});
+    if (fn)
+      entered(frames.back());
+    execute(depth);
   }
-  sort(v.begin(), v.end());
-  for (std::vector<std::string>::iterator iter = v.begin(); iter != v.end();
-       iter++) {
-    printf(" %s", (*iter).c_str());
+  Value result = std::move(stack.back());
+  stack.pop_back();
+  return result.to_snode();
+}
+
+// Interprets the frames above `depth` until they have all returned.
+void VM::execute(size_t depth) {
+  Frame *frame = &frames.back();
+  const Instr *ip = frame->ip;
+
+  while (true) {
+    const Instr &in = *ip++;
+    switch (in.op) {
+      case OP_JUMP:
+        ip = frame->code->ops.data() + in.a;
+        break;
+      case OP_JUMP_IF_FALSE: {
+        bool cond = truthy(stack.back());
+        stack.pop_back();
+        if (!cond)
+          ip = frame->code->ops.data() + in.a;
+        break;
+      }
+      case OP_SPECIAL:
+        frame->ip = ip;
+        special(in);
+        frame = &frames.back();
+        break;
+      case OP_PREPARE_CALL:
+        frame->ip = ip;
+        if (skip_call(in)) {
+          frame = &frames.back();
+          ip = frame->code->ops.data() + in.b;
+        }
+        break;
+      case OP_GUARD:
+        frame->ip = ip;
+        if (fall_back(in)) {
+          frame = &frames.back();
+          ip = frame->code->ops.data() + in.b;
+        }
+        break;
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_MOD:
+      case OP_LT:
+      case OP_EQ:
+      case OP_NOT:
+        frame->ip = ip;
+        run_arith(in);
+        frame = &frames.back();
+        ip = frame->ip;
+        break;
+      case OP_CALL:
+      case OP_TAIL_CALL:
+        frame->ip = ip;
+        invoke(in.a, in.op == OP_TAIL_CALL);
+        frame = &frames.back();
+        ip = frame->ip;
+        break;
+      case OP_RETURN:
+        leaving(*frame);
+        retire(frame->env);
+        frames.pop_back();
+        if (frames.size() == depth)
+          return;
+        frame = &frames.back();
+        ip = frame->ip;
+        break;
+      default:
+        step(*frame, in);
+        break;
+    }
   }
-  puts("");
+}
 
-  puts("Macros:");
-  print_map_keys(macros);
+void VM::exec(uint32_t pc) {
+  Frame &frame = frames.back();
+  const Instr &in = frame.code->ops[pc];
+  if (in.op == OP_SPECIAL)
+    special(in);
+  else
+    step(frame, in);
 }
 
-void prompt() { printf("> "); }
+bool VM::pop_truthy() {
+  bool cond = truthy(stack.back());
+  stack.pop_back();
+  return cond;
+}
 
-void prompt2() { printf("  "); }
+bool VM::prepare_call(uint32_t pc) {
+  return skip_call(frames.back().code->ops[pc]);
+}
 
-snode eval_string(std::string &s) {
-  std::vector<snode> vec = parse(s);
-  std::vector<snode> compiled = compile_all(vec);
-  return eval_all(compiled);
+bool VM::guard(uint32_t pc) { return fall_back(frames.back().code->ops[pc]); }
+
+// OP_CALL or an arithmetic opcode, run to completion.
+void VM::call(uint32_t pc) {
+  Instr in = frames.back().code->ops[pc];
+  size_t depth = frames.size();
+  if (in.op == OP_CALL)
+    invoke(in.a);
+  else
+    run_arith(in);
+  if (frames.size() > depth)
+    execute(depth);
 }
 
-snode eval_string(const char *s) {
-  std::string s2(s);
-  return eval_string(s2);
+// OP_TAIL_CALL from native code. Returns true if the callee took over the
+// frame, to be run once the native code returns.
+bool VM::tail_call(uint32_t pc) {
+  Instr in = frames.back().code->ops[pc];
+  invoke(in.a, /*tail=*/true);
+  return handed_over;
 }
 
-inline void eval_print(std::string &s) {
-  puts(eval_string(s)->str_with_type().c_str());
+thread_local VM vm;
+
+}  // namespace
+
+scode lower(snode &n) {
+  scode code(std::make_shared<Code>());
+  BytecodeCompiler compiler(*code, nullptr);
+  compiler.compile_expr(n);
+  code->ops.push_back({OP_RETURN, 0, 0});
+  return code;
 }
 
-// read-eval-print loop
-void repl() {
-  std::string code;
-  while (true) {
-    if (code.length() == 0)
-      prompt();
-    else
-      prompt2();
-    std::string line;
-    if (!getline(std::cin, line)) {  // EOF
-      eval_print(code);
-      return;
-    }
-    code += '\n' + line;
-    Tokenizer t(code);
-    t.tokenize();
-    if (t.unclosed <= 0) {  // no unmatched parenthesis nor quotation
-      eval_print(code);
-      code = "";
+snode run(scode &code, senvironment &env) { return vm.run(code, env); }
+
+namespace {
+
+std::string anonymous_name(const Code &code) {
+  std::string name = "(fn (";
+  for (size_t i = 0; i < code.nparams; i++) {
+    if (i > 0)
+      name += ' ';
+    name += SymbolName(code.locals[i]);
+  }
+  return name + "))";
+}
+
+// Names fn bodies by the globals bound to them, and the fns made in those
+// after them, eg. "outer/(fn (x))".
+void name_fns(HashMap<const Code *, std::string> &names, const Code &code,
+              const std::string &name) {
+  if (!names.emplace(&code, name).second)
+    return;
+  for (const scode &proto : code.protos)
+    name_fns(names, *proto, name + '/' + anonymous_name(*proto));
+}
+
+class FnNames {
+ public:
+  FnNames() {
+    for (size_t code = 0; code < context->globals->slots.size(); code++) {
+      Value global;
+      {
+        ReadLock lock = read_global(code);
+        global = context->globals->slots[code];
+      }
+      if (global.tag == Value::BOXED && global.box->type == Node::T_FN &&
+          global.box->v_code)
+        name_fns(names, *global.box->v_code, SymbolName(code));
     }
   }
+
+  const std::string &operator()(const Code *code) {
+    if (std::string *name = names.find(code))
+      return *name;
+    return *names.emplace(code, anonymous_name(*code)).first;
+  }
+
+ private:
+  HashMap<const Code *, std::string> names;
+};
+
+void stop_sampling() {
+  set_sample_timer(0);
+  sampling.store(false);
+  while (sampling_handlers.load() > 0)
+    std::this_thread::yield();
 }
 
-snode get(const char *name) {
-  std::string s(name);
-  return global_env->get(ToCode(s));
+// One line per fn, those that took longest by themselves first.
+void write_calls(FILE *out, FnNames &names) {
+  std::vector<const CallStats *> rows;
+  for (auto &[code, stats] : profile_totals)
+    rows.push_back(&stats);
+  std::sort(rows.begin(), rows.end(), [](auto *a, auto *b) {
+    return a->exclusive_ns != b->exclusive_ns
+               ? a->exclusive_ns > b->exclusive_ns
+               : a->calls > b->calls;
+  });
+  fprintf(out, "%12s %14s %14s %12s  %s\n", "calls", "inclusive-ms",
+          "exclusive-ms", "allocs", "fn");
+  for (const CallStats *row : rows) {
+    fprintf(out, "%12llu %14.3f %14.3f %12llu  %s\n",
+            static_cast<unsigned long long>(row->calls),
+            static_cast<double>(row->inclusive_ns) / 1e6,
+            static_cast<double>(row->exclusive_ns) / 1e6,
+            static_cast<unsigned long long>(row->allocs),
+            names(row->code.get()).c_str());
+  }
 }
 
-void set(const char *name, Node value) {
-  std::string s(name);
-  global_env->env[ToCode(s)] = std::make_shared<Node>(value);
+// Folded stacks, one line per stack with the number of samples of it.
+void write_samples(FILE *out, FnNames &names) {
+  HashMap<std::string, size_t> stacks;
+  size_t used = std::min(samples_used.load(), kSampleWords);
+  size_t at = 0;
+  while (at < used && samples[at] != kNoSample) {
+    size_t depth = samples[at];
+    std::string stack = depth ? "" : "(top level)";
+    for (size_t i = 0; i < depth; i++) {
+      if (i > 0)
+        stack += ';';
+      stack += names(reinterpret_cast<const Code *>(samples[at + 1 + i]));
+    }
+    stacks[stack]++;
+    at += depth + 1;
+  }
+  std::vector<std::pair<std::string, size_t>> lines(stacks.begin(),
+                                                    stacks.end());
+  std::sort(lines.begin(), lines.end());
+  for (auto &[stack, count] : lines)
+    fprintf(out, "%s %zu\n", stack.c_str(), count);
 }
 
-// extracts characters from filename and stores them into str
-bool slurp(std::string_view filename, std::string &str) {
-  std::ifstream input(filename.data());
-  if (!input)
+}  // namespace
+
+bool profile_start(std::string_view mode) {
+  int next = mode == "calls"    ? PROFILE_CALLS
+             : mode == "sample" ? PROFILE_SAMPLE
+                                : PROFILE_OFF;
+  if (next == PROFILE_OFF)
     return false;
+  stop_sampling();
+  {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    profile_totals.clear();
+    profile_generation.fetch_add(1);
+  }
+  if (next == PROFILE_SAMPLE) {
+    if (!samples)
+      samples.reset(new uintptr_t[kSampleWords]);
+    samples_used.store(0);
+    struct sigaction action = {};
+    action.sa_handler = take_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+    sampling.store(true);
+    set_sample_timer(kSampleMicros);
+  }
+  profile_mode.store(next);
+  return true;
+}
 
-  std::stringstream buff;
-  buff << input.rdbuf();
-  str = buff.str();
+bool profile_report(std::string_view path) {
+  int mode = profile_mode.exchange(PROFILE_OFF);
+  if (mode == PROFILE_OFF)
+    return false;
+  stop_sampling();
+  merge_profile();
+  FILE *out = path.empty() ? stderr : fopen(std::string(path).c_str(), "w");
+  if (!out)
+    return false;
+  {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    FnNames names;
+    if (mode == PROFILE_CALLS)
+      write_calls(out, names);
+    else
+      write_samples(out, names);
+  }
+  if (out != stderr)
+    fclose(out);
   return true;
 }
 
-// Opposite of slurp. Writes str to filename.
-int spit(std::string_view filename, std::string_view str) {
-  std::ofstream output(filename.data());
-  if (!output)
-    return -1;
+namespace {
 
-  output << str;
-  return static_cast<int>(str.size());
+// Image format: a table of symbol names, then the forms. Everything is
+// little-endian u32s, except doubles, and lengths come before what they count.
+// Instruction operands naming symbols refer to the table.
+bool names_symbol(Opcode op) {
+  return op == OP_LOAD_GLOBAL || op == OP_REF_GLOBAL || op == OP_DEF;
 }
 
-snode special_def(
-    std::vector<snode> &raw_args,
-    senvironment &env) {  // (def SYMBOL VALUE) ; set in the current environment
-  snode value = std::make_shared<Node>(*eval(raw_args[2], env));
-  return env->set(raw_args[1], value);
-}
+bool is_arith(Opcode op) { return op >= OP_ADD && op <= OP_NOT; }
 
-snode special_if(std::vector<snode> &raw_args,
-                 senvironment &env) {  // (if CONDITION THEN_EXPR {ELSE_EXPR})
-  snode &cond = raw_args[1];
-  if (eval(cond, env)->v_bool) {
-    return eval(raw_args[2], env);
-  } else {
-    if (raw_args.size() < 4)
-      return nil;
-    return eval(raw_args[3], env);
+// What eval_file keeps of a source file: what it was made from, and the forms
+// parsing and macro expansion made of it, along with the defmacro forms run on
+// the way. A source image starts with kSourceImageMagic and this key, before
+// the symbol table.
+struct SourceImage {
+  std::string path;  // absolute
+  uint64_t mtime = 0;
+  uint64_t size = 0;
+  uint64_t hash = 0;         // of the contents
+  uint64_t macro_state = 0;  // before expanding them
+  std::vector<snode> macros;
+  std::vector<snode> forms;
+};
+
+constexpr std::string_view kSourceImageMagic = "paren-source-1\n";
+
+class ImageWriter {
+ public:
+  bool save(const std::vector<scode> &forms, std::string &image) {
+    put(forms.size());
+    for (const scode &code : forms) {
+      if (!put(*code))
+        return false;
+    }
+    std::string body = std::move(out);
+    out.clear();
+    put_symbols();
+    image = out + body;
+    return true;
   }
-}
 
-snode special_set(std::vector<snode> &raw_args,
-                  senvironment &env) {  // (set SYMBOL-OR-PLACE VALUE)
-  snode var = eval(raw_args[1], env);
-  snode value = std::make_shared<Node>(*eval(raw_args[2], env));
-  if (raw_args[1]->type == Node::T_SYMBOL && var == nil) {  // new variable
-    return env->set(raw_args[1], value);
-  } else {
-    *var = *value;
-    return var;
+  bool save(const SourceImage &source, std::string &image) {
+    if (!put(source.macros) || !put(source.forms))
+      return false;
+    std::string body = std::move(out);
+    out = kSourceImageMagic;
+    put(source.path.size());
+    out += source.path;
+    put64(source.mtime);
+    put64(source.size);
+    put64(source.hash);
+    put64(source.macro_state);
+    put_symbols();
+    image = out + body;
+    return true;
   }
-}
 
-snode special_fn(
-    std::vector<snode> &raw_args,
-    senvironment &env) {  // (fn (ARGUMENT ..) BODY) => lexical closure
-  snode n2 =
-      fn(std::make_shared<Node>(raw_args), std::make_shared<environment>(env));
-  return n2;
-}
+ private:
+  std::string out;
+  HashMap<size_t, uint32_t> symbol_index;
+  std::vector<size_t> symbols;
 
-snode builtin_plus(std::vector<snode> &args, senvironment &env) {  // (+ X ..)
-  size_t len = args.size();
-  if (len <= 0)
-    return node_0;
-  snode first = args[0];
-  if (first->type == Node::T_INT) {
-    int sum = first->v_int;
-    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
-         i++) {
-      sum += (*i)->to_int();
+  void put(size_t x) {
+    uint32_t u = static_cast<uint32_t>(x);
+    for (int i = 0; i < 4; i++)
+      out += static_cast<char>((u >> (8 * i)) & 0xff);
+  }
+
+  void put64(uint64_t x) {
+    put(static_cast<uint32_t>(x));
+    put(static_cast<uint32_t>(x >> 32));
+  }
+
+  // The table can only be written once everything referring to it has been.
+  void put_symbols() {
+    put(symbols.size());
+    for (size_t code : symbols) {
+      put(SymbolName(code).size());
+      out += SymbolName(code);
     }
-    return std::make_shared<Node>(sum);
-  } else {
-    double sum = first->v_double;
-    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
-         i++) {
-      sum += (*i)->to_double();
+  }
+
+  void put_symbol(size_t code) {
+    auto [found, inserted] =
+        symbol_index.emplace(code, static_cast<uint32_t>(symbols.size()));
+    if (inserted)
+      symbols.push_back(code);
+    put(*found);
+  }
+
+  void put_double(double d) {
+    char bytes[sizeof(d)];
+    memcpy(bytes, &d, sizeof(d));
+    out.append(bytes, sizeof(d));
+  }
+
+  bool put(const Code &code) {
+    put(code.ops.size());
+    for (const Instr &in : code.ops) {
+      put(in.op);
+      if (names_symbol(in.op))
+        put_symbol(in.a);
+      else
+        put(in.a);
+      if (is_arith(in.op))
+        put_symbol(in.b);
+      else
+        put(in.b);
+    }
+    put(code.consts.size());
+    for (const Value &value : code.consts) {
+      if (!put(value))
+        return false;
     }
-    return std::make_shared<Node>(sum);
+    put(code.protos.size());
+    for (const scode &proto : code.protos) {
+      if (!put(*proto))
+        return false;
+    }
+    put(code.bindings.size());
+    for (const Binding &b : code.bindings) {
+      put_symbol(b.code);
+      put(b.slots.size());
+      for (auto [depth, slot] : b.slots) {
+        put(depth);
+        put(slot);
+      }
+    }
+    put(code.nparams);
+    put(code.locals.size());
+    for (size_t local : code.locals)
+      put_symbol(local);
+    return true;
   }
-}
 
-snode builtin_minus(std::vector<snode> &args, senvironment &env) {  // (- X ..)
-  size_t len = args.size();
-  if (len <= 0)
-    return node_0;
-  snode first = args[0];
-  if (first->type == Node::T_INT) {
-    int sum = first->v_int;
-    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
-         i++) {
-      sum -= (*i)->to_int();
+  bool put(const Value &value) {
+    put(value.tag);
+    switch (value.tag) {
+      case Value::INT:
+        put(static_cast<uint32_t>(value.v_int));
+        return true;
+      case Value::DOUBLE:
+        put_double(value.v_double);
+        return true;
+      case Value::BOOL:
+        put(value.v_bool);
+        return true;
+      case Value::BOXED:
+        return put(*value.box);
+      default:
+        return false;
     }
-    return std::make_shared<Node>(sum);
-  } else {
-    double sum = first->v_double;
-    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
-         i++) {
-      sum -= (*i)->to_double();
+  }
+
+  bool put(const Node &n) {
+    put(n.type);
+    switch (n.type) {
+      case Node::T_NIL:
+        return true;
+      case Node::T_INT:
+        put(static_cast<uint32_t>(n.v_int));
+        return true;
+      case Node::T_DOUBLE:
+        put_double(n.v_double);
+        return true;
+      case Node::T_BOOL:
+        put(n.v_bool);
+        return true;
+      case Node::T_STRING:
+        put(n.v_string.size());
+        out += n.v_string;
+        return true;
+      case Node::T_SYMBOL:
+        put_symbol(n.code);
+        return true;
+      case Node::T_LIST:
+        return put(n.v_list);
+      case Node::T_SPECIAL:
+        // Specials are lowered into OP_SPECIAL only while bound to a global,
+        // so store them by that name.
+        for (size_t code = 0; code < context->globals->slots.size(); code++) {
+          const Value &global = context->globals->slots[code];
+          if (global.tag == Value::BOXED && global.box.get() == &n) {
+            put_symbol(code);
+            return true;
+          }
+        }
+        return false;
+      case Node::T_BUILTIN:
+        // Only in guards (see snapshot), so stored by the name of a global
+        // bound to the same builtin.
+        for (size_t code = 0; code < context->globals->slots.size(); code++) {
+          const Value &global = context->globals->slots[code];
+          if (global.tag == Value::BOXED &&
+              global.box->type == Node::T_BUILTIN &&
+              global.box->v_builtin == n.v_builtin) {
+            put_symbol(code);
+            return true;
+          }
+        }
+        return false;
+      default:
+        return false;
     }
-    return std::make_shared<Node>(sum);
   }
-}
 
-snode builtin_mul(std::vector<snode> &args, senvironment &env) {  // (* X ..)
-  size_t len = args.size();
-  if (len <= 0)
-    return node_1;
-  snode first = args[0];
-  if (first->type == Node::T_INT) {
-    int sum = first->v_int;
-    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
-         i++) {
-      sum *= (*i)->to_int();
+  bool put(const std::vector<snode> &list) {
+    put(list.size());
+    for (const snode &item : list) {
+      if (!put(*item))
+        return false;
+    }
+    return true;
+  }
+};
+
+class ImageReader {
+ public:
+  explicit ImageReader(std::string_view image) : in(image) {}
+
+  std::vector<scode> load() {
+    std::vector<scode> forms;
+    size_t nsymbols = get();
+    for (size_t i = 0; i < nsymbols && !bad; i++)
+      symbols.push_back(ToCode(get_bytes(get())));
+    size_t nforms = get();
+    for (size_t i = 0; i < nforms && !bad; i++)
+      forms.push_back(get_code());
+    if (bad) {
+      fprintf(stderr, "Corrupt image\n");
+      forms.clear();
+    }
+    return forms;
+  }
+
+  // Reads the key of a source image, up to its symbol table.
+  bool load_key(SourceImage &source) {
+    if (get_bytes(kSourceImageMagic.size()) != kSourceImageMagic)
+      return false;
+    source.path = get_bytes(get());
+    source.mtime = get64();
+    source.size = get64();
+    source.hash = get64();
+    source.macro_state = get64();
+    return !bad;
+  }
+
+  // Reads the rest of a source image, after load_key.
+  bool load_forms(SourceImage &source) {
+    size_t nsymbols = get();
+    for (size_t i = 0; i < nsymbols && !bad; i++)
+      symbols.push_back(ToCode(get_bytes(get())));
+    source.macros = get_list();
+    source.forms = get_list();
+    return !bad && in.empty();
+  }
+
+ private:
+  std::string_view in;
+  std::vector<size_t> symbols;
+  bool bad = false;
+
+  uint32_t get() {
+    if (in.size() < 4) {
+      bad = true;
+      return 0;
+    }
+    uint32_t u = 0;
+    for (int i = 0; i < 4; i++)
+      u |= static_cast<uint32_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+    in.remove_prefix(4);
+    return u;
+  }
+
+  uint64_t get64() {
+    uint64_t lo = get();
+    return lo | static_cast<uint64_t>(get()) << 32;
+  }
+
+  std::string_view get_bytes(size_t n) {
+    if (in.size() < n) {
+      bad = true;
+      n = in.size();
+    }
+    std::string_view bytes = in.substr(0, n);
+    in.remove_prefix(n);
+    return bytes;
+  }
+
+  size_t get_symbol() {
+    uint32_t i = get();
+    if (i >= symbols.size()) {
+      bad = true;
+      return 0;
+    }
+    return symbols[i];
+  }
+
+  double get_double() {
+    double d = 0;
+    std::string_view bytes = get_bytes(sizeof(d));
+    memcpy(&d, bytes.data(), bytes.size());
+    return d;
+  }
+
+  scode get_code() {
+    scode code(std::make_shared<Code>());
+    size_t nops = get();
+    for (size_t i = 0; i < nops && !bad; i++) {
+      Opcode op = static_cast<Opcode>(get());
+      uint32_t a = names_symbol(op) ? uint32_t(get_symbol()) : get();
+      uint32_t b = is_arith(op) ? uint32_t(get_symbol()) : get();
+      code->ops.push_back({op, a, b});
     }
-    return std::make_shared<Node>(sum);
-  } else {
-    double sum = first->v_double;
-    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
-         i++) {
-      sum *= (*i)->to_double();
+    size_t nconsts = get();
+    for (size_t i = 0; i < nconsts && !bad; i++)
+      code->consts.push_back(get_value());
+    size_t nprotos = get();
+    for (size_t i = 0; i < nprotos && !bad; i++)
+      code->protos.push_back(get_code());
+    size_t nbindings = get();
+    for (size_t i = 0; i < nbindings && !bad; i++) {
+      Binding b{get_symbol(), {}};
+      size_t nslots = get();
+      for (size_t j = 0; j < nslots && !bad; j++) {
+        uint32_t depth = get();
+        b.slots.push_back({depth, get()});
+      }
+      code->bindings.push_back(std::move(b));
     }
-    return std::make_shared<Node>(sum);
+    code->nparams = get();
+    size_t nlocals = get();
+    for (size_t i = 0; i < nlocals && !bad; i++)
+      code->locals.push_back(get_symbol());
+    if (!bad)
+      mark_leaf(*code);
+    return code;
   }
-}
 
-snode builtin_div(std::vector<snode> &args, senvironment &env) {  // (/ X ..)
-  size_t len = args.size();
-  if (len <= 0)
-    return node_1;
-  snode first = args[0];
-  if (first->type == Node::T_INT) {
-    int sum = first->v_int;
-    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
-         i++) {
-      sum /= (*i)->to_int();
+  Value get_value() {
+    switch (get()) {
+      case Value::INT:
+        return static_cast<int>(get());
+      case Value::DOUBLE:
+        return get_double();
+      case Value::BOOL:
+        return get() != 0;
+      case Value::BOXED:
+        return get_node();
+      default:
+        bad = true;
+        return nil;
     }
-    return std::make_shared<Node>(sum);
-  } else {
-    double sum = first->v_double;
-    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
-         i++) {
-      sum /= (*i)->to_double();
+  }
+
+  snode get_node() {
+    switch (get()) {
+      case Node::T_NIL:
+        return nil;
+      case Node::T_INT:
+        return make_snode(static_cast<int>(get()));
+      case Node::T_DOUBLE:
+        return make_snode(get_double());
+      case Node::T_BOOL:
+        return make_snode(get() != 0);
+      case Node::T_STRING:
+        return make_snode(std::string(get_bytes(get())));
+      case Node::T_SYMBOL: {
+        Node n;
+        n.type = Node::T_SYMBOL;
+        n.code = get_symbol();
+        n.v_string = intern(SymbolName(n.code));
+        return make_snode(n);
+      }
+      case Node::T_LIST:
+        return make_snode(get_list());
+      case Node::T_SPECIAL:
+        return context->globals->get(get_symbol());
+      case Node::T_BUILTIN:
+        return snapshot(*context->globals->get(get_symbol()));
+      default:
+        bad = true;
+        return nil;
     }
-    return std::make_shared<Node>(sum);
   }
-}
 
-snode builtin_lt(std::vector<snode> &args, senvironment &env) {  // (< X Y)
-  if (args[0]->type == Node::T_INT) {
-    return std::make_shared<Node>(args[0]->v_int < args[1]->to_int());
-  } else {
-    return std::make_shared<Node>(args[0]->v_double < args[1]->to_double());
+  std::vector<snode> get_list() {
+    std::vector<snode> list;
+    size_t n = get();
+    for (size_t i = 0; i < n && !bad; i++)
+      list.push_back(get_node());
+    return list;
   }
-}
+};
 
-snode builtin_caret(std::vector<snode> &args,
-                    senvironment &env) {  // (^ BASE EXPONENT)
-  return std::make_shared<Node>(
-      pow(args[0]->to_double(), args[1]->to_double()));
+
+std::string cache_dir;
+bool cache_dir_set = false;
+
+const std::string &get_cache_dir() {
+  if (!cache_dir_set) {
+    cache_dir_set = true;
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (const char *dir = getenv("PAREN_CACHE_DIR"))
+      cache_dir = dir;
+    else if (xdg && *xdg)
+      cache_dir = std::string(xdg) + "/paren";
+    else if (home && *home)
+      cache_dir = std::string(home) + "/.cache/paren";
+  }
+  return cache_dir;
 }
 
-snode builtin_percent(std::vector<snode> &args,
-                      senvironment &env) {  // (% DIVIDEND DIVISOR)
-  return std::make_shared<Node>(args[0]->to_int() % args[1]->to_int());
+// Fills in the forms of `source` from the image at `image_path`, if it was
+// made for the same key.
+bool load_cached(const std::string &image_path, SourceImage &source) {
+  MappedFile file(image_path);
+  if (!file)
+    return false;
+  ImageReader reader(file.view());
+  SourceImage cached;
+  if (!reader.load_key(cached) || cached.path != source.path ||
+      cached.mtime != source.mtime || cached.size != source.size ||
+      cached.hash != source.hash || cached.macro_state != source.macro_state)
+    return false;
+  if (!reader.load_forms(cached))
+    return false;
+  source.macros = std::move(cached.macros);
+  source.forms = std::move(cached.forms);
+  return true;
 }
 
-snode builtin_sqrt(std::vector<snode> &args, senvironment &env) {  // (sqrt X)
-  return std::make_shared<Node>(sqrt(args[0]->to_double()));
+void save_cached(const std::string &image_path, const SourceImage &source) {
+  std::string image;
+  if (!ImageWriter().save(source, image))
+    return;
+  // Written aside and renamed into place, so that other processes never see
+  // part of an image.
+  std::error_code ec;
+  std::filesystem::create_directories(get_cache_dir(), ec);
+  std::string temp = image_path + "." + std::to_string(getpid());
+  if (spit(temp, image) < 0)
+    return;
+  std::filesystem::rename(temp, image_path, ec);
+  if (ec)
+    std::filesystem::remove(temp, ec);
 }
 
-snode builtin_plusplus(std::vector<snode> &args, senvironment &env) {  // (++ X)
-  size_t len = args.size();
-  if (len <= 0)
-    return std::make_shared<Node>(0);
-  snode first = args[0];
-  if (first->type == Node::T_INT) {
-    first->v_int++;
-  } else {
-    first->v_double++;
+void attach_natives(std::vector<scode> &codes, const native_code *natives,
+                    size_t count, size_t &next) {
+  for (scode &code : codes) {
+    if (next < count)
+      code->native = natives[next++];
+    attach_natives(code->protos, natives, count, next);
   }
-  return first;
 }
 
-snode builtin_minusminus(std::vector<snode> &args,
-                         senvironment &env) {  // (-- X)
-  size_t len = args.size();
-  if (len <= 0)
-    return std::make_shared<Node>(0);
-  snode first = args[0];
-  if (first->type == Node::T_INT) {
-    first->v_int--;
-  } else {
-    first->v_double--;
-  }
-  return first;
+}  // namespace
+
+bool save_image(const std::vector<scode> &forms, std::string &image) {
+  return ImageWriter().save(forms, image);
 }
 
-snode builtin_floor(std::vector<snode> &args, senvironment &env) {  // (floor X)
-  return std::make_shared<Node>(floor(args[0]->to_double()));
+std::vector<scode> load_image(std::string_view image) {
+  return ImageReader(image).load();
 }
 
-snode builtin_ceil(std::vector<snode> &args, senvironment &env) {  // (ceil X)
-  return std::make_shared<Node>(ceil(args[0]->to_double()));
+void run_image(std::string_view image, const native_code *natives,
+               size_t count) {
+  std::vector<scode> forms = load_image(image);
+  size_t next = 0;
+  attach_natives(forms, natives, count, next);
+  for (scode &code : forms) {
+    run(code, context->globals);
+    if (gc_due())
+      collect();
+  }
 }
 
-snode builtin_ln(std::vector<snode> &args, senvironment &env) {  // (ln X)
-  return std::make_shared<Node>(log(args[0]->to_double()));
+bool eval_file(std::string_view path) {
+  std::string contents;
+  if (!slurp(path, contents))
+    return false;
+
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  fs::path absolute = fs::absolute(path, ec);
+  SourceImage source;
+  source.path = absolute.string();
+  source.mtime = static_cast<uint64_t>(
+      fs::last_write_time(absolute, ec).time_since_epoch().count());
+  source.size = contents.size();
+  source.hash = fnv1a(contents);
+  source.macro_state = current_macro_state();
+
+  std::string image_path;
+  if (!get_cache_dir().empty()) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.img",
+             static_cast<unsigned long long>(fnv1a(source.path)));
+    image_path = get_cache_dir() + "/" + name;
+    if (load_cached(image_path, source)) {
+      for (const snode &n : source.macros)
+        define_macro(n);
+      eval_all(source.forms);
+      return true;
+    }
+  }
+
+  std::vector<snode> parsed = parse(contents);
+  std::vector<snode> *outer_log = macro_log;
+  macro_log = &source.macros;
+  source.forms = compile_all(parsed);
+  macro_log = outer_log;
+  if (!image_path.empty())
+    save_cached(image_path, source);
+  eval_all(source.forms);
+  return true;
 }
 
-snode builtin_log10(std::vector<snode> &args, senvironment &env) {  // (log10 X)
-  return std::make_shared<Node>(log10(args[0]->to_double()));
+void set_cache_dir(std::string_view dir) {
+  cache_dir = dir;
+  cache_dir_set = true;
 }
 
-snode builtin_rand(std::vector<snode> &args, senvironment &env) {  // (rand)
-  return std::make_shared<Node>(rand_double());
+void set_jit(jit_compiler compiler, size_t threshold) {
+  jit = compiler;
+  jit_threshold = threshold;
 }
 
-snode builtin_eqeq(std::vector<snode> &args,
-                   senvironment &env) {  // (== X ..) short-circuit
-  snode first = args[0];
-  if (first->type == Node::T_INT) {
-    int firstv = first->v_int;
-    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
-         i++) {
-      if ((*i)->to_int() != firstv) {
-        return node_false;
-      }
-    }
+snode apply(snode &func, std::vector<snode> &args, senvironment &env) {
+  if (func->type == Node::T_BUILTIN) {
+    return func->v_builtin(args, env);
+  } else if (func->type == Node::T_FN) {
+    return vm.call(func, args);
   } else {
-    double firstv = first->v_double;
-    for (std::vector<snode>::iterator i = args.begin() + 1; i != args.end();
-         i++) {
-      if ((*i)->to_double() != firstv) {
-        return node_false;
-      }
-    }
+    return nil;
   }
-  return node_true;
 }
 
-snode special_andand(std::vector<snode> &raw_args,
-                     senvironment &env) {  // (&& X ..) short-circuit
-  for (std::vector<snode>::iterator i = raw_args.begin() + 1;
-       i != raw_args.end(); i++) {
-    if (!(eval(*i, env))->v_bool) {
-      return node_false;
+namespace {
+
+// Goes through the elements of a list or sequence, in order.
+class Cursor {
+ public:
+  Cursor(snode n, senvironment &env) : n(std::move(n)), env(env) {
+    if (this->n->type != Node::T_SEQ) {
+      list = this->n;
+      return;
     }
+    seq = &seq_of(*this->n);
+    if (seq->kind == Seq::RANGE)
+      at = seq->start;
+    else if (seq->kind == Seq::LIST)
+      list = seq->source;
+    else
+      inner = std::make_unique<Cursor>(seq->source, env);
   }
-  return node_true;
-}
 
-snode special_oror(std::vector<snode> &raw_args,
-                   senvironment &env) {  // (|| X ..) short-circuit
-  for (std::vector<snode>::iterator i = raw_args.begin() + 1;
-       i != raw_args.end(); i++) {
-    if ((eval(*i, env))->v_bool) {
-      return node_true;
+  // Makes `out` the next element, unless there are no more.
+  bool next(snode &out) {
+    if (!seq)
+      return next_of(out);
+    switch (seq->kind) {
+      case Seq::RANGE:
+        if (seq->step >= 0 ? at > seq->end : at < seq->end)
+          return false;
+        out = seq->ints ? make_snode(static_cast<int>(at)) : make_snode(at);
+        at += seq->step;
+        return true;
+      case Seq::LIST:
+        return next_of(out);
+      case Seq::MAP:
+        if (!inner->next(out))
+          return false;
+        out = call(out);
+        return true;
+      case Seq::FILTER:
+        while (inner->next(out)) {
+          if (call(out)->v_bool)
+            return true;
+        }
+        return false;
+      case Seq::TAKE:
+        return index++ < seq->count && inner->next(out);
     }
+    return false;
   }
-  return node_false;
-}
 
-snode builtin_not(std::vector<snode> &args, senvironment &env) {  // (! X)
-  return std::make_shared<Node>(!(args[0]->v_bool));
-}
+ private:
+  snode n;
+  senvironment &env;
+  const Seq *seq = nullptr;
+  std::unique_ptr<Cursor> inner;  // through source
+  snode list;                     // what is left of a list
+  size_t index = 0;               // of the next element of list, or taken
+  double at = 0;                  // the next element of a range
+  std::vector<snode> args;
 
-snode special_while(std::vector<snode> &raw_args,
-                    senvironment &env) {  // (while CONDITION EXPR ..)
-  snode &cond = raw_args[1];
-  size_t len = raw_args.size();
-  while (eval(cond, env)->v_bool) {
-    for (size_t i = 2; i < len; i++) {
-      eval(raw_args[i], env);
+  bool next_of(snode &out) {
+    if (list->type == Node::T_CONS) {
+      const Cons &cell = cons_of(*list);
+      out = cell.first;
+      list = cell.rest;
+      return true;
+    }
+    if (list->type == Node::T_PVEC) {
+      const PVec &vec = pvec_of(*list);
+      if (index >= vec.size)
+        return false;
+      out = pvec_at(vec, index++);
+      return true;
     }
+    if (index >= list->v_list.size())
+      return false;
+    out = list->v_list[index++];
+    return true;
   }
-  return nil;
-}
 
-snode builtin_strlen(std::vector<snode> &args,
-                     senvironment &env) {  // (strlen X)
-  return std::make_shared<Node>((int)args[0]->v_string.size());
+  snode call(const snode &x) {
+    snode f = seq->f;
+    args.assign(1, x);
+    return apply(f, args, env);
+  }
+};
+
+// What goes through `n`, a list or sequence: a list, `n` itself if it is one.
+snode as_list(const snode &n, senvironment &env) {
+  if (n->type != Node::T_SEQ && !is_persistent(*n))
+    return n;
+  std::vector<snode> items;
+  Cursor cursor(n, env);
+  for (snode item; cursor.next(item);)
+    items.push_back(std::move(item));
+  return make_snode(items);
 }
 
-snode builtin_string(std::vector<snode> &args,
-                     senvironment &env) {  // (std::string X ..)
-  size_t len = args.size();
-  if (len <= 1)
-    return std::make_shared<Node>(std::string());
-  std::string acc;
-  for (std::vector<snode>::iterator i = args.begin(); i != args.end(); i++) {
-    acc += (*i)->to_string();
-  }
-  return std::make_shared<Node>(acc);
+snode make_persistent(Cons cell) {
+  Node n;
+  n.type = Node::T_CONS;
+  n.v_object = std::make_shared<Cons>(std::move(cell));
+  return make_snode(n);
 }
 
-snode builtin_char_at(std::vector<snode> &args,
-                      senvironment &env) {  // (char-at X)
-  int i = args[1]->to_int();
-  assert(i >= 0 && "Negative string indexing");
-  return std::make_shared<Node>(args[0]->v_string[static_cast<size_t>(i)]);
+// The vector, or nil if it is empty, for the list to be empty too.
+snode make_persistent(PVec vec) {
+  if (vec.size == 0)
+    return nil;
+  Node n;
+  n.type = Node::T_PVEC;
+  n.v_object = std::make_shared<PVec>(std::move(vec));
+  return make_snode(n);
 }
 
-snode builtin_chr(std::vector<snode> &args, senvironment &env) {  // (chr X)
-  char temp[2] = " ";
-  temp[0] = (char)args[0]->to_int();
-  return std::make_shared<Node>(std::string(temp));
+// `list` as a vector, itself if it is one. As with push-back!, what goes in
+// is a copy, since set changes a node in place.
+PVec pvec_of_list(const snode &list, senvironment &env) {
+  if (list->type == Node::T_PVEC)
+    return pvec_of(*list);
+  std::vector<snode> items;
+  Cursor cursor(list, env);
+  for (snode item; cursor.next(item);)
+    items.push_back(copy_node(item));
+  return make_pvec_of(std::move(items));
 }
 
-void import_impl(const std::string &path) {
-  std::string contents;
-  if (slurp(path, contents)) {
-    eval_string(contents);
-  } else {
-    std::cerr << "Unable to read file `" << path << "`" << std::endl;
-  }
+// `list` if it is persistent, or else a vector of what goes through it. A copy
+// of the node either way, which for a persistent list shares all it has.
+snode persistent(const snode &list, senvironment &env) {
+  if (is_persistent(*list))
+    return copy_node(list);
+  return make_persistent(pvec_of_list(list, env));
 }
 
-// (import X)
-snode builtin_import(std::vector<snode> &args, senvironment &env) {
-  std::string filename = args[0]->to_string();
-  import_impl(filename);
-  return nil;
+void write_seq(std::string &out, const snode &seq) {
+  as_list(seq, context->globals)->write_to(out);
 }
 
-snode builtin_double(std::vector<snode> &args,
-                     senvironment &env) {  // (double X)
-  return std::make_shared<Node>(args[0]->to_double());
+snode make_seq(Seq seq) {
+  Node n;
+  n.type = Node::T_SEQ;
+  n.v_object = std::make_shared<Seq>(std::move(seq));
+  return make_snode(n);
 }
 
-snode builtin_int(std::vector<snode> &args, senvironment &env) {  // (int X)
-  return std::make_shared<Node>(args[0]->to_int());
+// A sequence going through `source`, with `f` if it has one.
+snode make_seq(Seq::Kind kind, const snode &source, const snode &f) {
+  Seq seq;
+  seq.kind = kind;
+  seq.source = source;
+  seq.f = f;
+  return make_seq(std::move(seq));
 }
 
-snode builtin_read_string(std::vector<snode> &args,
-                          senvironment &env) {  // (read-std::string X)
-  return parse(args[0]->to_string())[0];
+// Locks `n` for push-back! or pop-back! to change. A sequence or persistent
+// list first becomes a list of what it has, in place, leaving what it shares
+// alone; its elements are got before the lock, as getting them can call fns.
+Lock lock_mutable(const snode &n, senvironment &env) {
+  snode list = as_list(n, env);
+  Lock lock = lock_node(n.get());
+  if (list != n && n->type != Node::T_LIST) {
+    n->type = Node::T_LIST;
+    n->v_list = std::move(list->v_list);
+    n->v_object.reset();
+  }
+  return lock;
 }
 
-snode builtin_type(std::vector<snode> &args, senvironment &env) {  // (type X)
-  return std::make_shared<Node>(args[0]->type_str());
+}  // namespace
+
+snode builtin_apply(std::vector<snode> &args,
+                    senvironment &env) {  // (apply FUNC LIST)
+  snode func = args[0];
+  snode list = as_list(args[1], env);
+  // One made by as_list is not needed after, so its elements can be moved.
+  std::vector<snode> lst =
+      list == args[1] ? list->v_list : std::move(list->v_list);
+  return apply(func, lst, env);
 }
 
-snode builtin_eval(std::vector<snode> &args, senvironment &env) {  // (eval X)
-  return eval(args[0], env);
+snode builtin_range(
+    std::vector<snode> &args,
+    senvironment &env) {  // (range START END {STEP}) => SEQ
+  Seq seq;
+  seq.kind = Seq::RANGE;
+  for (size_t i = 0; i < args.size() && i < 3; i++)
+    seq.ints = seq.ints && args[i]->type == Node::T_INT;
+  seq.start = args[0]->to_double();
+  seq.end = args[1]->to_double();
+  seq.step = args.size() > 2 ? args[2]->to_double() : 1;
+  return make_seq(std::move(seq));
 }
 
-snode special_quote(std::vector<snode> &raw_args,
-                    senvironment &env) {  // (quote X)
-  return raw_args[1];
+snode builtin_seq(std::vector<snode> &args,
+                  senvironment &env) {  // (seq LIST) => SEQ
+  if (args[0]->type == Node::T_SEQ)
+    return args[0];
+  return make_seq(Seq::LIST, args[0], nullptr);
 }
 
-snode builtin_list(std::vector<snode> &args,
-                   senvironment &env) {  // (list X ..)
-  std::vector<snode> ret;
-  ret.reserve(args.size());
-  for (auto &n : args) {
-    ret.push_back(n);
+snode builtin_take(std::vector<snode> &args,
+                   senvironment &env) {  // (take N LIST)
+  int n = std::max(args[0]->to_int(), 0);
+  if (args[1]->type == Node::T_SEQ) {
+    Seq seq;
+    seq.kind = Seq::TAKE;
+    seq.source = args[1];
+    seq.count = static_cast<size_t>(n);
+    return make_seq(std::move(seq));
   }
-  return std::make_shared<Node>(ret);
+  snode list = as_list(args[1], env);
+  const std::vector<snode> &items = list->v_list;
+  return make_snode(std::vector<snode>(
+      items.begin(),
+      items.begin() + std::min(static_cast<ptrdiff_t>(n),
+                               static_cast<ptrdiff_t>(items.size()))));
 }
 
-snode apply(snode &func, std::vector<snode> &args, senvironment &env) {
-  if (func->type == Node::T_BUILTIN) {
-    return func->v_builtin(args, env);
-  } else if (func->type == Node::T_FN) {
-    std::vector<snode> &f = func->v_list;
-    // anonymous function application-> lexical scoping
-    // (fn (ARGUMENT ..) BODY ..)
-    std::vector<snode> &arg_syms = f[1]->v_list;
-
-    std::shared_ptr<environment> local_env(
-        std::make_shared<environment>(environment(func->outer_env)));
-
-    size_t alen = arg_syms.size();
-    for (size_t i = 0; i < alen; i++) {  // assign arguments
-      // std::string &k = arg_syms.at(i)->v_string;
-      // local_env.env[k] = eval(n->v_list.at(i+1), env);
-      snode &k = arg_syms[i];
-      local_env->env[k->code] = args[i];
-    }
-
-    size_t last = f.size() - 1;
-    if (last < 2)
-      return nil;
-    for (size_t i = 2; i < last; i++) {  // body
-      eval(f.at(i), local_env);
-    }
-    return eval(f[last], local_env);
-  } else {
+// (reduce FUNC {INIT} LIST): FUNC of INIT, or else the first element, and the
+// next, then of that and the next, and so on. nil if there is nothing to
+// reduce.
+snode builtin_reduce(std::vector<snode> &args, senvironment &env) {
+  snode f = args[0];
+  Cursor cursor(args.size() > 2 ? args[2] : args[1], env);
+  snode acc = nil;
+  if (args.size() > 2)
+    acc = args[1];
+  else if (!cursor.next(acc))
     return nil;
+  std::vector<snode> args2(2);
+  for (snode item; cursor.next(item);) {
+    args2[0] = std::move(acc);
+    args2[1] = std::move(item);
+    acc = apply(f, args2, env);
   }
-}
-
-snode builtin_apply(std::vector<snode> &args,
-                    senvironment &env) {  // (apply FUNC LIST)
-  snode func = args[0];
-  std::vector<snode> lst = args[1]->v_list;
-  return apply(func, lst, env);
+  return acc;
 }
 
 snode builtin_fold(std::vector<snode> &args,
                    senvironment &env) {  // (fold FUNC LIST)
+  if (args[1]->type == Node::T_SEQ || is_persistent(*args[1]))
+    return builtin_reduce(args, env);
   snode f = args[0];
   snode lst = args[1];
   snode acc = lst->v_list[0];
@@ -960,9 +5694,11 @@ snode builtin_fold(std::vector<snode> &args,
 }
 
 snode builtin_map(std::vector<snode> &args,
-                  senvironment &env) {  // (std::map FUNC LIST)
+                  senvironment &env) {  // (map FUNC LIST)
+  if (args[1]->type == Node::T_SEQ)
+    return make_seq(Seq::MAP, args[1], args[0]);
   snode f = args[0];
-  snode lst = args[1];
+  snode lst = as_list(args[1], env);
   std::vector<snode> acc;
   std::vector<snode> args2;
   auto len = lst->v_list.size();
@@ -972,35 +5708,118 @@ snode builtin_map(std::vector<snode> &args,
     args2[0] = lst->v_list[i];
     acc.push_back(apply(f, args2, env));
   }
-  return std::make_shared<Node>(acc);
+  return make_snode(acc);
+}
+
+snode builtin_filter(std::vector<snode> &args,
+                     senvironment &env) {  // (filter FUNC LIST)
+  if (args[1]->type == Node::T_SEQ)
+    return make_seq(Seq::FILTER, args[1], args[0]);
+  snode f = args[0];
+  snode lst = as_list(args[1], env);
+  std::vector<snode> acc;
+  std::vector<snode> args2;
+  args2.push_back(nil);
+  for (unsigned int i = 0; i < lst->v_list.size(); i++) {
+    snode item = lst->v_list.at(i);
+    args2[0] = item;
+    snode ret = apply(f, args2, env);
+    if (ret->v_bool)
+      acc.push_back(item);
+  }
+  return make_snode(acc);
+}
+
+// The parallel versions of map, filter and fold split LIST in chunks, which
+// the pool works through. FUNC may be called on any thread, in any order.
+
+snode builtin_pmap(std::vector<snode> &args,
+                   senvironment &env) {  // (pmap FUNC LIST)
+  snode f = args[0];
+  snode list = as_list(args[1], env);
+  const std::vector<snode> &items = list->v_list;
+  std::vector<snode> acc(items.size());
+  parallel_chunks(items.size(), [&](size_t begin, size_t end) {
+    std::vector<snode> args2(1);
+    senvironment local_env = env;
+    for (size_t i = begin; i < end; i++) {
+      args2[0] = items[i];
+      acc[i] = apply(f, args2, local_env);
+    }
+  });
+  return make_snode(acc);
+}
+
+snode builtin_pfilter(std::vector<snode> &args,
+                      senvironment &env) {  // (pfilter FUNC LIST)
+  snode f = args[0];
+  snode list = as_list(args[1], env);
+  const std::vector<snode> &items = list->v_list;
+  std::vector<char> keep(items.size());
+  parallel_chunks(items.size(), [&](size_t begin, size_t end) {
+    std::vector<snode> args2(1);
+    senvironment local_env = env;
+    for (size_t i = begin; i < end; i++) {
+      args2[0] = items[i];
+      keep[i] = apply(f, args2, local_env)->v_bool;
+    }
+  });
+  std::vector<snode> acc;
+  for (size_t i = 0; i < items.size(); i++) {
+    if (keep[i])
+      acc.push_back(items[i]);
+  }
+  return make_snode(acc);
 }
 
-snode builtin_filter(std::vector<snode> &args,
-                     senvironment &env) {  // (filter FUNC LIST)
+// FUNC must be associative: each chunk is folded with it, and then the
+// results of the chunks, in order.
+snode builtin_preduce(std::vector<snode> &args,
+                      senvironment &env) {  // (preduce FUNC LIST)
   snode f = args[0];
-  snode lst = args[1];
-  std::vector<snode> acc;
-  std::vector<snode> args2;
-  args2.push_back(nil);
-  for (unsigned int i = 0; i < lst->v_list.size(); i++) {
-    snode item = lst->v_list.at(i);
-    args2[0] = item;
-    snode ret = apply(f, args2, env);
-    if (ret->v_bool)
-      acc.push_back(item);
+  snode list = as_list(args[1], env);
+  const std::vector<snode> &items = list->v_list;
+  if (items.empty())
+    return nil;
+  size_t chunks = std::min(items.size(), 4 * pool().size());
+  std::vector<snode> partial(chunks);
+  parallel_chunks(chunks, [&](size_t begin, size_t end) {
+    std::vector<snode> args2(2);
+    senvironment local_env = env;
+    for (size_t c = begin; c < end; c++) {
+      size_t first = items.size() * c / chunks;
+      size_t last = items.size() * (c + 1) / chunks;
+      snode acc = items[first];
+      for (size_t i = first + 1; i < last; i++) {
+        args2[0] = acc;
+        args2[1] = items[i];
+        acc = apply(f, args2, local_env);
+      }
+      partial[c] = acc;
+    }
+  });
+  snode acc = partial[0];
+  std::vector<snode> args2(2);
+  for (size_t c = 1; c < chunks; c++) {
+    args2[0] = acc;
+    args2[1] = partial[c];
+    acc = apply(f, args2, env);
   }
-  return std::make_shared<Node>(acc);
+  return acc;
 }
 
 snode builtin_push_backd(
     std::vector<snode> &args,
     senvironment &env) {  // (push-back! LIST ITEM) ; destructive
-  args[0]->v_list.push_back(std::make_shared<Node>(*args[1]));
+  snode item = copy_node(args[1]);
+  Lock lock = lock_mutable(args[0], env);
+  args[0]->v_list.push_back(std::move(item));
   return args[0];
 }
 
 snode builtin_pop_backd(std::vector<snode> &args,
                         senvironment &env) {  // (pop-back! LIST) ; destructive
+  Lock lock = lock_mutable(args[0], env);
   auto &v = args[0]->v_list;
   snode n = v.back();
   v.pop_back();
@@ -1011,12 +5830,179 @@ snode builtin_nth(std::vector<snode> &args,
                   senvironment &env) {  // (nth INDEX LIST)
   int i = args[0]->to_int();
   assert(i >= 0 && "Negative index for list");
-  return args[1]->v_list[static_cast<size_t>(i)];
+  size_t index = static_cast<size_t>(i);
+  switch (args[1]->type) {
+    case Node::T_F64VEC:
+      assert(index < elements_of<double>(*args[1]).size());
+      return make_snode(elements_of<double>(*args[1])[index]);
+    case Node::T_I32VEC:
+      assert(index < elements_of<int32_t>(*args[1]).size());
+      return make_snode(elements_of<int32_t>(*args[1])[index]);
+    case Node::T_PVEC:
+      assert(index < pvec_of(*args[1]).size);
+      return pvec_at(pvec_of(*args[1]), index);
+    case Node::T_SEQ:
+    case Node::T_CONS: {
+      Cursor cursor(args[1], env);
+      snode item = nil;
+      for (size_t k = 0; k <= index; k++) {
+        if (!cursor.next(item))
+          return nil;
+      }
+      return item;
+    }
+    default:
+      return args[1]->v_list[index];
+  }
 }
 
 snode builtin_length(std::vector<snode> &args,
                      senvironment &env) {  // (length LIST)
-  return std::make_shared<Node>((int)args[0]->v_list.size());
+  switch (args[0]->type) {
+    case Node::T_F64VEC:
+      return make_snode((int)elements_of<double>(*args[0]).size());
+    case Node::T_I32VEC:
+      return make_snode((int)elements_of<int32_t>(*args[0]).size());
+    case Node::T_DICT: {
+      Lock lock = lock_node(args[0].get());
+      return make_snode((int)dict_of(*args[0]).size());
+    }
+    case Node::T_SEQ: {
+      Cursor cursor(args[0], env);
+      int n = 0;
+      for (snode item; cursor.next(item);)
+        n++;
+      return make_snode(n);
+    }
+    case Node::T_CONS:
+    case Node::T_PVEC:
+      return make_snode((int)persistent_length(*args[0]));
+    default:
+      return make_snode((int)args[0]->v_list.size());
+  }
+}
+
+snode builtin_f64vec(std::vector<snode> &args,
+                     senvironment &env) {  // (f64vec X ..)
+  return make_vector_of<double>(args, env);
+}
+
+snode builtin_i32vec(std::vector<snode> &args,
+                     senvironment &env) {  // (i32vec X ..)
+  return make_vector_of<int32_t>(args, env);
+}
+
+snode builtin_f64vec_range(
+    std::vector<snode> &args,
+    senvironment &env) {  // (f64vec-range START END {STEP})
+  return make_vector_range<double>(args);
+}
+
+snode builtin_i32vec_range(
+    std::vector<snode> &args,
+    senvironment &env) {  // (i32vec-range START END {STEP})
+  return make_vector_range<int32_t>(args);
+}
+
+snode builtin_dot(std::vector<snode> &args,
+                  senvironment &env) {  // (dot VECTOR VECTOR)
+  if (int_elements(*args[0]))
+    return vector_dot<int32_t>(*args[0], *args[1]);
+  return vector_dot<double>(*args[0], *args[1]);
+}
+
+snode builtin_sum(std::vector<snode> &args,
+                  senvironment &env) {  // (sum LIST)
+  Node &vec = *args[0];
+  if (vec.type == Node::T_F64VEC) {
+    const Elements<double> &items = elements_of<double>(vec);
+    return make_snode(dot_f64(items.data(), nullptr, items.size()));
+  }
+  if (vec.type == Node::T_I32VEC) {
+    const Elements<int32_t> &items = elements_of<int32_t>(vec);
+    return make_snode(dot_i32(items.data(), nullptr, items.size()));
+  }
+  snode list = as_list(args[0], env);
+  return builtin_plus(list->v_list, env);
+}
+
+snode builtin_min(std::vector<snode> &args,
+                  senvironment &env) {  // (min X ..) or (min LIST)
+  return extreme(false, args, env);
+}
+
+snode builtin_max(std::vector<snode> &args,
+                  senvironment &env) {  // (max X ..) or (max LIST)
+  return extreme(true, args, env);
+}
+
+// A key as a dict keeps it: a copy, unless it compares by identity.
+snode dict_key(const snode &key) {
+  switch (key->type) {
+    case Node::T_NIL:
+    case Node::T_INT:
+    case Node::T_DOUBLE:
+    case Node::T_BOOL:
+    case Node::T_STRING:
+    case Node::T_SYMBOL:
+      return copy_node(key);
+    default:
+      return key;
+  }
+}
+
+snode builtin_dict(std::vector<snode> &args,
+                   senvironment &env) {  // (dict KEY VALUE ..)
+  auto dict = std::make_shared<Dict>();
+  for (size_t i = 0; i + 1 < args.size(); i += 2)
+    (*dict)[dict_key(args[i])] = copy_node(args[i + 1]);
+  Node n;
+  n.type = Node::T_DICT;
+  n.v_object = std::move(dict);
+  return make_snode(n);
+}
+
+snode builtin_get(std::vector<snode> &args,
+                  senvironment &env) {  // (get DICT KEY {DEFAULT})
+  snode missing = args.size() >= 3 ? args[2] : nil;
+  if (args.size() < 2 || args[0]->type != Node::T_DICT)
+    return missing;
+  Lock lock = lock_node(args[0].get());
+  snode *found = dict_of(*args[0]).find(args[1]);
+  return found ? *found : missing;
+}
+
+snode builtin_putd(std::vector<snode> &args,
+                   senvironment &env) {  // (put! DICT KEY VALUE) ; destructive
+  if (args.size() < 3 || args[0]->type != Node::T_DICT)
+    return nil;
+  snode key = dict_key(args[1]);
+  snode value = copy_node(args[2]);
+  Lock lock = lock_node(args[0].get());
+  Node &n = *args[0];
+  if (n.v_object.use_count() > 1)  // shared with copies; see Dict
+    n.v_object = std::make_shared<Dict>(dict_of(n));
+  dict_of(n)[key] = std::move(value);
+  return args[0];
+}
+
+snode builtin_hasp(std::vector<snode> &args,
+                   senvironment &env) {  // (has? DICT KEY)
+  if (args.size() < 2 || args[0]->type != Node::T_DICT)
+    return node_false;
+  Lock lock = lock_node(args[0].get());
+  return dict_of(*args[0]).find(args[1]) ? node_true : node_false;
+}
+
+snode builtin_keys(std::vector<snode> &args,
+                   senvironment &env) {  // (keys DICT), in the order added
+  std::vector<snode> ret;
+  if (args.empty() || args[0]->type != Node::T_DICT)
+    return make_snode(ret);
+  Lock lock = lock_node(args[0].get());
+  for (auto &[key, value] : dict_of(*args[0]))
+    ret.push_back(make_snode(*key));
+  return make_snode(ret);
 }
 
 snode special_begin(std::vector<snode> &raw_args,
@@ -1030,23 +6016,72 @@ snode special_begin(std::vector<snode> &raw_args,
   return eval(raw_args[last], env);
 }
 
-snode builtin_pr(std::vector<snode> &args, senvironment &env) {  // (pr X ..)
-  std::vector<snode>::iterator first = args.begin();
-  for (std::vector<snode>::iterator i = first; i != args.end(); i++) {
-    if (i != first)
-      printf(" ");
-    printf("%s", (*i)->to_string().c_str());
+namespace {
+
+// What pr and prn print goes to a buffer of their thread's, which is written
+// to stdout in one go once it holds $PAREN_OUTPUT_BUFFER bytes (64 KiB by
+// default, or none if stdout is a terminal), and otherwise when a task or
+// thread starts or ends, before reading stdin or running a command, and at
+// exit. Lines of threads running at once interleave by the buffer.
+struct Output {
+  std::string text;
+
+  ~Output() { flush(); }
+
+  void flush() {
+    if (text.empty())
+      return;
+    fwrite(text.data(), 1, text.size(), stdout);
+    fflush(stdout);
+    text.clear();
+  }
+};
+
+constexpr size_t kOutputBuffer = 64 * 1024;
+
+Output &output() {
+  static thread_local Output output;
+  return output;
+}
+
+size_t output_threshold() {
+  static const size_t threshold = [] {
+    if (const char *size = getenv("PAREN_OUTPUT_BUFFER"))
+      return static_cast<size_t>(std::max(atol(size), 0L));
+    return isatty(STDOUT_FILENO) ? size_t(0) : kOutputBuffer;
+  }();
+  return threshold;
+}
+
+void print(std::vector<snode> &args, bool newline) {
+  Output &out = output();
+  for (size_t i = 0; i < args.size(); i++) {
+    if (i > 0)
+      out.text += ' ';
+    args[i]->write_to(out.text);
   }
+  if (newline)
+    out.text += '\n';
+  if (out.text.size() >= output_threshold())
+    out.flush();
+}
+
+}  // namespace
+
+void flush_output() { output().flush(); }
+
+snode builtin_pr(std::vector<snode> &args, senvironment &env) {  // (pr X ..)
+  print(args, /*newline=*/false);
   return nil;
 }
 
 snode builtin_prn(std::vector<snode> &args, senvironment &env) {  // (prn X ..)
-  builtin_pr(args, env);
-  puts("");
+  print(args, /*newline=*/true);
   return nil;
 }
 
 snode builtin_exit(std::vector<snode> &args, senvironment &env) {  // (exit {X})
+  flush_output();
   puts("");
   if (args.size() == 0)
     exit(0);
@@ -1062,40 +6097,112 @@ snode builtin_system(
   for (snode &n : args) {
     cmd += n->to_string();
   }
-  return std::make_shared<Node>(system(cmd.c_str()));
+  flush_output();
+  return make_snode(system(cmd.c_str()));
 }
 
 snode builtin_cons(
     std::vector<snode> &args,
     senvironment &env) {  // (cons X LST): Returns a new list where x is the
                           // first element and lst is the rest.
-  snode x = args[0];
-  snode lst = args[1];
-  std::vector<snode> r;
-  r.push_back(x);
-  for (std::vector<snode>::iterator i = lst->v_list.begin();
-       i != lst->v_list.end(); i++) {
-    r.push_back(*i);
-  }
-  return std::make_shared<Node>(r);
+  snode rest = persistent(args[1], env);
+  size_t length = persistent_length(*rest) + 1;
+  return make_persistent(Cons{copy_node(args[0]), std::move(rest), length});
 }
 
-snode builtin_read_line(std::vector<snode> &args,
-                        senvironment &env) {  // (read-line)
-  std::string line;
-  if (!getline(std::cin, line)) {  // EOF
+snode builtin_first(std::vector<snode> &args,
+                    senvironment &env) {  // (first LIST)
+  const Node &list = *args[0];
+  if (list.type == Node::T_CONS)
+    return cons_of(list).first;
+  if (list.type == Node::T_PVEC)
+    return pvec_at(pvec_of(list), 0);
+  if (list.type == Node::T_LIST)
+    return list.v_list.empty() ? nil : list.v_list[0];
+  snode item = nil;
+  Cursor(args[0], env).next(item);
+  return item;
+}
+
+// (rest LIST): All of LIST but the first element, as a persistent list. nil
+// if there is no more.
+snode builtin_rest(std::vector<snode> &args, senvironment &env) {
+  const Node &list = *args[0];
+  if (list.type == Node::T_CONS)
+    return cons_of(list).rest;
+  PVec vec = pvec_of_list(args[0], env);
+  if (vec.size == 0)
     return nil;
-  } else {
-    return std::make_shared<Node>(line);
+  vec.start++;
+  vec.size--;
+  return make_persistent(std::move(vec));
+}
+
+snode builtin_pvec(std::vector<snode> &args,
+                   senvironment &env) {  // (pvec X ..)
+  std::vector<snode> items;
+  items.reserve(args.size());
+  for (const snode &n : args)
+    items.push_back(copy_node(n));
+  return make_persistent(make_pvec_of(std::move(items)));
+}
+
+// (assoc LIST INDEX X): LIST with element INDEX of it X, as a persistent
+// vector.
+snode builtin_assoc(std::vector<snode> &args, senvironment &env) {
+  PVec vec = pvec_of_list(args[0], env);
+  int i = args[1]->to_int();
+  assert(i >= 0 && static_cast<size_t>(i) < vec.size && "Index out of list");
+  return make_persistent(
+      pvec_assoc(vec, static_cast<size_t>(i), copy_node(args[2])));
+}
+
+// (push-back LIST X): LIST with X after the last element, as a persistent
+// vector.
+snode builtin_push_back(std::vector<snode> &args, senvironment &env) {
+  return make_persistent(
+      pvec_push_back(pvec_of_list(args[0], env), copy_node(args[1])));
+}
+
+snode builtin_read_line(std::vector<snode> &args,
+                        senvironment &env) {  // (read-line {FILE})
+  if (args.empty()) {
+    flush_output();  // eg. a prompt
+    std::string line;
+    if (!getline(std::cin, line)) {  // EOF
+      return nil;
+    } else {
+      return make_snode(line);
+    }
   }
+  File *file = file_of(args[0]);
+  if (!file)
+    return nil;
+  std::lock_guard<std::mutex> lock(file->mutex);
+  ssize_t n;
+  if (!file->stream ||
+      (n = getline(&file->line, &file->line_size, file->stream)) < 0)
+    return nil;
+  size_t size = static_cast<size_t>(n);
+  if (size > 0 && file->line[size - 1] == '\n')
+    size--;
+  return make_snode(String(std::string_view(file->line, size)));
 }
 
 snode builtin_slurp(std::vector<snode> &args,
                     senvironment &env) {  // (slurp FILENAME)
   std::string filename = args[0]->to_string();
+  // A large file is mapped, and the string borrows the mapping.
+  struct stat st;
+  if (stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+      static_cast<size_t>(st.st_size) >= kMapSlurp) {
+    auto file = std::make_shared<MappedFile>(filename);
+    if (*file)
+      return make_snode(String::borrow(file->view(), file));
+  }
   std::string str;
   if (slurp(filename, str))
-    return std::make_shared<Node>(str);
+    return make_snode(str);
   else
     return nil;
 }
@@ -1103,127 +6210,616 @@ snode builtin_slurp(std::vector<snode> &args,
 snode builtin_spit(std::vector<snode> &args,
                    senvironment &env) {  // (spit FILENAME STRING)
   std::string filename = args[0]->to_string();
-  std::string str = args[1]->to_string();
-  return std::make_shared<Node>(spit(filename, str));
+  if (args[1]->type == Node::T_STRING)
+    return make_snode(spit(filename, args[1]->v_string));
+  return make_snode(spit(filename, args[1]->to_string()));
+}
+
+snode builtin_open(std::vector<snode> &args,
+                   senvironment &env) {  // (open FILENAME {MODE})
+  std::string filename = args[0]->to_string();
+  std::string mode = args.size() >= 2 ? args[1]->to_string() : "r";
+  if (mode != "r" && mode != "w" && mode != "a")
+    return nil;
+  FILE *stream = fopen(filename.c_str(), mode.c_str());
+  if (!stream)
+    return nil;
+  auto file = std::make_shared<File>();
+  file->stream = stream;
+  file->buffer.reset(new char[kFileBuffer]);
+  setvbuf(stream, file->buffer.get(), _IOFBF, kFileBuffer);
+  Node n;
+  n.type = Node::T_FILE;
+  n.v_object = std::move(file);
+  return make_snode(n);
+}
+
+snode builtin_read_chunk(std::vector<snode> &args,
+                         senvironment &env) {  // (read-chunk FILE SIZE)
+  File *file = file_of(args[0]);
+  int size = args.size() >= 2 ? args[1]->to_int() : 0;
+  if (!file || size <= 0)
+    return nil;
+  std::lock_guard<std::mutex> lock(file->mutex);
+  if (!file->stream)
+    return nil;
+  size_t n = static_cast<size_t>(size);
+  String chunk = String::make(
+      n, [&](char *p) { return fread(p, 1, n, file->stream); });
+  if (chunk.empty())  // EOF
+    return nil;
+  return make_snode(std::move(chunk));
+}
+
+snode builtin_write(std::vector<snode> &args,
+                    senvironment &env) {  // (write FILE X ..)
+  File *file = file_of(args[0]);
+  if (!file)
+    return nil;
+  std::lock_guard<std::mutex> lock(file->mutex);
+  if (!file->stream)
+    return nil;
+  size_t written = 0;
+  for (size_t i = 1; i < args.size(); i++) {
+    if (args[i]->type == Node::T_STRING) {
+      const String &text = args[i]->v_string;
+      written += fwrite(text.data(), 1, text.size(), file->stream);
+    } else {
+      std::string text = args[i]->to_string();
+      written += fwrite(text.data(), 1, text.size(), file->stream);
+    }
+  }
+  return make_snode(static_cast<int>(written));
+}
+
+snode builtin_close(std::vector<snode> &args,
+                    senvironment &env) {  // (close FILE)
+  File *file = file_of(args[0]);
+  if (!file)
+    return node_false;
+  std::lock_guard<std::mutex> lock(file->mutex);
+  if (!file->stream)
+    return node_false;
+  bool ok = fclose(file->stream) == 0;
+  file->stream = nullptr;
+  return ok ? node_true : node_false;
 }
 
 snode special_thread(std::vector<snode> &raw_args,
-                     senvironment &env) {  // (std::thread EXPR ..): Creates new
+                     senvironment &env) {  // (thread EXPR ..): Creates new
                                            // std::thread and starts it.
   Node n2;
   n2.type = Node::T_THREAD;
   // You can not use std::shared_ptr for std::thread. It is deleted early.
-  n2.p_thread = new std::thread([&]() {
-    std::vector<snode> exprs(raw_args.begin() + 1,
-                             raw_args.end());  // to prevent early deletion and
-                                               // keep expressions in memory.
-    for (auto &sn : exprs) {
-      eval(sn, env);
+  Context *here = context;
+  here->threads_running.fetch_add(1, std::memory_order_relaxed);
+  flush_output();  // before anything the thread prints
+  std::vector<snode> exprs(raw_args.begin() + 1, raw_args.end());
+  n2.p_thread = new std::thread([exprs = std::move(exprs), env,
+                                 here]() mutable {
+    enter(here);
+    {
+      // The thread has a VM and heap arenas of its own, and a frame of its
+      // own for what it defines. Whatever it shares is let go of before it
+      // stops counting as running.
+      std::vector<snode> body = std::move(exprs);
+      senvironment local = make_env(std::move(env));
+      for (snode &sn : body)
+        eval(sn, local);
     }
+    enter(&default_context);
+    here->threads_running.fetch_sub(1, std::memory_order_release);
   });
-  return std::make_shared<Node>(n2);
+  return make_snode(n2);
+}
+
+snode special_spawn(std::vector<snode> &raw_args,
+                    senvironment &env) {  // (spawn EXPR ..) => FUTURE
+  auto future = std::make_shared<Future>();
+  std::vector<snode> exprs(raw_args.begin() + 1, raw_args.end());
+  // Like a thread, it gets a frame of its own.
+  submit_task([future, exprs = std::move(exprs), env] {
+    senvironment local = make_env(env);
+    snode value = nil;
+    for (snode sn : exprs)
+      value = eval(sn, local);
+    future->value = std::move(value);
+    future->done.store(true, std::memory_order_release);
+  });
+  Node n;
+  n.type = Node::T_FUTURE;
+  n.v_object = std::move(future);
+  return make_snode(n);
+}
+
+snode builtin_await(std::vector<snode> &args,
+                    senvironment &env) {  // (await FUTURE) => its value
+  if (args.empty() || args[0]->type != Node::T_FUTURE)
+    return args.empty() ? nil : args[0];
+  Future &future = *static_cast<Future *>(args[0]->v_object.get());
+  pool().wait([&] { return future.done.load(std::memory_order_acquire); });
+  return future.value;
+}
+
+snode builtin_gc(std::vector<snode> &args,
+                 senvironment &env) {  // (gc) => number of objects freed
+  return make_snode(static_cast<int>(collect()));
+}
+
+snode builtin_jit_compile(std::vector<snode> &args,
+                          senvironment &env) {  // (jit-compile FN) => BOOL
+  Node &func = *args[0];
+  if (!jit || func.type != Node::T_FN)
+    return make_snode(false);
+  Code &code = ensure_code(func);
+  native_code compiled = code.native.load(std::memory_order_acquire);
+  if (!compiled && (compiled = jit(code))) {
+    // Another thread may have compiled it meanwhile; keep the first.
+    native_code none = nullptr;
+    code.native.compare_exchange_strong(none, compiled);
+  }
+  return make_snode(compiled != nullptr);
+}
+
+snode builtin_jit_compiledp(
+    std::vector<snode> &args,
+    senvironment &env) {  // (jit-compiled? FN) => BOOL, without compiling it
+  Node &func = *args[0];
+  if (func.type != Node::T_FN || !func.v_code)
+    return make_snode(false);
+  return make_snode(func.v_code->native.load(std::memory_order_acquire) !=
+                    nullptr);
+}
+
+snode builtin_gc_stats(std::vector<snode> &args,
+                       senvironment &env) {  // (gc-stats) => ((NAME VALUE) ..)
+  HeapStats heap = heap_stats();
+  std::vector<snode> ret;
+  auto add = [&](const char *name, snode value) {
+    Node key;
+    key.type = Node::T_SYMBOL;
+    key.v_string = name;
+    key.code = ToCode(name);
+    ret.push_back(make_snode(std::vector<snode>{make_snode(key), value}));
+  };
+  // An int while it fits in one, as a double past that.
+  auto count = [](size_t n) {
+    if (n <= static_cast<size_t>(std::numeric_limits<int>::max()))
+      return make_snode(static_cast<int>(n));
+    return make_snode(static_cast<double>(n));
+  };
+  add("allocated-bytes", count(heap.allocated_bytes));
+  add("live-objects", count(heap.live_objects));
+  add("collections", count(heap.collections));
+  add("freed-objects", count(heap.freed_objects));
+  add("last-pause-us", make_snode(heap.last_pause_us));
+  add("max-pause-us", make_snode(heap.max_pause_us));
+  add("total-pause-us", make_snode(heap.total_pause_us));
+  return make_snode(ret);
+}
+
+snode builtin_profile_start(
+    std::vector<snode> &args,
+    senvironment &env) {  // (profile-start {MODE}): "calls" or "sample"
+  std::string mode = args.empty() ? "calls" : args[0]->to_string();
+  return make_snode(profile_start(mode));
+}
+
+snode builtin_profile_report(std::vector<snode> &args,
+                             senvironment &env) {  // (profile-report {FILE})
+  flush_output();
+  std::string path = args.empty() ? "" : args[0]->to_string();
+  return make_snode(profile_report(path));
 }
 
 snode builtin_join(
     std::vector<snode> &args,
     senvironment &env) {  // (join THREAD): wait for THREAD to end
   snode t = args[0];
-  pthread &pt = t->p_thread;
+  pthread pt = nullptr;
+  {
+    Lock lock = lock_node(t.get());
+    std::swap(pt, t->p_thread);
+  }
   if (pt != nullptr) {
     pt->join();
     delete pt;
-    pt = nullptr;
   }
   return nil;
 }
 
-void init() {
+void init_builtins() {
   srand((unsigned int)time(0));
 
-  global_env = std::make_shared<environment>(environment());
-
-  global_env->env[ToCode("true")] = std::make_shared<Node>(true);
-  global_env->env[ToCode("false")] = std::make_shared<Node>(false);
-  global_env->env[ToCode("E")] = std::make_shared<Node>(2.71828182845904523536);
-  global_env->env[ToCode("PI")] =
-      std::make_shared<Node>(3.14159265358979323846);
-
-  global_env->env[ToCode("def")] = make_special(special_def);
-  global_env->env[ToCode("set")] = make_special(special_set);
-  global_env->env[ToCode("if")] = make_special(special_if);
-  global_env->env[ToCode("fn")] = make_special(special_fn);
-  global_env->env[ToCode("begin")] = make_special(special_begin);
-  global_env->env[ToCode("while")] = make_special(special_while);
-  global_env->env[ToCode("quote")] = make_special(special_quote);
-  global_env->env[ToCode("&&")] = make_special(special_andand);
-  global_env->env[ToCode("||")] = make_special(special_oror);
-  global_env->env[ToCode("std::thread")] =
-      std::make_shared<Node>(special_thread);
-
-  global_env->env[ToCode("eval")] = std::make_shared<Node>(builtin_eval);
-  global_env->env[ToCode("+")] = std::make_shared<Node>(builtin_plus);
-  global_env->env[ToCode("-")] = std::make_shared<Node>(builtin_minus);
-  global_env->env[ToCode("*")] = std::make_shared<Node>(builtin_mul);
-  global_env->env[ToCode("/")] = std::make_shared<Node>(builtin_div);
-  global_env->env[ToCode("<")] = std::make_shared<Node>(builtin_lt);
-  global_env->env[ToCode("^")] = std::make_shared<Node>(builtin_caret);
-  global_env->env[ToCode("%")] = std::make_shared<Node>(builtin_percent);
-  global_env->env[ToCode("sqrt")] = std::make_shared<Node>(builtin_sqrt);
-  global_env->env[ToCode("++")] = std::make_shared<Node>(builtin_plusplus);
-  global_env->env[ToCode("--")] = std::make_shared<Node>(builtin_minusminus);
-  global_env->env[ToCode("floor")] = std::make_shared<Node>(builtin_floor);
-  global_env->env[ToCode("ceil")] = std::make_shared<Node>(builtin_ceil);
-  global_env->env[ToCode("ln")] = std::make_shared<Node>(builtin_ln);
-  global_env->env[ToCode("log10")] = std::make_shared<Node>(builtin_log10);
-  global_env->env[ToCode("rand")] = std::make_shared<Node>(builtin_rand);
-  global_env->env[ToCode("==")] = std::make_shared<Node>(builtin_eqeq);
-  global_env->env[ToCode("<")] = std::make_shared<Node>(builtin_lt);
-  global_env->env[ToCode("!")] = std::make_shared<Node>(builtin_not);
-  global_env->env[ToCode("strlen")] = std::make_shared<Node>(builtin_strlen);
-  global_env->env[ToCode("char-at")] = std::make_shared<Node>(builtin_char_at);
-  global_env->env[ToCode("chr")] = std::make_shared<Node>(builtin_chr);
-  global_env->env[ToCode("int")] = std::make_shared<Node>(builtin_int);
-  global_env->env[ToCode("double")] = std::make_shared<Node>(builtin_double);
-  global_env->env[ToCode("std::string")] =
-      std::make_shared<Node>(builtin_string);
-  global_env->env[ToCode("string")] = std::make_shared<Node>(builtin_string);
-  global_env->env[ToCode("read-std::string")] =
-      std::make_shared<Node>(builtin_read_string);
-  global_env->env[ToCode("type")] = std::make_shared<Node>(builtin_type);
-  global_env->env[ToCode("list")] = std::make_shared<Node>(builtin_list);
-  global_env->env[ToCode("apply")] = std::make_shared<Node>(builtin_apply);
-  global_env->env[ToCode("fold")] = std::make_shared<Node>(builtin_fold);
-  global_env->env[ToCode("std::map")] = std::make_shared<Node>(builtin_map);
-  global_env->env[ToCode("filter")] = std::make_shared<Node>(builtin_filter);
-  global_env->env[ToCode("push-back!")] =
-      std::make_shared<Node>(builtin_push_backd);
-  global_env->env[ToCode("pop-back!")] =
-      std::make_shared<Node>(builtin_pop_backd);
-  global_env->env[ToCode("nth")] = std::make_shared<Node>(builtin_nth);
-  global_env->env[ToCode("length")] = std::make_shared<Node>(builtin_length);
-  global_env->env[ToCode("pr")] = std::make_shared<Node>(builtin_pr);
-  global_env->env[ToCode("prn")] = std::make_shared<Node>(builtin_prn);
-  global_env->env[ToCode("exit")] = std::make_shared<Node>(builtin_exit);
-  global_env->env[ToCode("system")] = std::make_shared<Node>(builtin_system);
-  global_env->env[ToCode("cons")] = std::make_shared<Node>(builtin_cons);
-  global_env->env[ToCode("read-line")] =
-      std::make_shared<Node>(builtin_read_line);
-  global_env->env[ToCode("slurp")] = std::make_shared<Node>(builtin_slurp);
-  global_env->env[ToCode("spit")] = std::make_shared<Node>(builtin_spit);
-  global_env->env[ToCode("join")] = std::make_shared<Node>(builtin_join);
-  global_env->env[ToCode("import")] = std::make_shared<Node>(builtin_import);
+  senvironment &global_env = context->globals;
+  global_env = make_env();
+  global_env->global = true;
+
+  global_env->set(ToCode("true"), make_snode(true));
+  global_env->set(ToCode("false"), make_snode(false));
+  global_env->set(ToCode("E"), make_snode(2.71828182845904523536));
+  global_env->set(ToCode("PI"), make_snode(3.14159265358979323846));
+
+  global_env->set(ToCode("def"), make_special(special_def));
+  global_env->set(ToCode("set"), make_special(special_set));
+  global_env->set(ToCode("if"), make_special(special_if));
+  global_env->set(ToCode("fn"), make_special(special_fn));
+  global_env->set(ToCode("begin"), make_special(special_begin));
+  global_env->set(ToCode("while"), make_special(special_while));
+  global_env->set(ToCode("quote"), make_special(special_quote));
+  global_env->set(ToCode("&&"), make_special(special_andand));
+  global_env->set(ToCode("||"), make_special(special_oror));
+  global_env->set(ToCode("std::thread"), make_special(special_thread));
+  global_env->set(ToCode("thread"), make_special(special_thread));
+  global_env->set(ToCode("spawn"), make_special(special_spawn));
+  global_env->set(ToCode("await"), make_snode(builtin_await));
+
+  global_env->set(ToCode("eval"), make_snode(builtin_eval));
+  global_env->set(ToCode("+"), make_snode(builtin_plus));
+  global_env->set(ToCode("-"), make_snode(builtin_minus));
+  global_env->set(ToCode("*"), make_snode(builtin_mul));
+  global_env->set(ToCode("/"), make_snode(builtin_div));
+  global_env->set(ToCode("<"), make_snode(builtin_lt));
+  global_env->set(ToCode("^"), make_snode(builtin_caret));
+  global_env->set(ToCode("%"), make_snode(builtin_percent));
+  global_env->set(ToCode("sqrt"), make_snode(builtin_sqrt));
+  global_env->set(ToCode("++"), make_snode(builtin_plusplus));
+  global_env->set(ToCode("--"), make_snode(builtin_minusminus));
+  global_env->set(ToCode("floor"), make_snode(builtin_floor));
+  global_env->set(ToCode("ceil"), make_snode(builtin_ceil));
+  global_env->set(ToCode("ln"), make_snode(builtin_ln));
+  global_env->set(ToCode("log10"), make_snode(builtin_log10));
+  global_env->set(ToCode("rand"), make_snode(builtin_rand));
+  global_env->set(ToCode("=="), make_snode(builtin_eqeq));
+  global_env->set(ToCode("<"), make_snode(builtin_lt));
+  global_env->set(ToCode("!"), make_snode(builtin_not));
+  global_env->set(ToCode("strlen"), make_snode(builtin_strlen));
+  global_env->set(ToCode("char-at"), make_snode(builtin_char_at));
+  global_env->set(ToCode("chr"), make_snode(builtin_chr));
+  global_env->set(ToCode("int"), make_snode(builtin_int));
+  global_env->set(ToCode("double"), make_snode(builtin_double));
+  global_env->set(ToCode("std::string"), make_snode(builtin_string));
+  global_env->set(ToCode("string"), make_snode(builtin_string));
+  global_env->set(ToCode("read-std::string"), make_snode(builtin_read_string));
+  global_env->set(ToCode("type"), make_snode(builtin_type));
+  global_env->set(ToCode("list"), make_snode(builtin_list));
+  global_env->set(ToCode("apply"), make_snode(builtin_apply));
+  global_env->set(ToCode("fold"), make_snode(builtin_fold));
+  global_env->set(ToCode("std::map"), make_snode(builtin_map));
+  global_env->set(ToCode("map"), make_snode(builtin_map));
+  global_env->set(ToCode("filter"), make_snode(builtin_filter));
+  global_env->set(ToCode("range"), make_snode(builtin_range));
+  global_env->set(ToCode("seq"), make_snode(builtin_seq));
+  global_env->set(ToCode("take"), make_snode(builtin_take));
+  global_env->set(ToCode("reduce"), make_snode(builtin_reduce));
+  global_env->set(ToCode("pmap"), make_snode(builtin_pmap));
+  global_env->set(ToCode("pfilter"), make_snode(builtin_pfilter));
+  global_env->set(ToCode("preduce"), make_snode(builtin_preduce));
+  global_env->set(ToCode("push-back!"), make_snode(builtin_push_backd));
+  global_env->set(ToCode("pop-back!"), make_snode(builtin_pop_backd));
+  global_env->set(ToCode("nth"), make_snode(builtin_nth));
+  global_env->set(ToCode("length"), make_snode(builtin_length));
+  global_env->set(ToCode("f64vec"), make_snode(builtin_f64vec));
+  global_env->set(ToCode("i32vec"), make_snode(builtin_i32vec));
+  global_env->set(ToCode("f64vec-range"), make_snode(builtin_f64vec_range));
+  global_env->set(ToCode("i32vec-range"), make_snode(builtin_i32vec_range));
+  global_env->set(ToCode("dot"), make_snode(builtin_dot));
+  global_env->set(ToCode("sum"), make_snode(builtin_sum));
+  global_env->set(ToCode("min"), make_snode(builtin_min));
+  global_env->set(ToCode("max"), make_snode(builtin_max));
+  global_env->set(ToCode("dict"), make_snode(builtin_dict));
+  global_env->set(ToCode("get"), make_snode(builtin_get));
+  global_env->set(ToCode("put!"), make_snode(builtin_putd));
+  global_env->set(ToCode("has?"), make_snode(builtin_hasp));
+  global_env->set(ToCode("keys"), make_snode(builtin_keys));
+  global_env->set(ToCode("pr"), make_snode(builtin_pr));
+  global_env->set(ToCode("prn"), make_snode(builtin_prn));
+  global_env->set(ToCode("exit"), make_snode(builtin_exit));
+  global_env->set(ToCode("system"), make_snode(builtin_system));
+  global_env->set(ToCode("cons"), make_snode(builtin_cons));
+  global_env->set(ToCode("first"), make_snode(builtin_first));
+  global_env->set(ToCode("rest"), make_snode(builtin_rest));
+  global_env->set(ToCode("pvec"), make_snode(builtin_pvec));
+  global_env->set(ToCode("assoc"), make_snode(builtin_assoc));
+  global_env->set(ToCode("push-back"), make_snode(builtin_push_back));
+  global_env->set(ToCode("read-line"), make_snode(builtin_read_line));
+  global_env->set(ToCode("slurp"), make_snode(builtin_slurp));
+  global_env->set(ToCode("spit"), make_snode(builtin_spit));
+  global_env->set(ToCode("open"), make_snode(builtin_open));
+  global_env->set(ToCode("read-chunk"), make_snode(builtin_read_chunk));
+  global_env->set(ToCode("write"), make_snode(builtin_write));
+  global_env->set(ToCode("close"), make_snode(builtin_close));
+  global_env->set(ToCode("join"), make_snode(builtin_join));
+  global_env->set(ToCode("gc"), make_snode(builtin_gc));
+  global_env->set(ToCode("gc-stats"), make_snode(builtin_gc_stats));
+  global_env->set(ToCode("profile-start"), make_snode(builtin_profile_start));
+  global_env->set(ToCode("profile-report"),
+                  make_snode(builtin_profile_report));
+  global_env->set(ToCode("jit-compile"), make_snode(builtin_jit_compile));
+  global_env->set(ToCode("jit-compiled?"), make_snode(builtin_jit_compiledp));
+  global_env->set(ToCode("import"), make_snode(builtin_import));
+}
+
+void init() {
+  init_builtins();
 
   char library[] = "library.paren";
-  std::string code;
-  if (libparen::slurp(library, code)) {
-    libparen::eval_string(code);
-  } else {
+  if (!eval_file(library)) {
     printf("Error loading %s\n", library);
   }
 }
 
+namespace {
+
+// Copies the globals of one interpreter into another's, for fork. Each node
+// and environment reached is copied once, so what is shared between globals
+// stays so between the copies; a fn closing over the global table of the
+// original closes over that of the copy.
+class Cloner {
+ public:
+  Cloner(const senvironment &from, const senvironment &to) {
+    envs.emplace(from.get(), to);
+  }
+
+  snode node(const snode &n) {
+    if (!n)
+      return n;
+    if (snode *done = nodes.find(n.get()))
+      return *done;
+    snode copy = make_snode(*n);
+    nodes.emplace(n.get(), copy);
+    switch (copy->type) {
+      case Node::T_LIST:
+        for (snode &item : copy->v_list)
+          item = node(item);
+        break;
+      case Node::T_FN:
+        copy->outer_env = env(copy->outer_env);
+        break;
+      case Node::T_DICT: {
+        auto dict = std::make_shared<Dict>();
+        for (auto &[key, value] : dict_of(*n))
+          dict->emplace(node(key), node(value));
+        copy->v_object = std::move(dict);
+        break;
+      }
+      case Node::T_SEQ: {
+        auto seq = std::make_shared<Seq>(seq_of(*n));
+        seq->source = node(seq->source);
+        seq->f = node(seq->f);
+        copy->v_object = std::move(seq);
+        break;
+      }
+      case Node::T_CONS: {
+        // A cell at a time down the list, as for freeing one (see Cons).
+        const Node *from = n.get();
+        Node *to = copy.get();
+        for (;;) {
+          const Cons &cell = cons_of(*from);
+          auto cloned = std::make_shared<Cons>(
+              Cons{node(cell.first), nullptr, cell.length});
+          to->v_object = cloned;
+          const snode &rest = cell.rest;
+          if (rest->type != Node::T_CONS || nodes.find(rest.get())) {
+            cloned->rest = node(rest);
+            break;
+          }
+          cloned->rest = make_snode(*rest);
+          nodes.emplace(rest.get(), cloned->rest);
+          from = rest.get();
+          to = cloned->rest.get();
+        }
+        break;
+      }
+      case Node::T_PVEC: {
+        std::vector<snode> items;
+        each_persistent(*n, [&](const snode &item) {
+          items.push_back(node(item));
+        });
+        copy->v_object = std::make_shared<PVec>(make_pvec_of(std::move(items)));
+        break;
+      }
+      case Node::T_THREAD:
+        copy->p_thread = nullptr;  // joined through the original
+        break;
+      default:
+        break;
+    }
+    return copy;
+  }
+
+  senvironment env(const senvironment &e) {
+    if (!e)
+      return e;
+    if (senvironment *done = envs.find(e.get()))
+      return *done;
+    senvironment copy = make_env();
+    envs.emplace(e.get(), copy);
+    copy->code = e->code;
+    copy->global = e->global;
+    copy->outer = env(e->outer);
+    fill(*e, *copy);
+    return copy;
+  }
+
+  // Binds in `to` what `from` does.
+  void fill(const environment &from, environment &to) {
+    for (const auto &[code, value] : from.env)
+      to.env.emplace(code, node(value));
+    to.slots.resize(from.slots.size());
+    for (size_t i = 0; i < from.slots.size(); i++) {
+      const Value &value = from.slots[i];
+      to.slots[i] = value.tag == Value::BOXED ? Value(node(value.box)) : value;
+    }
+  }
+
+ private:
+  HashMap<const Node *, snode> nodes;
+  HashMap<const environment *, senvironment> envs;
+};
+
+}  // namespace
+
+Interpreter::Interpreter() : context_(std::make_unique<Context>()) {
+  Scope scope(*this);
+  init_builtins();
+}
+
+Interpreter::Interpreter(std::unique_ptr<Context> context)
+    : context_(std::move(context)) {}
+
+Interpreter::Interpreter(Interpreter &&other) = default;
+
+Interpreter::~Interpreter() {
+  if (!context_)
+    return;  // moved from
+  while (context_->threads_running.load(std::memory_order_acquire) > 0)
+    std::this_thread::yield();
+  Scope scope(*this);
+  context_->globals.reset();
+  context_->macros.clear();
+  // Nothing outside is left holding what was reachable from the globals only
+  // through cycles.
+  libparen::collect();
+  registry.orphan();
+  std::lock_guard<std::mutex> lock(context_->orphaned_envs_mutex);
+  context_->orphaned_envs.clear();
+}
+
+Interpreter::Scope::Scope(Interpreter &interpreter)
+    : outer(enter(interpreter.context_.get())) {}
+
+Interpreter::Scope::~Scope() { enter(outer); }
+
+Interpreter Interpreter::fork() {
+  Interpreter copy{std::make_unique<Context>()};
+  Context &from = *context_;
+  Context &to = *copy.context_;
+  {
+    ReadLock lock(from.macros_mutex);
+    to.macros = from.macros;
+    to.macro_state = from.macro_state;
+  }
+  Scope scope(copy);
+  to.globals = make_env();
+  to.globals->global = true;
+  Cloner(from.globals, to.globals).fill(*from.globals, *to.globals);
+  return copy;
+}
+
+void Interpreter::init() {
+  Scope scope(*this);
+  libparen::init();
+}
+
+snode Interpreter::eval_string(std::string_view s) {
+  Scope scope(*this);
+  std::string code(s);
+  return libparen::eval_string(code);
+}
+
+bool Interpreter::eval_file(std::string_view path) {
+  Scope scope(*this);
+  return libparen::eval_file(path);
+}
+
+snode Interpreter::get(const char *name) {
+  Scope scope(*this);
+  return libparen::get(name);
+}
+
+void Interpreter::set(const char *name, Node value) {
+  Scope scope(*this);
+  libparen::set(name, std::move(value));
+}
+
+size_t Interpreter::collect() {
+  Scope scope(*this);
+  return libparen::collect();
+}
+
+HeapStats Interpreter::heap_stats() {
+  Scope scope(*this);
+  return libparen::heap_stats();
+}
+
+}  // namespace libparen
+
+struct paren_ctx {
+  libparen::Interpreter interpreter;
+};
+
+namespace libparen {
+
 extern "C" void paren_init() { init(); }
 extern "C" void paren_eval_string(const char *s) { eval_string(s); }
 extern "C" void paren_import(const char *s) { import_impl(s); }
 
+extern "C" paren_ctx *paren_ctx_new() { return new paren_ctx{Interpreter()}; }
+
+extern "C" paren_ctx *paren_ctx_fork(paren_ctx *ctx) {
+  return new paren_ctx{ctx->interpreter.fork()};
+}
+
+extern "C" void paren_ctx_free(paren_ctx *ctx) { delete ctx; }
+extern "C" void paren_ctx_init(paren_ctx *ctx) { ctx->interpreter.init(); }
+
+extern "C" void paren_ctx_eval_string(paren_ctx *ctx, const char *s) {
+  ctx->interpreter.eval_string(s);
+}
+
+extern "C" void paren_ctx_import(paren_ctx *ctx, const char *s) {
+  Interpreter::Scope scope(ctx->interpreter);
+  import_impl(s);
+}
+
+extern "C" int paren_ctx_get_int(paren_ctx *ctx, const char *name) {
+  return ctx->interpreter.get(name)->to_int();
+}
+
+extern "C" void paren_run_image(const char *image, size_t size,
+                                void (*const *natives)(void *vm),
+                                size_t count) {
+  run_image(std::string_view(image, size), natives, count);
+}
+
+extern "C" void paren_rt_exec(void *vm, uint32_t pc) {
+  static_cast<VM *>(vm)->exec(pc);
+}
+
+extern "C" int paren_rt_pop_truthy(void *vm) {
+  return static_cast<VM *>(vm)->pop_truthy();
+}
+
+extern "C" int paren_rt_prepare_call(void *vm, uint32_t pc) {
+  return static_cast<VM *>(vm)->prepare_call(pc);
+}
+
+extern "C" int paren_rt_guard(void *vm, uint32_t pc) {
+  return static_cast<VM *>(vm)->guard(pc);
+}
+
+extern "C" void paren_rt_call(void *vm, uint32_t pc) {
+  static_cast<VM *>(vm)->call(pc);
+}
+
+extern "C" int paren_rt_tail_call(void *vm, uint32_t pc) {
+  return static_cast<VM *>(vm)->tail_call(pc);
+}
+
+extern "C" int paren_rt_intact(void *vm, uint32_t pc) {
+  return static_cast<VM *>(vm)->intact(pc);
+}
+
+extern "C" void paren_rt_push(void *vm, int tag, int64_t bits) {
+  Value value;
+  value.tag = static_cast<Value::Tag>(tag);
+  memcpy(&value.v_double, &bits, sizeof bits);
+  static_cast<VM *>(vm)->push(value);
+}
+
+extern "C" void *paren_rt_slots(void *vm) {
+  return static_cast<VM *>(vm)->slots();
+}
+
 }  // namespace libparen
@@ -1,9 +1,13 @@
 #ifndef LIBPAREN_H
 #define LIBPAREN_H
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iostream>
 #include <map>
@@ -18,6 +22,17 @@
 inline constexpr std::string_view kParenInitName = "paren_init";
 inline constexpr std::string_view kParenEvalStringName = "paren_eval_string";
 inline constexpr std::string_view kParenImportName = "paren_import";
+inline constexpr std::string_view kParenRunImageName = "paren_run_image";
+inline constexpr std::string_view kParenRtExecName = "paren_rt_exec";
+inline constexpr std::string_view kParenRtPopTruthyName = "paren_rt_pop_truthy";
+inline constexpr std::string_view kParenRtPrepareCallName =
+    "paren_rt_prepare_call";
+inline constexpr std::string_view kParenRtGuardName = "paren_rt_guard";
+inline constexpr std::string_view kParenRtCallName = "paren_rt_call";
+inline constexpr std::string_view kParenRtTailCallName = "paren_rt_tail_call";
+inline constexpr std::string_view kParenRtIntactName = "paren_rt_intact";
+inline constexpr std::string_view kParenRtPushName = "paren_rt_push";
+inline constexpr std::string_view kParenRtSlotsName = "paren_rt_slots";
 
 extern "C" {
 
@@ -26,6 +41,46 @@ void paren_eval_string(const char *);
 void paren_import(const char *);
 void paren_init();
 
+// Interpreters of their own (see libparen::Interpreter), which the functions
+// above do not act on.
+typedef struct paren_ctx paren_ctx;
+paren_ctx *paren_ctx_new(void);  // with the builtins bound
+paren_ctx *paren_ctx_fork(paren_ctx *ctx);
+void paren_ctx_free(paren_ctx *ctx);
+void paren_ctx_init(paren_ctx *ctx);  // loads library.paren
+void paren_ctx_eval_string(paren_ctx *ctx, const char *s);
+void paren_ctx_import(paren_ctx *ctx, const char *s);
+int paren_ctx_get_int(paren_ctx *ctx, const char *name);  // of global `name`
+
+// Runs an image made by paren -c (see save_image). natives[i] is the compiled
+// function for the i-th Code of the image in preorder: each top-level form,
+// followed depth-first by the fn bodies in it.
+void paren_run_image(const char *image, size_t size,
+                     void (*const *natives)(void *vm), size_t count);
+
+// What compiled functions call to run the instruction at `pc` of the Code they
+// stand for, on `vm`, which runs the calling frame.
+void paren_rt_exec(void *vm, uint32_t pc);         // straight-line instructions
+int paren_rt_pop_truthy(void *vm);                 // OP_JUMP_IF_FALSE
+int paren_rt_prepare_call(void *vm, uint32_t pc);  // nonzero to skip the call
+void paren_rt_call(void *vm, uint32_t pc);         // OP_CALL or arithmetic
+// OP_GUARD. Nonzero if it fell back on its form, which leaves the result of
+// that, and the compiled function is to continue at the target.
+int paren_rt_guard(void *vm, uint32_t pc);
+// OP_TAIL_CALL. Nonzero if the callee took over the frame, in which case the
+// compiled function must return without pushing a result, to have it run.
+int paren_rt_tail_call(void *vm, uint32_t pc);
+// Nonzero if the symbol of the arithmetic instruction at `pc` is still bound to
+// its builtin, so that compiled code may do it inline.
+int paren_rt_intact(void *vm, uint32_t pc);
+// Pushes the libparen::Value tagged `tag` (not BOXED) whose payload has the
+// bytes of `bits`, for a value compiled code kept to itself until now.
+void paren_rt_push(void *vm, int tag, int64_t bits);
+// The slots of the calling frame, a libparen::Value each. Compiled code for a
+// leaf fn body (see Code::leaf) reads and writes them in place, which it may do
+// as they stay put while the frame runs and no other thread sees them.
+void *paren_rt_slots(void *vm);
+
 }  // extern "C"
 
 namespace libparen {
@@ -33,11 +88,114 @@ namespace libparen {
 struct Node;
 struct environment;
 struct paren;
+struct Code;
 typedef std::shared_ptr<Node> snode;
 typedef std::shared_ptr<std::thread> sthread;
 typedef std::shared_ptr<environment> senvironment;
+typedef std::shared_ptr<Code> scode;
 typedef std::thread *pthread;
 typedef snode (*builtin)(std::vector<snode> &args, senvironment &env);
+typedef void (*native_code)(void *vm);  // see paren_run_image
+
+// Text of strings and symbols. It never changes once made, so copies, as def,
+// set and push-back! make of nodes, share it. Up to kInline bytes are held
+// inline; more are in a counted buffer. Appending to a String whose bytes end
+// where those written to its buffer do extends the buffer in place, and
+// buffers so grown get room to spare, so building a string by appending to it
+// takes time linear in its length. A String can also stand for bytes held by
+// something else, eg. a mapped file, without copying them.
+class String {
+ public:
+  static constexpr size_t kInline = 15;  // the most bytes held inline
+
+  String() : size_(0) {}
+  String(std::string_view s);
+  String(const std::string &s) : String(std::string_view(s)) {}
+  String(const char *s) : String(std::string_view(s)) {}
+  String(const String &other) : size_(other.size_) {
+    if (size_ > kInline) {
+      chunk_ = other.chunk_;
+      chunk_->refs.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      memcpy(inline_, other.inline_, sizeof(inline_));
+    }
+  }
+  String(String &&other) noexcept : size_(other.size_) {
+    memcpy(inline_, other.inline_, sizeof(inline_));  // or the pointer
+    other.size_ = 0;
+  }
+  String &operator=(String other) noexcept {
+    std::swap(size_, other.size_);
+    char bytes[sizeof(inline_)];
+    memcpy(bytes, inline_, sizeof(bytes));
+    memcpy(inline_, other.inline_, sizeof(bytes));
+    memcpy(other.inline_, bytes, sizeof(bytes));
+    return *this;
+  }
+  ~String() {
+    if (size_ > kInline)
+      release(chunk_);
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const char *data() const { return size_ > kInline ? chunk_->text : inline_; }
+  char operator[](size_t i) const { return data()[i]; }
+  operator std::string_view() const { return {data(), size_}; }
+  std::string str() const { return std::string(data(), size_); }
+
+  String append(std::string_view tail) const;  // this followed by tail
+
+  // A String of `bytes`, which `owner` keeps alive and unchanged as long as it
+  // is around.
+  static String borrow(std::string_view bytes,
+                       std::shared_ptr<const void> owner);
+
+  // A String of at most `n` bytes, which fill(p) writes at p, returning how
+  // many it did.
+  template <typename F>
+  static String make(size_t n, F &&fill) {
+    String s;
+    if (n <= kInline) {
+      s.size_ = fill(s.inline_);
+      return s;
+    }
+    Chunk *chunk = make_chunk(n);
+    size_t size = fill(chunk->bytes());
+    if (size <= kInline) {
+      memcpy(s.inline_, chunk->bytes(), size);
+      release(chunk);
+    } else {
+      chunk->used.store(size, std::memory_order_relaxed);
+      s.chunk_ = chunk;
+    }
+    s.size_ = size;
+    return s;
+  }
+
+ private:
+  struct Chunk {
+    std::atomic<size_t> refs;
+    std::atomic<size_t> used;  // bytes written, which are never changed
+    size_t capacity;
+    const char *text;  // bytes(), or what owner holds
+    std::shared_ptr<const void> owner;
+    char *bytes() { return reinterpret_cast<char *>(this + 1); }
+  };
+
+  union {
+    Chunk *chunk_;
+    char inline_[kInline + 1];
+  };
+  size_t size_;
+
+  static Chunk *make_chunk(size_t capacity);
+  static void release(Chunk *chunk);
+};
+
+// The String for `s` made the first time it was asked for. Literals and
+// symbol names are interned; they stay for the life of the process.
+String intern(std::string_view s);
 
 struct Node {
   enum {
@@ -51,7 +209,15 @@ struct Node {
     T_SPECIAL,
     T_BUILTIN,
     T_FN,
-    T_THREAD
+    T_THREAD,
+    T_FUTURE,
+    T_F64VEC,  // vector of doubles
+    T_I32VEC,  // vector of ints
+    T_DICT,    // hash table
+    T_FILE,    // file opened by open
+    T_SEQ,     // lazy sequence
+    T_CONS,    // cons cell, a persistent list
+    T_PVEC     // persistent vector
   } type;
   union {
     int v_int;
@@ -61,36 +227,421 @@ struct Node {
     pthread p_thread = nullptr;
     builtin v_builtin;
   };
-  std::string v_string;
+  String v_string;
   std::vector<snode> v_list;
   senvironment outer_env;  // if T_FN
                            // sthread s_thread;
+  scode v_code;            // if T_FN, compiled body (see lower)
+  // If T_FUTURE, the Future; if a vector, its elements, which never change;
+  // if T_DICT, its table; if T_FILE, the File; if T_SEQ, the Seq; if T_CONS
+  // or T_PVEC, the cell or vector, which never changes either.
+  std::shared_ptr<void> v_object;
 
   Node();
   Node(int a);
   Node(double a);
   Node(bool a);
-  Node(const std::string &a);
+  Node(String a);
   Node(const std::vector<snode> &a);
   Node(builtin a);
 
-  int to_int();             // convert to int
-  double to_double();       // convert to double
-  std::string to_string();  // convert to std::string
+  int to_int();                     // convert to int
+  double to_double();               // convert to double
+  std::string to_string();          // convert to std::string
+  void write_to(std::string &out);  // appends to_string() to out
   std::string type_str();
   std::string str_with_type();
 };
 
+// A value as the VM holds it. Ints, doubles, bools and nils made by copying
+// (def, set) are stored inline, without a Node. Everything else is boxed, as is
+// any variable whose node has been handed out, since set and ++ update nodes in
+// place and callers rely on seeing that.
+struct Value {
+  enum Tag : uint8_t {
+    EMPTY,  // unbound slot; never on the VM stack
+    NIL,
+    INT,
+    DOUBLE,
+    BOOL,
+    BOXED
+  } tag;
+  union {
+    int v_int;
+    double v_double;
+    bool v_bool;
+  };
+  snode box;  // if BOXED
+
+  Value() : tag(EMPTY), v_double(0) {}
+  Value(int a) : tag(INT), v_int(a) {}
+  Value(double a) : tag(DOUBLE), v_double(a) {}
+  Value(bool a) : tag(BOOL), v_bool(a) {}
+  Value(snode n) : tag(BOXED), v_double(0), box(std::move(n)) {}
+
+  explicit operator bool() const { return tag != EMPTY; }  // bound
+  snode to_snode() const;  // a Node for this value, fresh unless BOXED
+  snode &boxed();          // boxes this value in place
+};
+
+// Heap
+//
+// Nodes and environments are allocated from per-thread arenas of fixed-size
+// blocks; see make_snode and make_env. References are still counted, which
+// frees everything but cycles (eg. a fn defined in the frame it closes over).
+// collect frees those: anything reachable from a tracked environment but only
+// referenced from other such objects is garbage. It runs at safe points (see
+// gc_due) and only while no other thread runs paren code of the same
+// interpreter, whose environments are all it looks at (see Interpreter).
+void *heap_allocate(size_t size);
+void heap_deallocate(void *p, size_t size);
+
+template <typename T>
+struct HeapAllocator {
+  typedef T value_type;
+  HeapAllocator() = default;
+  template <typename U>
+  HeapAllocator(const HeapAllocator<U> &) {}
+  T *allocate(size_t n) {
+    return static_cast<T *>(heap_allocate(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) { heap_deallocate(p, n * sizeof(T)); }
+  template <typename U>
+  bool operator==(const HeapAllocator<U> &) const {
+    return true;
+  }
+};
+
+template <typename... Args>
+snode make_snode(Args &&...args) {
+  return std::allocate_shared<Node>(HeapAllocator<Node>(),
+                                    std::forward<Args>(args)...);
+}
+
+void track(const senvironment &env);  // lets collect see env
+
+struct HeapStats {
+  size_t allocated_bytes;  // in blocks still in use
+  size_t live_objects;
+  size_t collections;
+  size_t freed_objects;  // by collect, in total
+  double last_pause_us;
+  double max_pause_us;
+  double total_pause_us;
+};
+
+bool gc_due();     // whether enough has been allocated since the last collect
+size_t collect();  // returns the number of objects freed
+HeapStats heap_stats();
+
+// A hash table with open addressing. Entries are kept in a vector in the
+// order they were added, and found through a table of their indices, probed
+// linearly, which is at most three quarters full. Nothing is removed but by
+// clear(). Lookups may be by any type Hash and Eq take along with K, eg. a
+// std::string_view for std::string keys.
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename Eq = std::equal_to<>>
+class HashMap {
+ public:
+  typedef std::pair<K, V> Entry;
+
+  size_t size() const { return entries.size(); }
+  bool empty() const { return entries.empty(); }
+  typename std::vector<Entry>::iterator begin() { return entries.begin(); }
+  typename std::vector<Entry>::iterator end() { return entries.end(); }
+  typename std::vector<Entry>::const_iterator begin() const {
+    return entries.begin();
+  }
+  typename std::vector<Entry>::const_iterator end() const {
+    return entries.end();
+  }
+
+  void clear() {
+    entries.clear();
+    slots.clear();
+  }
+
+  template <typename Q>
+  V *find(const Q &key) {
+    if (slots.empty())
+      return nullptr;
+    uint32_t hash = hash_of(key);
+    for (size_t i = hash & mask();; i = (i + 1) & mask()) {
+      const Slot &slot = slots[i];
+      if (slot.entry == kEmpty)
+        return nullptr;
+      if (slot.hash == hash && Eq()(entries[slot.entry].first, key))
+        return &entries[slot.entry].second;
+    }
+  }
+
+  // The value for `key`, which is added with `value` unless there is one,
+  // and whether it was.
+  std::pair<V *, bool> emplace(K key, V value) {
+    if (V *found = find(key))
+      return {found, false};
+    if ((entries.size() + 1) * 4 > slots.size() * 3)
+      grow();
+    uint32_t hash = hash_of(key);
+    place(hash, static_cast<uint32_t>(entries.size()));
+    entries.emplace_back(std::move(key), std::move(value));
+    return {&entries.back().second, true};
+  }
+
+  V &operator[](const K &key) { return *emplace(key, V()).first; }
+
+ private:
+  struct Slot {
+    uint32_t entry;
+    uint32_t hash;
+  };
+  static constexpr uint32_t kEmpty = UINT32_MAX;
+
+  std::vector<Entry> entries;
+  std::vector<Slot> slots;  // a power of two of them, or none
+
+  size_t mask() const { return slots.size() - 1; }
+
+  // The high bits of a Fibonacci hash, so that keys hashing to nearby values,
+  // like symbol codes, are spread across the table.
+  template <typename Q>
+  static uint32_t hash_of(const Q &key) {
+    uint64_t h = static_cast<uint64_t>(Hash()(key));
+    return static_cast<uint32_t>((h * 0x9E3779B97F4A7C15ull) >> 32);
+  }
+
+  void place(uint32_t hash, uint32_t entry) {
+    size_t i = hash & mask();
+    while (slots[i].entry != kEmpty)
+      i = (i + 1) & mask();
+    slots[i] = {entry, hash};
+  }
+
+  void grow() {
+    std::vector<Slot> old = std::move(slots);
+    slots.assign(std::max<size_t>(8, 2 * old.size()), Slot{kEmpty, 0});
+    for (const Slot &slot : old) {
+      if (slot.entry != kEmpty)
+        place(slot.hash, slot.entry);
+    }
+  }
+};
+
 struct environment {
-  std::map<size_t, snode> env;
+  HashMap<size_t, snode> env;  // bindings made by name at runtime
+  std::vector<Value, HeapAllocator<Value>> slots;  // the global table, or the
+                                                 // locals of a fn body
+  scode code;                   // if a fn frame, names the slots (Code::locals)
   senvironment outer;
+  bool global = false;  // slots are indexed by symbol code
   environment();
   environment(senvironment outer);
+  // Bound slot or binding for code in this scope only, if any. While threads
+  // run, these are for callers holding the lock on this scope.
+  Value *slot(size_t code);
+  snode *find(size_t code);
   snode get(size_t code);
   snode get(snode &k);
+  snode set(size_t code, const snode &v);
   snode set(snode &k, snode &v);
 };
 
+template <typename... Args>
+senvironment make_env(Args &&...args) {
+  senvironment env = std::allocate_shared<environment>(
+      HeapAllocator<environment>(), std::forward<Args>(args)...);
+  track(env);
+  return env;
+}
+
+// Bytecode
+//
+// After macro expansion, each top-level form is lowered into a flat
+// instruction stream run by a stack-based VM. Special forms whose head names a
+// builtin special at lowering time are compiled to jumps and stores; every
+// other call evaluates its head at runtime, so specials reached through
+// variables still work through OP_PREPARE_CALL. Lowering also folds calls of
+// pure builtins on constants, prunes branches on constant conditions and
+// inlines wrappers of them such as inc; the code so made is guarded by
+// OP_GUARD, since the names it relied on can be rebound before it runs.
+enum Opcode : uint8_t {
+  OP_NIL,            // push nil
+  OP_CONST,          // push consts[a]
+  OP_LOAD_LOCAL,     // push slot b of the frame a levels up
+  OP_LOAD_GLOBAL,    // push global symbol a
+  OP_LOAD,           // push the symbol bound as bindings[a] describes
+  OP_REF_LOCAL,      // like the OP_LOAD* above but box the variable in
+  OP_REF_GLOBAL,     // place first, for arguments of calls which may
+  OP_REF,            // update them
+  OP_DEF_LOCAL,      // bind slot a of this frame to a copy of top
+  OP_DEF,            // bind symbol a in this environment to a copy of top
+  OP_SET,            // (set SYMBOL VALUE) for bindings[a], VALUE on top
+  OP_SET_PLACE,      // (set PLACE VALUE), PLACE then VALUE on the stack
+  OP_POP,            // discard top
+  OP_JUMP,           // continue at a
+  OP_JUMP_IF_FALSE,  // pop, continue at a if it is not true
+  OP_CLOSURE,        // push a T_FN for protos[a] closing over the environment
+  OP_SPECIAL,        // push consts[a]->v_builtin(consts[b]->v_list, env)
+  OP_PREPARE_CALL,   // callee on top; if it is a special or not callable,
+                     // replace it with the result of the raw form consts[a]
+                     // and continue at b
+  OP_GUARD,          // consts[a] is (FORM SYMBOL SEEN ..): unless each SYMBOL
+                     // is still bound globally as its SEEN copy is, push the
+                     // result of the raw FORM and continue at b
+  OP_CALL,           // call the callee below the top a arguments
+  OP_TAIL_CALL,      // OP_CALL in tail position; a fn called reuses the frame
+  // Calls of the arithmetic builtins bound to symbol b, on the top a
+  // arguments. They run inline when b is still bound to its builtin and the
+  // arguments are numbers (bools for OP_NOT); otherwise like OP_CALL.
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_LT,
+  OP_EQ,
+  OP_NOT,
+  OP_RETURN,         // return top to the caller
+};
+
+// Operand types an arithmetic instruction called with two arguments has seen,
+// named by the first, which picks the result type. The VM runs the next call at
+// the site straight on those types while they hold.
+enum ArithHint : uint8_t {
+  HINT_NONE,     // not run inline yet
+  HINT_INT,      // an int and an int
+  HINT_DOUBLE,   // a double and a number
+  HINT_GENERIC,  // anything else, or more than one of the above
+};
+
+struct Instr {
+  Opcode op;
+  mutable uint8_t hint = HINT_NONE;  // if arithmetic, an ArithHint; updated
+                                     // while running, not saved in images
+  uint32_t a;
+  uint32_t b;
+
+  Instr(Opcode op, uint32_t a, uint32_t b) : op(op), a(a), b(b) {}
+};
+
+// Lexical address of a symbol that is not always bound in one place: the
+// frame slots it may be bound in, innermost first, and then the global table.
+// Locals made by def or set are only bound once those have run.
+struct Binding {
+  size_t code;
+  std::vector<std::pair<uint32_t, uint32_t>> slots;  // (depth, slot)
+};
+
+struct Code {
+  std::vector<Instr> ops;
+  std::vector<Value> consts;
+  std::vector<scode> protos;  // nested fn bodies
+  std::vector<Binding> bindings;
+  size_t nparams = 0;
+  // Symbol code of each frame slot if a fn body: the arguments, then every
+  // symbol the body binds with def or set.
+  std::vector<size_t> locals;
+  std::atomic<native_code> native = nullptr;  // if compiled by paren -c or
+                                              // the JIT
+  std::atomic<size_t> calls = 0;  // of a fn body, while the JIT is on
+  // If a fn body, whether nothing in it can keep its frame past the call: it
+  // makes no closures, runs no specials at runtime and does not name eval.
+  // Such frames are recycled on return rather than freed, and collect need
+  // not track them as they can be in no cycle.
+  bool leaf = false;
+};
+
+// Images
+//
+// paren -c lowers a program as it compiles it and stores the Code of each
+// top-level form in the binary it makes, with symbols by name.
+bool save_image(const std::vector<scode> &forms, std::string &image);
+std::vector<scode> load_image(std::string_view image);
+void run_image(std::string_view image, const native_code *natives,
+               size_t count);
+
+// Evaluates the file at `path` like eval_string, or returns false if it cannot
+// be read. What parsing and macro expansion make of it is kept in an image in
+// the cache directory, and used instead as long as the file's path, mtime and
+// contents, and the macros defined before, are the same. The cache directory
+// is $PAREN_CACHE_DIR, or else paren/ in $XDG_CACHE_HOME or ~/.cache.
+bool eval_file(std::string_view path);
+void set_cache_dir(std::string_view dir);  // "" turns the cache off
+
+// JIT
+//
+// A host linking LLVM (paren --jit) can compile fn bodies while the program
+// runs. A body is handed to `compiler` on its `threshold`th call, or as soon as
+// (jit-compile FN) asks for it. What it returns, unless nullptr, is run in
+// place of the bytecode from then on (see Code::native).
+typedef native_code (*jit_compiler)(const Code &code);
+void set_jit(jit_compiler compiler, size_t threshold);
+
+// Profiling
+//
+// profile_start("calls") counts the calls of each fn body, the time spent in
+// them with and without the fns they call, and the heap blocks they allocate
+// themselves. profile_start("sample") only counts calls and, on a timer
+// signal, records which fns are running instead, which costs much less.
+// profile_report writes what was recorded since to `path`, or stderr if "",
+// and stops: a table for "calls", folded stacks (one "OUTER;..;INNER COUNT"
+// line per stack, as flame graph tools read) for "sample". Calls still running
+// on other threads are left out. Fns are named by the global bound to them.
+bool profile_start(std::string_view mode);
+bool profile_report(std::string_view path);
+
+// Interpreters
+//
+// An Interpreter has a global table, macros and collector of its own, so that
+// several can run at once, each on a thread of its own, without seeing each
+// other. Everything else is shared: the heap arenas, symbol codes, interned
+// strings, compiled code, the task pool, and the settings above. The functions
+// outside Interpreter act on the interpreter the calling thread is in (see
+// Interpreter::Scope): a default one, unless it is running an Interpreter.
+// Threads and tasks started by paren code run in the interpreter that started
+// them.
+struct Context;
+
+class Interpreter {
+ public:
+  Interpreter();  // with the builtins bound, as init_builtins leaves it
+  Interpreter(Interpreter &&other);
+  ~Interpreter();  // waits for the threads and tasks its code started
+
+  // Makes the constructing thread run `interpreter` until destroyed.
+  class Scope {
+   public:
+    explicit Scope(Interpreter &interpreter);
+    ~Scope();
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+   private:
+    Context *outer;
+  };
+
+  // A new Interpreter with a copy of what this one has defined and its macros,
+  // eg. one with library.paren loaded, for much less than loading it again.
+  // What globals hold is copied as def copies it, along with the lists and
+  // dicts in it and the frames fns close over, so that what either does to
+  // them leaves the other alone. It only reads this one, which may be forked
+  // by several threads at once as long as none runs it.
+  Interpreter fork();
+
+  void init();  // loads library.paren
+  snode eval_string(std::string_view s);
+  bool eval_file(std::string_view path);
+  snode get(const char *name);
+  void set(const char *name, Node value);
+  size_t collect();
+  HeapStats heap_stats();
+
+ private:
+  explicit Interpreter(std::unique_ptr<Context> context);
+  std::unique_ptr<Context> context_;
+};
+
+void init_builtins();  // init, without loading library.paren
 void init();
 
 snode eval(snode &n, senvironment &env);
@@ -98,13 +649,45 @@ snode eval_all(std::vector<snode> &lst);
 snode compile(snode &n);
 std::vector<snode> compile_all(std::vector<snode> &lst);
 snode apply(snode &func, std::vector<snode> &args, senvironment &env);
+scode lower(snode &n);
+snode run(scode &code, senvironment &env);
 void print_logo();
+void flush_output();  // writes out what pr and prn buffered on this thread
 void prompt();
 void prompt2();
 snode eval_string(std::string &s);
 snode eval_string(const char *s);
 inline void eval_print(std::string &s);
-void repl();  // read-eval-print loop
+void repl();  // read-eval-print loop, a form at a time
+
+// Reads source given a piece at a time, as it comes in, and hands out each
+// top-level form as soon as it is complete. Each piece is lexed once, from
+// where the last one left off.
+class Reader {
+ public:
+  Reader();
+  ~Reader();
+  Reader(const Reader &) = delete;
+  Reader &operator=(const Reader &) = delete;
+
+  void feed(std::string_view piece);
+  // Moves the source of the next complete form into `form`, if any.
+  bool next(std::string &form);
+  // Whether part of a form has been fed (an atom is only complete once
+  // something follows it).
+  bool partial() const;
+  std::string finish();  // what is left of the input, and starts over
+
+ private:
+  struct State;
+  std::unique_ptr<State> state;
+};
+
+// Reads source from the file descriptor `in` until it ends, and evaluates each
+// top-level form as soon as it is complete, on the interpreter of the calling
+// thread. For each, writes what it evaluates to and a newline to `out`, after
+// anything it printed.
+void serve(int in, int out);
 
 snode get(const char *name);
 void set(const char *name, Node value);
@@ -113,9 +696,9 @@ inline double rand_double();
 bool slurp(std::string_view filename, std::string &str);
 int spit(std::string_view filename, std::string_view str);
 size_t ToCode(std::string_view name);
-snode make_snode(const Node &n);
+const std::string &SymbolName(size_t code);
 
-std::vector<std::string> tokenize(const std::string &s);
-std::vector<snode> parse(const std::string &s);
+std::vector<std::string> tokenize(std::string_view s);
+std::vector<snode> parse(std::string_view s);
 }  // namespace libparen
 #endif
@@ -1,16 +1,30 @@
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cstdio>
+#include <charconv>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <span>
 #include <string>
+#include <thread>
 
 #include "argparse.h"
 #include "libparen.h"
 #include "llvm-c/Analysis.h"
 #include "llvm-c/Core.h"
+#include "llvm-c/LLJIT.h"
+#include "llvm-c/Orc.h"
 #include "llvm-c/Target.h"
 #include "llvm-c/TargetMachine.h"
 #include "llvm-c/Transforms/PassBuilder.h"
@@ -23,6 +37,16 @@ void HandleLLVMError(char *error) {
   LLVMDisposeMessage(error);
 }
 
+// Prints and consumes `error`, if any. Returns whether there was one.
+bool HandleLLVMErrorRef(LLVMErrorRef error) {
+  if (!error)
+    return false;
+  char *message = LLVMGetErrorMessage(error);
+  std::cerr << "LLVM error: " << message << std::endl;
+  LLVMDisposeErrorMessage(message);
+  return true;
+}
+
 // We want to use the LLVM C API to make it easier to port to the language
 // (since we won't have C++ mangling), but RAII is useful for doing cleanup from
 // the C API. This is a wrapper for just that.
@@ -50,8 +74,9 @@ LLVMValueRef GetParenInitFunc(LLVMModuleRef mod) {
     return func;
 
   LLVMTypeRef param_types[] = {};
-  LLVMTypeRef func_type = LLVMFunctionType(LLVMVoidType(), param_types,
-                                           /*ParamCount=*/0, /*IsVarArg=*/0);
+  LLVMTypeRef func_type =
+      LLVMFunctionType(LLVMVoidTypeInContext(LLVMGetModuleContext(mod)),
+                       param_types, /*ParamCount=*/0, /*IsVarArg=*/0);
   LLVMValueRef paren_init_func =
       LLVMAddFunction(mod, kParenInitName.data(), func_type);
   return paren_init_func;
@@ -61,17 +86,17 @@ LLVMTypeRef GetOpaquePtr(LLVMModuleRef mod, unsigned address_space = 0) {
   return LLVMPointerTypeInContext(LLVMGetModuleContext(mod), address_space);
 }
 
-LLVMValueRef GetParenEvalStringFunc(LLVMModuleRef mod) {
-  if (LLVMValueRef func =
-          LLVMGetNamedFunction(mod, kParenEvalStringName.data()))
+LLVMValueRef GetParenRunImageFunc(LLVMModuleRef mod) {
+  if (LLVMValueRef func = LLVMGetNamedFunction(mod, kParenRunImageName.data()))
     return func;
 
-  LLVMTypeRef param_types[] = {GetOpaquePtr(mod)};
-  LLVMTypeRef func_type = LLVMFunctionType(LLVMVoidType(), param_types,
-                                           /*ParamCount=*/1, /*IsVarArg=*/0);
-  LLVMValueRef paren_eval_string_func =
-      LLVMAddFunction(mod, kParenEvalStringName.data(), func_type);
-  return paren_eval_string_func;
+  LLVMContextRef ctx = LLVMGetModuleContext(mod);
+  LLVMTypeRef param_types[] = {GetOpaquePtr(mod), LLVMInt64TypeInContext(ctx),
+                               GetOpaquePtr(mod), LLVMInt64TypeInContext(ctx)};
+  LLVMTypeRef func_type =
+      LLVMFunctionType(LLVMVoidTypeInContext(ctx), param_types,
+                       /*ParamCount=*/4, /*IsVarArg=*/0);
+  return LLVMAddFunction(mod, kParenRunImageName.data(), func_type);
 }
 
 LLVMValueRef GetParenImportFunc(LLVMModuleRef mod) {
@@ -79,21 +104,834 @@ LLVMValueRef GetParenImportFunc(LLVMModuleRef mod) {
     return func;
 
   LLVMTypeRef param_types[] = {GetOpaquePtr(mod)};
-  LLVMTypeRef func_type = LLVMFunctionType(LLVMVoidType(), param_types,
-                                           /*ParamCount=*/1, /*IsVarArg=*/0);
+  LLVMTypeRef func_type =
+      LLVMFunctionType(LLVMVoidTypeInContext(LLVMGetModuleContext(mod)),
+                       param_types, /*ParamCount=*/1, /*IsVarArg=*/0);
   return LLVMAddFunction(mod, kParenImportName.data(), func_type);
 }
 
-LLVMValueRef CreateMain(LLVMModuleRef mod, std::string_view contents,
+// Where a libparen::Value keeps its tag and its payload, for compiled code
+// reading and writing frame slots in place.
+struct ValueLayout {
+  unsigned long long size;
+  unsigned long long tag;
+  unsigned long long payload;
+};
+
+ValueLayout GetValueLayout() {
+  static const libparen::Value probe;
+  auto offset = [](const void *member) {
+    return static_cast<unsigned long long>(
+        static_cast<const char *>(member) -
+        reinterpret_cast<const char *>(&probe));
+  };
+  return {sizeof(libparen::Value), offset(&probe.tag),
+          offset(&probe.v_double)};
+}
+
+// Emits an internal function for each Code, which stands for it. Jumps become
+// branches. What the instructions push is kept in LLVM values while it is an
+// int, a double, a bool or nil, and arithmetic on those is done inline while
+// its symbol is bound to the builtin, on the types the hints of the JIT name if
+// any. The locals of a leaf fn body are read and written in its frame in place.
+// Everything else is left to the runtime (see paren_rt_exec in libparen.h),
+// which is handed what the instruction needs of the stack first.
+class NativeEmitter {
+ public:
+  explicit NativeEmitter(LLVMModuleRef mod)
+      : mod(mod),
+        ctx(LLVMGetModuleContext(mod)),
+        builder(LLVMCreateBuilderInContext(ctx), LLVMDisposeBuilder),
+        layout(GetValueLayout()),
+        ptr_type(GetOpaquePtr(mod)),
+        void_type(LLVMVoidTypeInContext(ctx)),
+        int8_type(LLVMInt8TypeInContext(ctx)),
+        int32_type(LLVMInt32TypeInContext(ctx)),
+        int64_type(LLVMInt64TypeInContext(ctx)),
+        double_type(LLVMDoubleTypeInContext(ctx)) {
+    LLVMTypeRef params[] = {ptr_type};
+    native_type = LLVMFunctionType(void_type, params, /*ParamCount=*/1,
+                                   /*IsVarArg=*/0);
+  }
+
+  // Emits `forms` and their fn bodies in the preorder paren_run_image expects.
+  void EmitAll(const std::vector<libparen::scode> &forms) {
+    for (const libparen::scode &code : forms) {
+      std::string name = "paren_code_" + std::to_string(natives.size());
+      LLVMValueRef func = Emit(*code, name);
+      LLVMSetLinkage(func, LLVMInternalLinkage);
+      natives.push_back(func);
+      EmitAll(code->protos);
+    }
+  }
+
+  const std::vector<LLVMValueRef> &Natives() const { return natives; }
+
+  // Emits the function for `code` alone. Its fn bodies are left to be
+  // compiled separately.
+  LLVMValueRef Emit(const libparen::Code &code, const std::string &name) {
+    using namespace libparen;
+    func = LLVMAddFunction(mod, name.c_str(), native_type);
+    vm = LLVMGetParam(func, 0);
+    consts = &code.consts;
+    bindings = &code.bindings;
+
+    LLVMBasicBlockRef entry = AppendBlock("entry");
+    LLVMPositionBuilderAtEnd(*builder, entry);
+    const std::vector<Instr> &ops = code.ops;
+    std::vector<int> depths = StackDepths(ops);
+    int max_depth = 0;
+    for (uint32_t pc = 0; pc < ops.size(); pc++) {
+      if (depths[pc] >= 0)
+        max_depth = std::max({max_depth, depths[pc],
+                              depths[pc] + StackEffect(ops[pc])});
+    }
+    tags.clear();
+    bits.clear();
+    for (int i = 0; i < max_depth; i++) {
+      tags.push_back(LLVMBuildAlloca(*builder, int8_type, "tag"));
+      bits.push_back(LLVMBuildAlloca(*builder, int64_type, "bits"));
+      SetSpilled(i);
+    }
+    intact.clear();
+    for (const Instr &in : ops) {
+      if (in.op >= OP_ADD && in.op <= OP_NOT &&
+          !intact.count({in.op, in.b})) {
+        LLVMValueRef flag = LLVMBuildAlloca(*builder, int8_type, "intact");
+        LLVMBuildStore(*builder, LLVMConstInt(int8_type, 0, 0), flag);
+        intact[{in.op, in.b}] = flag;
+      }
+    }
+    slots =
+        code.leaf ? CallRuntime(kParenRtSlotsName, ptr_type, {vm}) : nullptr;
+
+    // A block starts at each jump target and after each jump.
+    std::vector<LLVMBasicBlockRef> blocks(ops.size(), nullptr);
+    auto block_at = [&](uint32_t pc) {
+      if (pc < ops.size() && !blocks[pc])
+        blocks[pc] = AppendBlock("");
+    };
+    for (uint32_t pc = 0; pc < ops.size(); pc++) {
+      switch (ops[pc].op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+          block_at(ops[pc].a);
+          block_at(pc + 1);
+          break;
+        case OP_PREPARE_CALL:
+        case OP_GUARD:
+          block_at(ops[pc].b);
+          block_at(pc + 1);
+          break;
+        case OP_RETURN:
+        case OP_TAIL_CALL:
+          block_at(pc + 1);
+          break;
+        default:
+          break;
+      }
+    }
+
+    bool terminated = false;
+    for (uint32_t pc = 0; pc < ops.size(); pc++) {
+      if (blocks[pc]) {
+        if (!terminated)
+          LLVMBuildBr(*builder, blocks[pc]);
+        LLVMPositionBuilderAtEnd(*builder, blocks[pc]);
+        terminated = false;
+        if (depths[pc] < 0) {  // reached by no path
+          LLVMBuildUnreachable(*builder);
+          terminated = true;
+        }
+      }
+      if (depths[pc] < 0)
+        continue;
+
+      const Instr &in = ops[pc];
+      int depth = depths[pc];
+      switch (in.op) {
+        case OP_CONST:
+          if (!Constant((*consts)[in.a], depth))
+            CallOut(kParenRtExecName, void_type, in, pc, depth);
+          break;
+        case OP_LOAD_LOCAL:
+          if (slots && in.a == 0)
+            Load(in.b, in, pc, depth);
+          else
+            CallOut(kParenRtExecName, void_type, in, pc, depth);
+          break;
+        case OP_LOAD:
+          if (uint32_t slot; LocalSlot(in, slot))
+            Load(slot, in, pc, depth);
+          else
+            CallOut(kParenRtExecName, void_type, in, pc, depth);
+          break;
+        case OP_DEF_LOCAL:
+          if (slots)
+            Store(in.a, /*defining=*/true, in, pc, depth);
+          else
+            CallOut(kParenRtExecName, void_type, in, pc, depth);
+          break;
+        case OP_SET:
+          if (uint32_t slot; LocalSlot(in, slot))
+            Store(slot, /*defining=*/false, in, pc, depth);
+          else
+            CallOut(kParenRtExecName, void_type, in, pc, depth);
+          break;
+        case OP_POP: {
+          // Nothing to do unless the runtime has it.
+          LLVMBasicBlockRef pop = AppendBlock("");
+          LLVMBasicBlockRef done = AppendBlock("");
+          LLVMBuildCondBr(*builder, IsSpilled(depth - 1), pop, done);
+          LLVMPositionBuilderAtEnd(*builder, pop);
+          CallRuntime(kParenRtExecName, void_type, {vm, Pc(pc)});
+          LLVMBuildBr(*builder, done);
+          LLVMPositionBuilderAtEnd(*builder, done);
+          break;
+        }
+        case OP_JUMP:
+          LLVMBuildBr(*builder, blocks[in.a]);
+          terminated = true;
+          break;
+        case OP_JUMP_IF_FALSE: {
+          // Conditions read v_bool whatever the type, so the payload's first
+          // byte unless the runtime has the value.
+          LLVMBasicBlockRef from = LLVMGetInsertBlock(*builder);
+          LLVMBasicBlockRef pop = AppendBlock("");
+          LLVMBasicBlockRef branch = AppendBlock("");
+          LLVMValueRef held = Truncate(Bits(depth - 1), int8_type);
+          LLVMBuildCondBr(*builder, IsSpilled(depth - 1), pop, branch);
+          LLVMPositionBuilderAtEnd(*builder, pop);
+          LLVMValueRef popped =
+              Truncate(CallRuntime(kParenRtPopTruthyName, int32_type, {vm}),
+                       int8_type);
+          LLVMBuildBr(*builder, branch);
+          LLVMPositionBuilderAtEnd(*builder, branch);
+          LLVMValueRef cond = LLVMBuildPhi(*builder, int8_type, "");
+          LLVMValueRef values[] = {held, popped};
+          LLVMBasicBlockRef from_blocks[] = {from, pop};
+          LLVMAddIncoming(cond, values, from_blocks, 2);
+          LLVMValueRef truthy = LLVMBuildICmp(
+              *builder, LLVMIntNE, cond, LLVMConstInt(int8_type, 0, 0), "");
+          LLVMBuildCondBr(*builder, truthy, blocks[pc + 1], blocks[in.a]);
+          terminated = true;
+          break;
+        }
+        case OP_PREPARE_CALL: {
+          LLVMValueRef skipped = IsNonzero(
+              CallOut(kParenRtPrepareCallName, int32_type, in, pc, depth));
+          LLVMBuildCondBr(*builder, skipped, blocks[in.b], blocks[pc + 1]);
+          terminated = true;
+          break;
+        }
+        case OP_GUARD: {
+          // Falling back pushes the form's result.
+          LLVMValueRef fell_back =
+              IsNonzero(CallOut(kParenRtGuardName, int32_type, in, pc, depth));
+          LLVMBasicBlockRef pushed = AppendBlock("");
+          LLVMBuildCondBr(*builder, fell_back, pushed, blocks[pc + 1]);
+          LLVMPositionBuilderAtEnd(*builder, pushed);
+          SetSpilled(depth);
+          LLVMBuildBr(*builder, blocks[in.b]);
+          terminated = true;
+          break;
+        }
+        case OP_RETURN:
+          Flush(depth);
+          LLVMBuildRetVoid(*builder);
+          terminated = true;
+          break;
+        case OP_TAIL_CALL: {
+          // The callee may take over the frame; then it is run once this
+          // returns.
+          LLVMValueRef handed_over = IsNonzero(
+              CallOut(kParenRtTailCallName, int32_type, in, pc, depth));
+          LLVMBasicBlockRef leave = AppendBlock("");
+          LLVMBuildCondBr(*builder, handed_over, leave, blocks[pc + 1]);
+          LLVMPositionBuilderAtEnd(*builder, leave);
+          LLVMBuildRetVoid(*builder);
+          terminated = true;
+          break;
+        }
+        case OP_CALL:
+          CallOut(kParenRtCallName, void_type, in, pc, depth);
+          break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_LT:
+        case OP_EQ:
+        case OP_NOT:
+          if (in.a == (in.op == OP_NOT ? 1 : 2))
+            EmitArith(in, pc, depth);
+          else
+            CallOut(kParenRtCallName, void_type, in, pc, depth);
+          break;
+        default:
+          CallOut(kParenRtExecName, void_type, in, pc, depth);
+          break;
+      }
+    }
+    return func;
+  }
+
+ private:
+  // The tag of a position of the stack whose value the runtime has, as it has
+  // every boxed one. Such positions are always the bottom ones.
+  static constexpr libparen::Value::Tag kSpilled = libparen::Value::BOXED;
+
+  // How many values `in` leaves on the stack less those it takes, when it goes
+  // on to the next instruction.
+  static int StackEffect(const libparen::Instr &in) {
+    using namespace libparen;
+    switch (in.op) {
+      case OP_NIL:
+      case OP_CONST:
+      case OP_LOAD_LOCAL:
+      case OP_LOAD_GLOBAL:
+      case OP_LOAD:
+      case OP_REF_LOCAL:
+      case OP_REF_GLOBAL:
+      case OP_REF:
+      case OP_CLOSURE:
+      case OP_SPECIAL:
+        return 1;
+      case OP_SET_PLACE:
+      case OP_POP:
+      case OP_JUMP_IF_FALSE:
+      case OP_RETURN:
+        return -1;
+      case OP_CALL:
+      case OP_TAIL_CALL:
+        return -static_cast<int>(in.a);
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_MOD:
+      case OP_LT:
+      case OP_EQ:
+      case OP_NOT:
+        return 1 - static_cast<int>(in.a);
+      default:
+        return 0;
+    }
+  }
+
+  // How many values the frame has on the stack as each instruction starts, or
+  // -1 if none is reached.
+  static std::vector<int> StackDepths(const std::vector<libparen::Instr> &ops) {
+    using namespace libparen;
+    std::vector<int> depths(ops.size(), -1);
+    std::vector<uint32_t> work;
+    auto reach = [&](uint32_t pc, int depth) {
+      if (pc < ops.size() && depths[pc] < 0) {
+        depths[pc] = depth;
+        work.push_back(pc);
+      }
+    };
+    reach(0, 0);
+    while (!work.empty()) {
+      uint32_t pc = work.back();
+      work.pop_back();
+      const Instr &in = ops[pc];
+      int depth = depths[pc];
+      switch (in.op) {
+        case OP_JUMP:
+          reach(in.a, depth);
+          break;
+        case OP_JUMP_IF_FALSE:
+          reach(in.a, depth - 1);
+          reach(pc + 1, depth - 1);
+          break;
+        case OP_PREPARE_CALL:
+          reach(in.b, depth);
+          reach(pc + 1, depth);
+          break;
+        case OP_GUARD:
+          reach(in.b, depth + 1);
+          reach(pc + 1, depth);
+          break;
+        case OP_RETURN:
+          break;
+        default:
+          reach(pc + 1, depth + StackEffect(in));
+          break;
+      }
+    }
+    return depths;
+  }
+
+  // Whether the runtime running `in` cannot rebind anything, or run code that
+  // could.
+  static bool Pure(const libparen::Instr &in) {
+    using namespace libparen;
+    switch (in.op) {
+      case OP_NIL:
+      case OP_CONST:
+      case OP_LOAD_LOCAL:
+      case OP_LOAD_GLOBAL:
+      case OP_LOAD:
+      case OP_REF_LOCAL:
+      case OP_REF_GLOBAL:
+      case OP_REF:
+      case OP_POP:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  // Leaves `in`, at `pc` with `depth` values on the stack, to the runtime
+  // function `name`, once the runtime has all of those. Whatever it pushes is
+  // then the runtime's too.
+  LLVMValueRef CallOut(std::string_view name, LLVMTypeRef ret,
+                       const libparen::Instr &in, uint32_t pc, int depth) {
+    Flush(depth);
+    LLVMValueRef result = CallRuntime(name, ret, {vm, Pc(pc)});
+    if (int after = depth + StackEffect(in); after > depth)
+      SetSpilled(after - 1);
+    if (!Pure(in))
+      ForgetIntact();
+    return result;
+  }
+
+  // Hands the runtime what it does not have of the bottom `depth` values.
+  void Flush(int depth) {
+    for (int i = 0; i < depth; i++) {
+      LLVMBasicBlockRef push = AppendBlock("");
+      LLVMBasicBlockRef done = AppendBlock("");
+      LLVMValueRef tag = Tag(i);
+      LLVMBuildCondBr(*builder, IsSpilled(i), done, push);
+      LLVMPositionBuilderAtEnd(*builder, push);
+      CallRuntime(kParenRtPushName, void_type,
+                  {vm, LLVMBuildZExt(*builder, tag, int32_type, ""), Bits(i)});
+      SetSpilled(i);
+      LLVMBuildBr(*builder, done);
+      LLVMPositionBuilderAtEnd(*builder, done);
+    }
+  }
+
+  // Keeps `c` at position `depth` if it is unboxed. Returns false otherwise.
+  bool Constant(const libparen::Value &c, int depth) {
+    using libparen::Value;
+    uint64_t payload = 0;
+    switch (c.tag) {
+      case Value::INT:
+        payload = static_cast<uint64_t>(static_cast<int64_t>(c.v_int));
+        break;
+      case Value::DOUBLE:
+        memcpy(&payload, &c.v_double, sizeof payload);
+        break;
+      case Value::BOOL:
+        payload = c.v_bool;
+        break;
+      default:
+        return false;
+    }
+    Set(depth, TagOf(c.tag), LLVMConstInt(int64_type, payload, 0));
+    return true;
+  }
+
+  // Whether what OP_LOAD or OP_SET `in` looks up is first looked for in a slot
+  // of this frame, which is then `slot`.
+  bool LocalSlot(const libparen::Instr &in, uint32_t &slot) {
+    if (!slots)
+      return false;
+    const libparen::Binding &b = (*bindings)[in.a];
+    if (b.slots.empty() || b.slots[0].first != 0)
+      return false;
+    slot = b.slots[0].second;
+    return true;
+  }
+
+  // Pushes the value in `slot` if it is bound and unboxed, and leaves `in` to
+  // the runtime otherwise.
+  void Load(uint32_t slot, const libparen::Instr &in, uint32_t pc, int depth) {
+    LLVMValueRef tag = SlotTag(slot);
+    LLVMBasicBlockRef load = AppendBlock("");
+    LLVMBasicBlockRef slow = AppendBlock("");
+    LLVMBasicBlockRef done = AppendBlock("");
+    LLVMBuildCondBr(*builder, IsUnboxed(tag), load, slow);
+    LLVMPositionBuilderAtEnd(*builder, load);
+    Set(depth, tag,
+        LLVMBuildLoad2(*builder, int64_type, SlotPayload(slot), ""));
+    LLVMBuildBr(*builder, done);
+    LLVMPositionBuilderAtEnd(*builder, slow);
+    CallOut(kParenRtExecName, void_type, in, pc, depth);
+    LLVMBuildBr(*builder, done);
+    LLVMPositionBuilderAtEnd(*builder, done);
+  }
+
+  // Stores the top value in `slot` if that is unboxed, as are what the slot
+  // holds and, unless `defining`, that it is bound. Leaves `in` to the runtime
+  // otherwise.
+  void Store(uint32_t slot, bool defining, const libparen::Instr &in,
+             uint32_t pc, int depth) {
+    using libparen::Value;
+    LLVMValueRef held = SlotTag(slot);
+    LLVMValueRef fits = defining ? LLVMBuildICmp(*builder, LLVMIntNE, held,
+                                                 TagOf(Value::BOXED), "")
+                                 : IsUnboxed(held);
+    LLVMValueRef fast =
+        LLVMBuildAnd(*builder, fits, IsUnspilled(depth - 1), "");
+    LLVMBasicBlockRef store = AppendBlock("");
+    LLVMBasicBlockRef slow = AppendBlock("");
+    LLVMBasicBlockRef done = AppendBlock("");
+    LLVMBuildCondBr(*builder, fast, store, slow);
+    LLVMPositionBuilderAtEnd(*builder, store);
+    LLVMBuildStore(*builder, Tag(depth - 1), SlotAt(slot, layout.tag));
+    LLVMBuildStore(*builder, Bits(depth - 1), SlotPayload(slot));
+    LLVMBuildBr(*builder, done);
+    LLVMPositionBuilderAtEnd(*builder, slow);
+    CallOut(kParenRtExecName, void_type, in, pc, depth);
+    LLVMBuildBr(*builder, done);
+    LLVMPositionBuilderAtEnd(*builder, done);
+  }
+
+  // Does the arithmetic `in`, at `pc` with `depth` values on the stack, inline
+  // on ints and doubles the runtime does not have, or on a bool for OP_NOT,
+  // with the builtin's rule that the first argument picks the result type. A
+  // hint leaves out the types it rules out. The runtime does it otherwise.
+  void EmitArith(const libparen::Instr &in, uint32_t pc, int depth) {
+    using namespace libparen;
+    Opcode op = in.op;
+    int x = depth - static_cast<int>(in.a);
+    uint8_t hint =
+        std::atomic_ref<uint8_t>(in.hint).load(std::memory_order_relaxed);
+    LLVMValueRef tx = Tag(x);
+    LLVMValueRef bx = Bits(x);
+    LLVMValueRef int_case = nullptr;
+    LLVMValueRef double_case = nullptr;
+    LLVMValueRef ty = nullptr;
+    LLVMValueRef by = nullptr;
+    if (op == OP_NOT) {
+      int_case = IsTag(tx, Value::BOOL);
+    } else {
+      ty = Tag(x + 1);
+      by = Bits(x + 1);
+      if (hint != HINT_DOUBLE) {
+        int_case = LLVMBuildAnd(*builder, IsTag(tx, Value::INT),
+                                IsTag(ty, Value::INT), "");
+        if (op == OP_DIV || op == OP_MOD) {
+          // Neither a division by zero nor INT_MIN / -1.
+          LLVMValueRef y = Truncate(by, int32_type);
+          LLVMValueRef divisible = LLVMBuildAnd(
+              *builder,
+              LLVMBuildICmp(*builder, LLVMIntNE, y, Int32(0), ""),
+              LLVMBuildICmp(*builder, LLVMIntNE, y, Int32(-1), ""), "");
+          int_case = LLVMBuildAnd(*builder, int_case, divisible, "");
+        }
+      }
+      if (hint != HINT_INT && op != OP_MOD) {
+        LLVMValueRef number = LLVMBuildOr(*builder, IsTag(ty, Value::INT),
+                                          IsTag(ty, Value::DOUBLE), "");
+        double_case = LLVMBuildAnd(*builder, IsTag(tx, Value::DOUBLE),
+                                   number, "");
+      }
+    }
+
+    if (!int_case && !double_case) {
+      CallOut(kParenRtCallName, void_type, in, pc, depth);
+      return;
+    }
+    LLVMBasicBlockRef check = AppendBlock("");
+    LLVMBasicBlockRef slow = AppendBlock("slow");
+    LLVMBasicBlockRef done = AppendBlock("");
+    LLVMValueRef any = int_case && double_case
+                           ? LLVMBuildOr(*builder, int_case, double_case, "")
+                           : int_case ? int_case : double_case;
+    LLVMBuildCondBr(*builder, any, check, slow);
+    LLVMPositionBuilderAtEnd(*builder, check);
+    LLVMBasicBlockRef ints = int_case ? AppendBlock("int") : nullptr;
+    LLVMBasicBlockRef doubles = double_case ? AppendBlock("double") : nullptr;
+    LLVMBasicBlockRef fast = AppendBlock("");
+    LLVMBuildCondBr(*builder, Intact(in, pc), fast, slow);
+    LLVMPositionBuilderAtEnd(*builder, fast);
+    if (ints && doubles)
+      LLVMBuildCondBr(*builder, int_case, ints, doubles);
+    else
+      LLVMBuildBr(*builder, ints ? ints : doubles);
+
+    if (ints) {
+      LLVMPositionBuilderAtEnd(*builder, ints);
+      if (op == OP_NOT) {
+        LLVMValueRef b = LLVMBuildICmp(*builder, LLVMIntEQ,
+                                       Truncate(bx, int8_type),
+                                       LLVMConstInt(int8_type, 0, 0), "");
+        SetBool(x, b);
+      } else {
+        LLVMValueRef i = Truncate(bx, int32_type);
+        LLVMValueRef j = Truncate(by, int32_type);
+        switch (op) {
+          case OP_ADD:
+            SetInt(x, LLVMBuildAdd(*builder, i, j, ""));
+            break;
+          case OP_SUB:
+            SetInt(x, LLVMBuildSub(*builder, i, j, ""));
+            break;
+          case OP_MUL:
+            SetInt(x, LLVMBuildMul(*builder, i, j, ""));
+            break;
+          case OP_DIV:
+            SetInt(x, LLVMBuildSDiv(*builder, i, j, ""));
+            break;
+          case OP_MOD:
+            SetInt(x, LLVMBuildSRem(*builder, i, j, ""));
+            break;
+          case OP_LT:
+            SetBool(x, LLVMBuildICmp(*builder, LLVMIntSLT, i, j, ""));
+            break;
+          default:
+            SetBool(x, LLVMBuildICmp(*builder, LLVMIntEQ, i, j, ""));
+            break;
+        }
+      }
+      LLVMBuildBr(*builder, done);
+    }
+
+    if (doubles) {
+      LLVMPositionBuilderAtEnd(*builder, doubles);
+      LLVMValueRef d = LLVMBuildBitCast(*builder, bx, double_type, "");
+      LLVMValueRef e = LLVMBuildSelect(
+          *builder, IsTag(ty, Value::INT),
+          LLVMBuildSIToFP(*builder, Truncate(by, int32_type), double_type, ""),
+          LLVMBuildBitCast(*builder, by, double_type, ""), "");
+      switch (op) {
+        case OP_ADD:
+          SetDouble(x, LLVMBuildFAdd(*builder, d, e, ""));
+          break;
+        case OP_SUB:
+          SetDouble(x, LLVMBuildFSub(*builder, d, e, ""));
+          break;
+        case OP_MUL:
+          SetDouble(x, LLVMBuildFMul(*builder, d, e, ""));
+          break;
+        case OP_DIV:
+          SetDouble(x, LLVMBuildFDiv(*builder, d, e, ""));
+          break;
+        case OP_LT:
+          SetBool(x, LLVMBuildFCmp(*builder, LLVMRealOLT, d, e, ""));
+          break;
+        default:
+          SetBool(x, LLVMBuildFCmp(*builder, LLVMRealOEQ, d, e, ""));
+          break;
+      }
+      LLVMBuildBr(*builder, done);
+    }
+
+    LLVMPositionBuilderAtEnd(*builder, slow);
+    CallOut(kParenRtCallName, void_type, in, pc, depth);
+    LLVMBuildBr(*builder, done);
+    LLVMPositionBuilderAtEnd(*builder, done);
+  }
+
+  // Whether the symbol of `in` is bound to its builtin. That is asked of the
+  // runtime once, and again only after it may have run code.
+  LLVMValueRef Intact(const libparen::Instr &in, uint32_t pc) {
+    LLVMValueRef flag = intact[{in.op, in.b}];
+    LLVMBasicBlockRef ask = AppendBlock("");
+    LLVMBasicBlockRef done = AppendBlock("");
+    LLVMValueRef known = LLVMBuildLoad2(*builder, int8_type, flag, "");
+    LLVMBuildCondBr(*builder, IsNonzero(known), done, ask);
+    LLVMPositionBuilderAtEnd(*builder, ask);
+    LLVMValueRef answer =
+        CallRuntime(kParenRtIntactName, int32_type, {vm, Pc(pc)});
+    LLVMBuildStore(*builder, Truncate(answer, int8_type), flag);
+    LLVMBuildBr(*builder, done);
+    LLVMPositionBuilderAtEnd(*builder, done);
+    return IsNonzero(LLVMBuildLoad2(*builder, int8_type, flag, ""));
+  }
+
+  void ForgetIntact() {
+    for (auto &[symbol, flag] : intact)
+      LLVMBuildStore(*builder, LLVMConstInt(int8_type, 0, 0), flag);
+  }
+
+  LLVMValueRef Tag(int i) {
+    return LLVMBuildLoad2(*builder, int8_type, tags[static_cast<size_t>(i)],
+                          "");
+  }
+
+  LLVMValueRef Bits(int i) {
+    return LLVMBuildLoad2(*builder, int64_type, bits[static_cast<size_t>(i)],
+                          "");
+  }
+
+  void Set(int i, LLVMValueRef tag, LLVMValueRef payload) {
+    LLVMBuildStore(*builder, tag, tags[static_cast<size_t>(i)]);
+    LLVMBuildStore(*builder, payload, bits[static_cast<size_t>(i)]);
+  }
+
+  void SetInt(int i, LLVMValueRef x) {
+    Set(i, TagOf(libparen::Value::INT),
+        LLVMBuildSExt(*builder, x, int64_type, ""));
+  }
+
+  void SetDouble(int i, LLVMValueRef x) {
+    Set(i, TagOf(libparen::Value::DOUBLE),
+        LLVMBuildBitCast(*builder, x, int64_type, ""));
+  }
+
+  void SetBool(int i, LLVMValueRef cond) {
+    Set(i, TagOf(libparen::Value::BOOL),
+        LLVMBuildZExt(*builder, cond, int64_type, ""));
+  }
+
+  void SetSpilled(int i) {
+    LLVMBuildStore(*builder, TagOf(kSpilled), tags[static_cast<size_t>(i)]);
+  }
+
+  LLVMValueRef IsSpilled(int i) { return IsTag(Tag(i), kSpilled); }
+
+  LLVMValueRef IsUnspilled(int i) {
+    return LLVMBuildICmp(*builder, LLVMIntNE, Tag(i), TagOf(kSpilled), "");
+  }
+
+  LLVMValueRef TagOf(libparen::Value::Tag tag) {
+    return LLVMConstInt(int8_type, tag, /*SignExtend=*/0);
+  }
+
+  LLVMValueRef IsTag(LLVMValueRef tag, libparen::Value::Tag is) {
+    return LLVMBuildICmp(*builder, LLVMIntEQ, tag, TagOf(is), "");
+  }
+
+  // Bound and not boxed: nil, an int, a double or a bool.
+  LLVMValueRef IsUnboxed(LLVMValueRef tag) {
+    using libparen::Value;
+    LLVMValueRef index = LLVMBuildSub(*builder, tag, TagOf(Value::NIL), "");
+    LLVMValueRef count =
+        LLVMConstInt(int8_type, Value::BOOL - Value::NIL + 1, 0);
+    return LLVMBuildICmp(*builder, LLVMIntULT, index, count, "");
+  }
+
+  LLVMValueRef SlotAt(uint32_t slot, unsigned long long offset) {
+    LLVMValueRef index =
+        LLVMConstInt(int64_type, slot * layout.size + offset, 0);
+    return LLVMBuildGEP2(*builder, int8_type, slots, &index, 1, "");
+  }
+
+  LLVMValueRef SlotTag(uint32_t slot) {
+    return LLVMBuildLoad2(*builder, int8_type, SlotAt(slot, layout.tag), "");
+  }
+
+  LLVMValueRef SlotPayload(uint32_t slot) {
+    return SlotAt(slot, layout.payload);
+  }
+
+  LLVMValueRef Truncate(LLVMValueRef x, LLVMTypeRef type) {
+    return LLVMBuildTrunc(*builder, x, type, "");
+  }
+
+  LLVMValueRef IsNonzero(LLVMValueRef x) {
+    return LLVMBuildICmp(*builder, LLVMIntNE, x,
+                         LLVMConstInt(LLVMTypeOf(x), 0, 0), "");
+  }
+
+  LLVMValueRef Int32(int x) {
+    return LLVMConstInt(int32_type, static_cast<unsigned long long>(x),
+                        /*SignExtend=*/1);
+  }
+
+  LLVMBasicBlockRef AppendBlock(const char *name) {
+    return LLVMAppendBasicBlockInContext(ctx, func, name);
+  }
+
+  LLVMValueRef Pc(uint32_t pc) {
+    return LLVMConstInt(int32_type, pc, /*SignExtend=*/0);
+  }
+
+  // Calls the runtime function `name`, declaring it with the types of `args`
+  // if this is the first call.
+  LLVMValueRef CallRuntime(std::string_view name, LLVMTypeRef ret,
+                           std::vector<LLVMValueRef> args) {
+    LLVMValueRef callee = LLVMGetNamedFunction(mod, name.data());
+    if (!callee) {
+      std::vector<LLVMTypeRef> params;
+      for (LLVMValueRef arg : args)
+        params.push_back(LLVMTypeOf(arg));
+      LLVMTypeRef func_type = LLVMFunctionType(
+          ret, params.data(), static_cast<unsigned>(params.size()),
+          /*IsVarArg=*/0);
+      callee = LLVMAddFunction(mod, name.data(), func_type);
+    }
+    return LLVMBuildCall2(*builder, LLVMGlobalGetValueType(callee), callee,
+                          args.data(), static_cast<unsigned>(args.size()),
+                          /*Name=*/"");
+  }
+
+  LLVMModuleRef mod;
+  LLVMContextRef ctx;
+  GenericRAII<LLVMBuilderRef> builder;
+  ValueLayout layout;
+  LLVMTypeRef ptr_type;
+  LLVMTypeRef void_type;
+  LLVMTypeRef int8_type;
+  LLVMTypeRef int32_type;
+  LLVMTypeRef int64_type;
+  LLVMTypeRef double_type;
+  LLVMTypeRef native_type;
+  std::vector<LLVMValueRef> natives;
+  // For the function being emitted.
+  LLVMValueRef func;
+  LLVMValueRef vm;
+  const std::vector<libparen::Value> *consts;
+  const std::vector<libparen::Binding> *bindings;
+  LLVMValueRef slots;  // of the frame, if a leaf fn body's
+  // A tag and a payload for each position of the stack.
+  std::vector<LLVMValueRef> tags;
+  std::vector<LLVMValueRef> bits;
+  // For each symbol of arithmetic, nonzero while known to be intact.
+  std::map<std::pair<libparen::Opcode, uint32_t>, LLVMValueRef> intact;
+};
+
+// Defines in the current interpreter the macros of the library and the
+// imports, which is all the binary will have loaded before running the
+// program.
+bool LoadMacros(std::span<const std::string> imports) {
+  std::vector<std::string> libraries(imports.begin(), imports.end());
+  if (std::filesystem::exists("library.paren"))
+    libraries.insert(libraries.begin(), "library.paren");
+  for (const std::string &library : libraries) {
+    std::string code;
+    if (!libparen::slurp(library, code)) {
+      std::cerr << "Failed to read " << library << std::endl;
+      return false;
+    }
+    std::vector<libparen::snode> parsed = libparen::parse(code);
+    libparen::compile_all(parsed);  // for the macros
+  }
+  return true;
+}
+
+// Lowers the program in `contents` to the Code paren_run_image will run. As
+// with eval_string, macros are expanded first, here with those of the current
+// interpreter (see LoadMacros).
+bool LowerProgram(std::string_view contents,
+                  std::vector<libparen::scode> &forms) {
+  std::vector<libparen::snode> parsed = libparen::parse(contents);
+  for (libparen::snode &form : libparen::compile_all(parsed))
+    forms.push_back(libparen::lower(form));
+  return true;
+}
+
+LLVMValueRef CreateMain(LLVMModuleRef mod, std::string_view image,
+                        const std::vector<LLVMValueRef> &natives,
                         std::span<const std::string> imports) {
+  LLVMContextRef ctx = LLVMGetModuleContext(mod);
   LLVMTypeRef param_types[] = {};
-  LLVMTypeRef func_type = LLVMFunctionType(LLVMInt32Type(), param_types,
-                                           /*ParamCount=*/0, /*IsVarArg=*/0);
+  LLVMTypeRef func_type =
+      LLVMFunctionType(LLVMInt32TypeInContext(ctx), param_types,
+                       /*ParamCount=*/0, /*IsVarArg=*/0);
   LLVMValueRef main_func = LLVMAddFunction(mod, "main", func_type);
 
-  LLVMBasicBlockRef entry = LLVMAppendBasicBlock(main_func, "entry");
+  LLVMBasicBlockRef entry =
+      LLVMAppendBasicBlockInContext(ctx, main_func, "entry");
 
-  GenericRAII<LLVMBuilderRef> builder(LLVMCreateBuilder(), LLVMDisposeBuilder);
+  GenericRAII<LLVMBuilderRef> builder(LLVMCreateBuilderInContext(ctx),
+                                      LLVMDisposeBuilder);
   LLVMPositionBuilderAtEnd(*builder, entry);
 
   // Initialize the runtime.
@@ -118,17 +956,43 @@ LLVMValueRef CreateMain(LLVMModuleRef mod, std::string_view contents,
                    /*NumArgs=*/1, /*Name=*/"");
   }
 
-  // Just run the code.
-  LLVMValueRef paren_eval_string_func = GetParenEvalStringFunc(mod);
-  LLVMValueRef code =
-      LLVMBuildGlobalStringPtr(*builder, contents.data(), /*Name=*/"");
-  LLVMValueRef paren_eval_string_params[] = {code};
+  // Run the program.
+  LLVMValueRef image_init = LLVMConstStringInContext(
+      ctx, image.data(), static_cast<unsigned>(image.size()),
+      /*DontNullTerminate=*/1);
+  LLVMValueRef image_global =
+      LLVMAddGlobal(mod, LLVMTypeOf(image_init), "paren_image");
+  LLVMSetInitializer(image_global, image_init);
+  LLVMSetGlobalConstant(image_global, 1);
+  LLVMSetLinkage(image_global, LLVMInternalLinkage);
+
+  std::vector<LLVMValueRef> native_ptrs;
+  for (LLVMValueRef native : natives)
+    native_ptrs.push_back(LLVMConstPointerCast(native, GetOpaquePtr(mod)));
+  LLVMValueRef natives_init =
+      LLVMConstArray(GetOpaquePtr(mod), native_ptrs.data(),
+                     static_cast<unsigned>(native_ptrs.size()));
+  LLVMValueRef natives_global =
+      LLVMAddGlobal(mod, LLVMTypeOf(natives_init), "paren_natives");
+  LLVMSetInitializer(natives_global, natives_init);
+  LLVMSetGlobalConstant(natives_global, 1);
+  LLVMSetLinkage(natives_global, LLVMInternalLinkage);
+
+  LLVMValueRef paren_run_image_func = GetParenRunImageFunc(mod);
+  LLVMValueRef paren_run_image_params[] = {
+      LLVMConstPointerCast(image_global, GetOpaquePtr(mod)),
+      LLVMConstInt(LLVMInt64TypeInContext(ctx), image.size(),
+                   /*SignExtend=*/0),
+      LLVMConstPointerCast(natives_global, GetOpaquePtr(mod)),
+      LLVMConstInt(LLVMInt64TypeInContext(ctx), natives.size(),
+                   /*SignExtend=*/0)};
   LLVMBuildCall2(*builder,
-                 /*FuncType=*/LLVMGlobalGetValueType(paren_eval_string_func),
-                 paren_eval_string_func, paren_eval_string_params,
-                 /*NumArgs=*/1, /*Name=*/"");
+                 /*FuncType=*/LLVMGlobalGetValueType(paren_run_image_func),
+                 paren_run_image_func, paren_run_image_params,
+                 /*NumArgs=*/4, /*Name=*/"");
 
-  LLVMValueRef zero = LLVMConstInt(LLVMInt32Type(), 0, /*SignExtend*/ 0);
+  LLVMValueRef zero =
+      LLVMConstInt(LLVMInt32TypeInContext(ctx), 0, /*SignExtend*/ 0);
   LLVMBuildRet(*builder, zero);
 
   return main_func;
@@ -140,100 +1004,471 @@ enum class EmissionKind {
   Object,
 };
 
-int Compile(std::string_view input_filename, std::ostream &out,
-            EmissionKind emission, std::span<const std::string> imports = {}) {
-  std::ifstream input(input_filename.data());
+struct CodegenOptions {
+  unsigned opt_level = 0;  // as in -O<opt_level>
+  // Comma-separated sanitizers to instrument the program with (see
+  // GetSanitizerPasses). The runtime library must then be linked with them.
+  std::string_view sanitize;
+};
+
+bool ParseOptLevel(std::string_view arg, unsigned &opt_level) {
+  if (arg.size() != 1 || arg[0] < '0' || arg[0] > '3') {
+    std::cerr << "Unknown optimization level -O" << arg << std::endl;
+    return false;
+  }
+  opt_level = static_cast<unsigned>(arg[0] - '0');
+  return true;
+}
+
+// Appends the instrumentation passes for the sanitizers in `sanitize` to
+// `passes`. These run after the optimization pipeline, as in clang.
+bool GetSanitizerPasses(std::string_view sanitize, std::string &passes) {
+  while (!sanitize.empty()) {
+    size_t comma = sanitize.find(',');
+    std::string_view name = sanitize.substr(0, comma);
+    sanitize.remove_prefix(comma == std::string_view::npos ? sanitize.size()
+                                                           : comma + 1);
+
+    if (name == "address") {
+      passes += ",asan";
+    } else if (name == "thread") {
+      passes += ",tsan-module,function(tsan)";
+    } else if (name == "memory") {
+      passes += ",msan";
+    } else {
+      std::cerr << "Unknown sanitizer " << name << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+LLVMCodeGenOptLevel GetCodeGenLevel(unsigned opt_level) {
+  switch (opt_level) {
+    case 0:
+      return LLVMCodeGenLevelNone;
+    case 1:
+      return LLVMCodeGenLevelLess;
+    case 2:
+      return LLVMCodeGenLevelDefault;
+    default:
+      return LLVMCodeGenLevelAggressive;
+  }
+}
 
+void InitializeTarget() {
   LLVMInitializeX86TargetInfo();
   LLVMInitializeX86Target();
   LLVMInitializeX86TargetMC();
   LLVMInitializeX86AsmParser();
   LLVMInitializeX86AsmPrinter();
+}
 
-  GenericRAII<char *> triple(LLVMGetDefaultTargetTriple(), LLVMDisposeMessage);
-  GenericRAII<char *> error(NULL, HandleLLVMError);
-  LLVMTargetRef target;
-  LLVMBool failed = LLVMGetTargetFromTriple(*triple, &target, &*error);
-  if (failed)
-    return -1;
+// What target machines for the host are made from. Found once, on first use,
+// for all threads.
+struct HostTarget {
+  LLVMTargetRef target = nullptr;  // nullptr if there is none
+  std::string triple;
+  std::string cpu;
+  std::string features;
+};
 
-  GenericRAII<char *> cpu(LLVMGetHostCPUName(), LLVMDisposeMessage);
-  GenericRAII<char *> features(LLVMGetHostCPUFeatures(), LLVMDisposeMessage);
-  GenericRAII<LLVMTargetMachineRef> target_machine(
-      LLVMCreateTargetMachine(
-          target, *triple, *cpu, *features, /*level=*/LLVMCodeGenLevelNone,
-          /*Reloc=*/LLVMRelocPIC, /*CodeModel=*/LLVMCodeModelDefault),
-      LLVMDisposeTargetMachine);
+const HostTarget &GetHostTarget() {
+  static const HostTarget host = [] {
+    InitializeTarget();
+    HostTarget host;
+    GenericRAII<char *> triple(LLVMGetDefaultTargetTriple(),
+                               LLVMDisposeMessage);
+    GenericRAII<char *> error(NULL, HandleLLVMError);
+    if (LLVMGetTargetFromTriple(*triple, &host.target, &*error)) {
+      host.target = nullptr;
+      return host;
+    }
+    GenericRAII<char *> cpu(LLVMGetHostCPUName(), LLVMDisposeMessage);
+    GenericRAII<char *> features(LLVMGetHostCPUFeatures(), LLVMDisposeMessage);
+    host.triple = *triple;
+    host.cpu = *cpu;
+    host.features = *features;
+    return host;
+  }();
+  return host;
+}
 
-  LLVMModuleRef mod = LLVMModuleCreateWithName(input_filename.data());
+// Returns a target machine for the host, or nullptr if there is none. A target
+// machine is only ever used by one thread at a time.
+LLVMTargetMachineRef CreateHostTargetMachine(LLVMCodeGenOptLevel level) {
+  const HostTarget &host = GetHostTarget();
+  if (!host.target)
+    return nullptr;
+  return LLVMCreateTargetMachine(host.target, host.triple.c_str(),
+                                 host.cpu.c_str(), host.features.c_str(), level,
+                                 /*Reloc=*/LLVMRelocPIC,
+                                 /*CodeModel=*/LLVMCodeModelDefault);
+}
 
-  std::string contents;
-  if (!libparen::slurp(input_filename, contents)) {
-    std::cerr << "Failed to read " << input_filename << std::endl;
-    return -1;
+// Compiles programs to modules of an LLVM context of its own, emitted by a
+// target machine of its own, so that threads can each have one and compile at
+// once. Programs are lowered by the current interpreter.
+class Compiler {
+ public:
+  Compiler(EmissionKind emission, std::span<const std::string> imports,
+           const CodegenOptions &options)
+      : emission(emission), imports(imports), options(options) {}
+
+  ~Compiler() {
+    if (target_machine)
+      LLVMDisposeTargetMachine(target_machine);
+    if (context)
+      LLVMContextDispose(context);
   }
-  CreateMain(mod, contents, imports);
-
-  GenericRAII<LLVMPassBuilderOptionsRef> pb_options(
-      LLVMCreatePassBuilderOptions(), LLVMDisposePassBuilderOptions);
-  // NOTE: This means we always need to pass `-fsanitize=address` during the
-  // link step.
-  LLVMErrorRef maybe_error =
-      LLVMRunPasses(mod, /*passes=*/"asan", *target_machine, *pb_options);
-  if (maybe_error) {
-    char *error = LLVMGetErrorMessage(maybe_error);
-    std::cerr << "LLVM error: " << error << std::endl;
-    LLVMDisposeErrorMessage(error);
-    return -1;
+
+  Compiler(const Compiler &) = delete;
+  Compiler &operator=(const Compiler &) = delete;
+
+  bool Init() {
+    passes = "default<O" + std::to_string(options.opt_level) + ">";
+    if (!GetSanitizerPasses(options.sanitize, passes))
+      return false;
+    target_machine =
+        CreateHostTargetMachine(GetCodeGenLevel(options.opt_level));
+    if (!target_machine)
+      return false;
+    context = LLVMContextCreate();
+    return true;
   }
 
-  failed = LLVMVerifyModule(mod, LLVMAbortProcessAction, &*error);
+  // Compiles the program in `input_filename`, to `out`.
+  bool Compile(const std::string &input_filename, std::ostream &out) {
+    std::string contents;
+    if (!libparen::slurp(input_filename, contents)) {
+      std::cerr << "Failed to read " << input_filename << std::endl;
+      return false;
+    }
+    std::vector<libparen::scode> forms;
+    if (!LowerProgram(contents, forms))
+      return false;
+    std::string image;
+    if (!libparen::save_image(forms, image)) {
+      std::cerr << "Cannot compile the constants in " << input_filename
+                << std::endl;
+      return false;
+    }
+
+    GenericRAII<LLVMModuleRef> mod(
+        LLVMModuleCreateWithNameInContext(input_filename.c_str(), context),
+        LLVMDisposeModule);
+    NativeEmitter emitter(*mod);
+    emitter.EmitAll(forms);
+    CreateMain(*mod, image, emitter.Natives(), imports);
 
-  if (failed)
-    return -1;
+    GenericRAII<LLVMPassBuilderOptionsRef> pb_options(
+        LLVMCreatePassBuilderOptions(), LLVMDisposePassBuilderOptions);
+    // Like clang, only vectorize from -O2 up.
+    LLVMPassBuilderOptionsSetLoopVectorization(*pb_options,
+                                               options.opt_level > 1);
+    LLVMPassBuilderOptionsSetSLPVectorization(*pb_options,
+                                              options.opt_level > 1);
+    if (HandleLLVMErrorRef(LLVMRunPasses(*mod, passes.c_str(), target_machine,
+                                         *pb_options)))
+      return false;
+
+    GenericRAII<char *> error(NULL, HandleLLVMError);
+    LLVMBool failed = LLVMVerifyModule(*mod, LLVMAbortProcessAction, &*error);
+
+    if (failed)
+      return false;
 
-  GenericRAII<LLVMMemoryBufferRef> outbuff(nullptr, [](auto x) {
-    if (x)
-      LLVMDisposeMemoryBuffer(x);
-  });
+    GenericRAII<LLVMMemoryBufferRef> outbuff(nullptr, [](auto x) {
+      if (x)
+        LLVMDisposeMemoryBuffer(x);
+    });
 
-  switch (emission) {
-    case EmissionKind::IR: {
-      char *str = LLVMPrintModuleToString(mod);
-      out << str;
-      LLVMDisposeMessage(str);
-      break;
+    switch (emission) {
+      case EmissionKind::IR: {
+        char *str = LLVMPrintModuleToString(*mod);
+        out << str;
+        LLVMDisposeMessage(str);
+        break;
+      }
+      case EmissionKind::ASM:
+        failed = LLVMTargetMachineEmitToMemoryBuffer(
+            target_machine, *mod,
+            /*codegen=*/LLVMAssemblyFile, &*error, &*outbuff);
+        break;
+      case EmissionKind::Object:
+        failed = LLVMTargetMachineEmitToMemoryBuffer(
+            target_machine, *mod,
+            /*codegen=*/LLVMObjectFile, &*error, &*outbuff);
+        break;
+    }
+
+    if (outbuff) {
+      out.write(LLVMGetBufferStart(*outbuff),
+                static_cast<std::streamsize>(LLVMGetBufferSize(*outbuff)));
     }
-    case EmissionKind::ASM:
-      failed = LLVMTargetMachineEmitToMemoryBuffer(*target_machine, mod,
-                                                   /*codegen=*/LLVMAssemblyFile,
-                                                   &*error, &*outbuff);
-      break;
-    case EmissionKind::Object:
-      failed = LLVMTargetMachineEmitToMemoryBuffer(*target_machine, mod,
-                                                   /*codegen=*/LLVMObjectFile,
-                                                   &*error, &*outbuff);
-      break;
+
+    out.flush();
+
+    return !failed;
+  }
+
+ private:
+  EmissionKind emission;
+  std::span<const std::string> imports;
+  const CodegenOptions &options;
+  std::string passes;
+  LLVMTargetMachineRef target_machine = nullptr;
+  LLVMContextRef context = nullptr;
+};
+
+int Compile(const std::string &input_filename, std::ostream &out,
+            EmissionKind emission, std::span<const std::string> imports = {},
+            const CodegenOptions &options = {}) {
+  Compiler compiler(emission, imports, options);
+  if (!compiler.Init())
+    return -1;
+  libparen::Interpreter interpreter;
+  libparen::Interpreter::Scope scope(interpreter);
+  if (!LoadMacros(imports))
+    return -1;
+  return compiler.Compile(input_filename, out) ? 0 : -1;
+}
+
+// paren -c with more than one input: compiles each to an output of its own,
+// named as for one input, in `output_dir` if given. `jobs` threads compile at
+// once, each with a Compiler. Each program is lowered by a fork of one
+// interpreter, which the library and the imports are loaded into only once.
+int CompileBatch(std::span<const std::string> inputs,
+                 const std::string &output_dir, EmissionKind emission,
+                 std::span<const std::string> imports,
+                 const CodegenOptions &options, unsigned jobs) {
+  libparen::Interpreter warm;
+  {
+    libparen::Interpreter::Scope scope(warm);
+    if (!LoadMacros(imports))
+      return -1;
   }
 
-  if (outbuff) {
-    out.write(LLVMGetBufferStart(*outbuff),
-              static_cast<std::streamsize>(LLVMGetBufferSize(*outbuff)));
+  // Two inputs with one output would have two threads write it at once.
+  namespace fs = std::filesystem;
+  std::vector<fs::path> outputs;
+  std::map<fs::path, size_t> input_of;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    fs::path output = inputs[i] + ".obj";
+    if (!output_dir.empty())
+      output = fs::path(output_dir) / output.filename();
+    output = output.lexically_normal();
+    auto [it, inserted] = input_of.emplace(output, i);
+    if (!inserted) {
+      std::cerr << "Inputs " << inputs[it->second] << " and " << inputs[i]
+                << " would both be compiled to " << output.string()
+                << std::endl;
+      return -1;
+    }
+    outputs.push_back(std::move(output));
   }
 
-  out.flush();
+  std::atomic<size_t> next = 0;
+  std::atomic<bool> failed = false;
+  auto work = [&] {
+    Compiler compiler(emission, imports, options);
+    if (!compiler.Init()) {
+      failed = true;
+      return;
+    }
+    for (size_t i; (i = next++) < inputs.size();) {
+      const fs::path &output = outputs[i];
+      std::ofstream out(output);
 
+      // fork only reads warm, so the threads can each fork it at once.
+      libparen::Interpreter fork = warm.fork();
+      libparen::Interpreter::Scope scope(fork);
+      if (!compiler.Compile(inputs[i], out)) {
+        failed = true;
+        out.close();
+        std::error_code ignored;
+        fs::remove(output, ignored);  // not to be taken for an up to date one
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < std::min<size_t>(jobs, inputs.size()); i++)
+    threads.emplace_back(work);
+  for (std::thread &thread : threads)
+    thread.join();
   return failed ? -1 : 0;
 }
 
+// Compiles fn bodies while paren runs a program (see libparen::set_jit) to the
+// same code paren -c emits for them, optimized as with -O2.
+class Jit {
+ public:
+  ~Jit() {
+    if (jit)
+      HandleLLVMErrorRef(LLVMOrcDisposeLLJIT(jit));
+    if (context)
+      LLVMOrcDisposeThreadSafeContext(context);
+    if (target_machine)
+      LLVMDisposeTargetMachine(target_machine);
+  }
+
+  bool Init() {
+    target_machine = CreateHostTargetMachine(LLVMCodeGenLevelDefault);
+    if (!target_machine)
+      return false;
+    if (HandleLLVMErrorRef(LLVMOrcCreateLLJIT(&jit, /*Builder=*/nullptr)))
+      return false;
+    context = LLVMOrcCreateNewThreadSafeContext();
+    return DefineRuntime();
+  }
+
+  // Returns nullptr if `code` could not be compiled.
+  libparen::native_code Compile(const libparen::Code &code) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string name = "paren_jit_" + std::to_string(compiled++);
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext(
+        name.c_str(), LLVMOrcThreadSafeContextGetContext(context));
+    NativeEmitter(mod).Emit(code, name);
+
+    GenericRAII<LLVMPassBuilderOptionsRef> pb_options(
+        LLVMCreatePassBuilderOptions(), LLVMDisposePassBuilderOptions);
+    if (HandleLLVMErrorRef(LLVMRunPasses(mod, "default<O2>", target_machine,
+                                         *pb_options))) {
+      LLVMDisposeModule(mod);
+      return nullptr;
+    }
+
+    LLVMOrcThreadSafeModuleRef tsm =
+        LLVMOrcCreateNewThreadSafeModule(mod, context);
+    if (HandleLLVMErrorRef(LLVMOrcLLJITAddLLVMIRModule(
+            jit, LLVMOrcLLJITGetMainJITDylib(jit), tsm)))
+      return nullptr;
+
+    LLVMOrcExecutorAddress address;
+    if (HandleLLVMErrorRef(LLVMOrcLLJITLookup(jit, &address, name.c_str())))
+      return nullptr;
+    return reinterpret_cast<libparen::native_code>(address);
+  }
+
+ private:
+  // Lets compiled code call the runtime in this process. It is looked up by
+  // address, so paren need not export its symbols.
+  bool DefineRuntime() {
+    std::pair<std::string_view, void *> runtime[] = {
+        {kParenRtExecName, reinterpret_cast<void *>(paren_rt_exec)},
+        {kParenRtPopTruthyName, reinterpret_cast<void *>(paren_rt_pop_truthy)},
+        {kParenRtPrepareCallName,
+         reinterpret_cast<void *>(paren_rt_prepare_call)},
+        {kParenRtGuardName, reinterpret_cast<void *>(paren_rt_guard)},
+        {kParenRtCallName, reinterpret_cast<void *>(paren_rt_call)},
+        {kParenRtTailCallName, reinterpret_cast<void *>(paren_rt_tail_call)},
+        {kParenRtIntactName, reinterpret_cast<void *>(paren_rt_intact)},
+        {kParenRtPushName, reinterpret_cast<void *>(paren_rt_push)},
+        {kParenRtSlotsName, reinterpret_cast<void *>(paren_rt_slots)},
+    };
+    std::vector<LLVMJITCSymbolMapPair> symbols;
+    for (auto [name, address] : runtime) {
+      LLVMJITSymbolFlags flags = {
+          LLVMJITSymbolGenericFlagsExported | LLVMJITSymbolGenericFlagsCallable,
+          /*TargetFlags=*/0};
+      symbols.push_back(
+          {LLVMOrcLLJITMangleAndIntern(jit, name.data()),
+           {reinterpret_cast<LLVMOrcExecutorAddress>(address), flags}});
+    }
+    LLVMOrcMaterializationUnitRef unit =
+        LLVMOrcAbsoluteSymbols(symbols.data(), symbols.size());
+    if (HandleLLVMErrorRef(
+            LLVMOrcJITDylibDefine(LLVMOrcLLJITGetMainJITDylib(jit), unit))) {
+      LLVMOrcDisposeMaterializationUnit(unit);
+      return false;
+    }
+    return true;
+  }
+
+  LLVMTargetMachineRef target_machine = nullptr;  // for the passes
+  LLVMOrcLLJITRef jit = nullptr;
+  LLVMOrcThreadSafeContextRef context = nullptr;
+  std::mutex mutex;  // Compile may be called from any paren thread
+  size_t compiled = 0;
+};
+
+// How many calls a fn body must get under paren --jit to be compiled.
+constexpr size_t kJitThreshold = 100;
+
+Jit *jit = nullptr;
+
+libparen::native_code JitCompile(const libparen::Code &code) {
+  return jit->Compile(code);
+}
+
+// paren --serve PATH: evaluates forms from stdin if PATH is "-", answering on
+// stdout (see libparen::serve), or else from connections to a Unix socket made
+// at PATH. Each connection is served on a thread of its own, by an interpreter
+// of its own forked from `warm`, which is otherwise left alone.
+int Serve(const std::string &path, libparen::Interpreter &warm) {
+  if (path == "-") {
+    libparen::Interpreter::Scope scope(warm);
+    libparen::serve(STDIN_FILENO, STDOUT_FILENO);
+    libparen::flush_output();
+    return 0;
+  }
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long: " << path << std::endl;
+    return -1;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path.c_str());
+  if (listener < 0 ||
+      bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    perror(path.c_str());
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN);  // a client gone is only the end of its thread
+  for (;;) {
+    int connection = accept(listener, nullptr, nullptr);
+    if (connection < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept");
+      return -1;
+    }
+    std::thread([&warm, connection] {
+      libparen::Interpreter interpreter = warm.fork();
+      {
+        libparen::Interpreter::Scope scope(interpreter);
+        libparen::serve(connection, connection);
+        libparen::flush_output();
+      }
+      close(connection);
+    }).detach();
+  }
+}
+
 }  // namespace
 
 int main(int argc, char *argv[]) {
   argparse::ArgParser argparser(argv[0]);
-  argparser.AddPosArg("input");
+  // More than one only with -c; see CompileBatch.
+  argparser.AddPosArg("input").setAppend();
   argparser.AddOptArg("compile", 'c').setStoreTrue();
   argparser.AddOptArg("output", 'o');
+  // Threads to compile more than one input with; 0 for as many as cores.
+  argparser.AddOptArg("jobs", 'j').setDefault(std::string("0"));
   argparser.AddOptArg("import", 'i').setAppend().setDefaultList();
+  argparser.AddOptArg("opt-level", 'O').setDefault(std::string("0"));
+  argparser.AddOptArg("sanitize").setDefault(std::string());
+  argparser.AddOptArg("jit").setStoreTrue();
+  // Profiles the program ("calls" or "sample"; see libparen::profile_start)
+  // and writes the report to --profile-output, or stderr.
+  argparser.AddOptArg("profile").setDefault(std::string());
+  argparser.AddOptArg("profile-output").setDefault(std::string());
+  // Keeps running, evaluating forms sent to it; see Serve.
+  argparser.AddOptArg("serve").setDefault(std::string());
 
   // TODO: This could be a mutually exclusive group.
   argparser.AddOptArg("emit-llvm").setStoreTrue();
@@ -245,7 +1480,35 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  if (!args.has("input")) {
+  Jit jit_instance;
+  if (args.get<bool>("jit")) {
+    if (!jit_instance.Init())
+      return -1;
+    jit = &jit_instance;
+    libparen::set_jit(JitCompile, kJitThreshold);
+  }
+
+  std::string serve = args.get("serve");
+  if (!serve.empty()) {
+    libparen::Interpreter warm;
+    warm.init();
+    {
+      libparen::Interpreter::Scope scope(warm);
+      for (const std::string &import_module : args.getList("import"))
+        paren_import(import_module.c_str());
+    }
+    return Serve(serve, warm);
+  }
+
+  static const argparse::list_t kNoInputs;
+  const argparse::list_t &inputs =
+      args.has("input") ? args.getList("input") : kNoInputs;
+  if (inputs.size() > 1 && !args.get<bool>("compile")) {
+    std::cerr << "Only -c takes more than one input" << std::endl;
+    return -1;
+  }
+
+  if (inputs.empty()) {
     libparen::init();
     libparen::print_logo();
     libparen::repl();
@@ -256,10 +1519,51 @@ int main(int argc, char *argv[]) {
   if (args.get<bool>("compile")) {
     assert(argc > 1);
 
+    EmissionKind kind{EmissionKind::Object};
+    if (args.get<bool>("emit-llvm"))
+      kind = EmissionKind::IR;
+    else if (args.get<bool>("emit-asm"))
+      kind = EmissionKind::ASM;
+
+    CodegenOptions options;
+    if (!ParseOptLevel(args.get("opt-level"), options.opt_level))
+      return -1;
+    options.sanitize = args.get("sanitize");
+
+    if (inputs.size() > 1) {
+      // -o names a directory for the outputs.
+      std::string output_dir = args.has("output") ? args["output"] : "";
+      if (output_dir == "-") {
+        std::cerr << "Cannot write more than one output to stdout"
+                  << std::endl;
+        return -1;
+      }
+      std::error_code dir_error;
+      if (!output_dir.empty())
+        std::filesystem::create_directories(output_dir, dir_error);
+      if (dir_error) {
+        std::cerr << "Cannot create " << output_dir << ": "
+                  << dir_error.message() << std::endl;
+        return -1;
+      }
+      const std::string &jobs_arg = args.get("jobs");
+      unsigned jobs = 0;
+      auto [end, error] = std::from_chars(
+          jobs_arg.data(), jobs_arg.data() + jobs_arg.size(), jobs);
+      if (error != std::errc() || end != jobs_arg.data() + jobs_arg.size()) {
+        std::cerr << "Bad number of jobs " << jobs_arg << std::endl;
+        return -1;
+      }
+      if (jobs == 0)
+        jobs = std::max(std::thread::hardware_concurrency(), 1u);
+      return CompileBatch(inputs, output_dir, kind, args.getList("import"),
+                          options, jobs);
+    }
+
     std::ofstream file_output;
     std::ostream &out = [&]() -> std::ostream & {
       if (!args.has("output")) {
-        file_output = std::ofstream(args.get("input") + ".obj");
+        file_output = std::ofstream(inputs[0] + ".obj");
         return file_output;
       }
 
@@ -270,23 +1574,26 @@ int main(int argc, char *argv[]) {
       return file_output;
     }();
 
-    EmissionKind kind{EmissionKind::Object};
-    if (args.get<bool>("emit-llvm"))
-      kind = EmissionKind::IR;
-    else if (args.get<bool>("emit-asm"))
-      kind = EmissionKind::ASM;
-
-    return Compile(args.get("input"), out, kind, args.getList("import"));
+    return Compile(inputs[0], out, kind, args.getList("import"), options);
   }
 
-  // execute files
+  // execute the file
   libparen::init();
-  for (int i = 1; i < argc; i++) {
-    std::string code;
-    if (libparen::slurp(std::string(argv[i]), code)) {
-      libparen::eval_string(code);
-    } else {
-      fprintf(stderr, "Cannot open file: %s\n", argv[i]);
-    }
+  for (const std::string &import_module : args.getList("import"))
+    paren_import(import_module.c_str());
+  std::string profile = args.get("profile");
+  if (!profile.empty() && !libparen::profile_start(profile)) {
+    std::cerr << "Unknown profile mode " << profile << std::endl;
+    return -1;
+  }
+  std::string code;
+  if (libparen::slurp(inputs[0], code)) {
+    libparen::eval_string(code);
+  } else {
+    fprintf(stderr, "Cannot open file: %s\n", inputs[0].c_str());
+  }
+  if (!profile.empty()) {
+    libparen::flush_output();
+    libparen::profile_report(args.get("profile-output"));
   }
 }
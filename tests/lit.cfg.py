@@ -12,11 +12,14 @@ build_root = Path(config.build_root)
 paren_path = build_root / "paren"
 library_paren_path = build_root / "library.paren"
 
+# Keep images of library.paren and imports out of the user's cache directory.
+config.environment["PAREN_CACHE_DIR"] = str(build_root / "tests" / "cache")
+
 config.substitutions.append(("%paren", f"{paren_path} -i {library_paren_path}"))
 config.substitutions.append(
     (
         "%cxx",
-        f"{config.cxx} -fsanitize=address -Wl,--whole-archive -lparen -L{config.build_root} -Wl,--no-whole-archive",
+        f"{config.cxx} {config.link_flags} -Wl,--whole-archive -lparen -L{config.build_root} -Wl,--no-whole-archive",
     )
 )
 config.substitutions.append(("FileCheck", config.filecheck))
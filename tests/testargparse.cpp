@@ -31,6 +31,30 @@ TEST(ArgParse, SimplePosArgs) {
   EXPECT_EQ(res.get("pos2"), "arg2");
 }
 
+TEST(ArgParse, PosArgAppend) {
+  constexpr char *kArgv[] = {
+      "exe",
+      "arg1",
+      "arg2",
+      "--opt",
+      "val",
+      "arg3",
+      nullptr,
+  };
+  constexpr int kArgc = 6;
+
+  argparse::ArgParser parser;
+  parser.AddPosArg("pos1");
+  parser.AddPosArg("rest").setAppend();
+  parser.AddOptArg("opt");
+
+  auto res = parser.ParseArgs(kArgc, kArgv);
+  std::vector<std::string> expected{"arg2", "arg3"};
+  EXPECT_EQ(res.get("pos1"), "arg1");
+  EXPECT_EQ(res.getList("rest"), expected);
+  EXPECT_EQ(res.get("opt"), "val");
+}
+
 TEST(ArgParse, OptArg) {
   argparse::ArgParser parser;
   parser.AddPosArg("pos1");
@@ -195,4 +219,46 @@ TEST(ArgParse, OptArgAppendShortName) {
   EXPECT_EQ(res.get("pos1"), "arg2");
 }
 
+TEST(ArgParse, OptArgJoinedShortName) {
+  constexpr char *kArgv[] = {
+      "exe",
+      "-O2",
+      "arg1",
+      nullptr,
+  };
+  constexpr int kArgc = 3;
+
+  argparse::ArgParser parser;
+  parser.AddPosArg("pos1");
+  parser.AddOptArg("opt", 'O');
+
+  auto res = parser.ParseArgs(kArgc, kArgv);
+  EXPECT_EQ(res.get("opt"), "2");
+  EXPECT_EQ(res.get("pos1"), "arg1");
+}
+
+TEST(ArgParse, OptArgJoinedLongName) {
+  constexpr char *kArgv[] = {
+      "exe",
+      "--opt=a,b",
+      "--list=arg2",
+      "arg1",
+      "--list",
+      "arg3",
+      nullptr,
+  };
+  constexpr int kArgc = 6;
+
+  argparse::ArgParser parser;
+  parser.AddPosArg("pos1");
+  parser.AddOptArg("opt");
+  parser.AddOptArg("list").setAppend();
+
+  auto res = parser.ParseArgs(kArgc, kArgv);
+  std::vector<std::string> expected{"arg2", "arg3"};
+  EXPECT_EQ(res.get("opt"), "a,b");
+  EXPECT_EQ(res.getList("list"), expected);
+  EXPECT_EQ(res.get("pos1"), "arg1");
+}
+
 }  // namespace
@@ -0,0 +1,157 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libparen.h"
+
+namespace {
+
+using libparen::Interpreter;
+
+int int_of(const libparen::snode &n) { return n ? n->to_int() : -1; }
+
+// An Interpreter with library.paren loaded, left out of the image cache.
+Interpreter with_library() {
+  libparen::set_cache_dir("");
+  Interpreter interpreter;
+  EXPECT_TRUE(interpreter.eval_file(PAREN_LIBRARY));
+  return interpreter;
+}
+
+TEST(Interpreter, GlobalsAreSeparate) {
+  Interpreter a, b;
+  a.eval_string("(def x 1)");
+  b.eval_string("(def x 2)");
+  EXPECT_EQ(int_of(a.eval_string("x")), 1);
+  EXPECT_EQ(int_of(b.eval_string("x")), 2);
+
+  // Neither is the default one, which is left as the other tests have it.
+  EXPECT_EQ(int_of(a.eval_string("(def y 3) y")), 3);
+  EXPECT_EQ(libparen::get("y")->type, libparen::Node::T_NIL);
+}
+
+TEST(Interpreter, MacrosAreSeparate) {
+  Interpreter a, b;
+  a.eval_string("(defmacro twice (x) (begin x x))");
+  a.eval_string("(def n 0) (twice (++ n))");
+  EXPECT_EQ(int_of(a.eval_string("n")), 2);
+  b.eval_string("(def twice (fn (x) 10))");
+  EXPECT_EQ(int_of(b.eval_string("(twice 0)")), 10);
+}
+
+TEST(Interpreter, ForkCopiesWhatWasDefined) {
+  Interpreter base = with_library();
+  base.eval_string(
+      "(def xs (list 1 2 3))"
+      "(defn make-counter () (def n 0) (fn () (++ n)))"
+      "(def counter (make-counter))"
+      "(def counters (cons (make-counter) (pvec (make-counter))))"
+      "(defn sq (x) (* x x))");
+  Interpreter fork = base.fork();
+
+  // library.paren and the macros in it come along.
+  EXPECT_EQ(int_of(fork.eval_string("(inc (sq 4))")), 17);
+  EXPECT_EQ(int_of(fork.eval_string("(def k 0) (for i 1 3 1 (++ k)) k")), 3);
+
+  // What the fork does to its copies leaves the original alone.
+  fork.eval_string("(push-back! xs 4) (counter) (counter)");
+  EXPECT_EQ(int_of(fork.eval_string("(length xs)")), 4);
+  EXPECT_EQ(int_of(base.eval_string("(length xs)")), 3);
+  EXPECT_EQ(int_of(fork.eval_string("(counter)")), 3);
+  EXPECT_EQ(int_of(base.eval_string("(counter)")), 1);
+  fork.eval_string("((first counters)) ((nth 1 counters))");
+  EXPECT_EQ(int_of(fork.eval_string("((first counters))")), 2);
+  EXPECT_EQ(int_of(base.eval_string("((nth 1 counters))")), 1);
+
+  // Fns of the original see the globals of the fork.
+  fork.eval_string("(defn sq (x) (+ x x))");
+  EXPECT_EQ(int_of(fork.eval_string("(sq 5)")), 10);
+  EXPECT_EQ(int_of(base.eval_string("(sq 5)")), 25);
+}
+
+TEST(Interpreter, ForksRunOnThreadsAtOnce) {
+  Interpreter base = with_library();
+  base.eval_string(
+      "(defn fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+
+  constexpr int kThreads = 4;
+  std::vector<Interpreter> forks;
+  for (int i = 0; i < kThreads; i++)
+    forks.push_back(base.fork());
+  std::vector<int> results(kThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; i++) {
+    threads.emplace_back([&, i] {
+      Interpreter &fork = forks[static_cast<size_t>(i)];
+      fork.set("seed", libparen::Node(i));
+      fork.eval_string(
+          "(def acc 0)"
+          "(for j 1 200 1 (set acc (+ acc seed (fib 10))))");
+      fork.collect();
+      results[static_cast<size_t>(i)] = int_of(fork.eval_string("acc"));
+    });
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+  for (int i = 0; i < kThreads; i++)
+    EXPECT_EQ(results[static_cast<size_t>(i)], 200 * (i + 55));
+}
+
+TEST(Interpreter, InterpretersInternSymbolsAtOnce) {
+  // Symbols are shared by every interpreter, though none of these starts a
+  // thread of its own.
+  constexpr int kThreads = 4;
+  constexpr int kSymbols = 500;
+  std::vector<int> sums(kThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; i++) {
+    threads.emplace_back([&, i] {
+      Interpreter interpreter;
+      std::string source = "(def sum 0)";
+      for (int k = 0; k < kSymbols; k++) {
+        // Some names are this thread's, some every thread's.
+        std::string name = k % 2 ? "shared-" + std::to_string(k)
+                                 : "own-" + std::to_string(i) + "-" +
+                                       std::to_string(k);
+        source += "(def " + name + " " + std::to_string(k) + ")" +
+                  "(set sum (+ sum " + name + "))";
+      }
+      sums[static_cast<size_t>(i)] =
+          int_of(interpreter.eval_string(source + " sum"));
+    });
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+  for (int sum : sums)
+    EXPECT_EQ(sum, kSymbols * (kSymbols - 1) / 2);
+  for (int k = 1; k < kSymbols; k += 2) {
+    std::string name = "shared-" + std::to_string(k);
+    EXPECT_EQ(libparen::SymbolName(libparen::ToCode(name)), name);
+  }
+}
+
+TEST(Interpreter, SpawnRunsInTheInterpreter) {
+  Interpreter a = with_library();
+  a.eval_string("(def x 7)");
+  EXPECT_EQ(int_of(a.eval_string("(await (spawn (* x 6)))")), 42);
+  EXPECT_EQ(int_of(a.eval_string("(def t (thread (set x 8))) (join t) x")), 8);
+}
+
+TEST(Interpreter, CApi) {
+  paren_ctx *base = paren_ctx_new();
+  paren_ctx_eval_string(base, "(def x 5)");
+  paren_ctx *fork = paren_ctx_fork(base);
+  paren_ctx_eval_string(fork, "(set x 6)");
+  EXPECT_EQ(paren_ctx_get_int(fork, "x"), 6);
+  EXPECT_EQ(paren_ctx_get_int(base, "x"), 5);
+  paren_ctx_free(fork);
+
+  // The base outlives its fork.
+  paren_ctx_eval_string(base, "(set x (+ x 1))");
+  EXPECT_EQ(paren_ctx_get_int(base, "x"), 6);
+  paren_ctx_free(base);
+}
+
+}  // namespace
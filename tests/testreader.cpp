@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "libparen.h"
+
+namespace {
+
+using libparen::Reader;
+
+// What `form` evaluates to, as an int.
+int eval(const std::string &form) {
+  libparen::Interpreter interpreter;
+  return interpreter.eval_string(form)->to_int();
+}
+
+// Feeds `pieces` in turn, and collects each form as it comes out.
+std::vector<std::string> read(std::vector<std::string_view> pieces,
+                              Reader &reader) {
+  std::vector<std::string> forms;
+  for (std::string_view piece : pieces) {
+    reader.feed(piece);
+    for (std::string form; reader.next(form);)
+      forms.push_back(form);
+  }
+  return forms;
+}
+
+TEST(Reader, FormsComeOutWhenComplete) {
+  Reader reader;
+  reader.feed("(+ 1 ");
+  std::string form;
+  EXPECT_FALSE(reader.next(form));
+  EXPECT_TRUE(reader.partial());
+  reader.feed("2) (f");
+  ASSERT_TRUE(reader.next(form));
+  EXPECT_EQ(eval(form), 3);
+  EXPECT_FALSE(reader.next(form));
+  reader.feed(")");
+  EXPECT_TRUE(reader.next(form));
+  EXPECT_FALSE(reader.partial());
+}
+
+TEST(Reader, PiecesSplitAnywhere) {
+  Reader reader;
+  std::vector<std::string> forms =
+      read({"(str", "len \"a ) ", "b\") ; a (comm", "ent\n 12", "3 "}, reader);
+  ASSERT_EQ(forms.size(), 2u);
+  EXPECT_EQ(eval(forms[0]), 5);
+  EXPECT_EQ(eval(forms[1]), 123);
+  EXPECT_FALSE(reader.partial());
+}
+
+TEST(Reader, AtomNeedsWhatFollows) {
+  Reader reader;
+  EXPECT_TRUE(read({"42"}, reader).empty());
+  EXPECT_TRUE(reader.partial());
+  EXPECT_EQ(read({"\n"}, reader), std::vector<std::string>{"42"});
+}
+
+// A stray ) ends what came before it, and leaves what follows whole.
+TEST(Reader, StrayClose) {
+  Reader reader;
+  std::vector<std::string> forms = read({"1 ) (+ 1 1)"}, reader);
+  ASSERT_EQ(forms.size(), 3u);
+  EXPECT_EQ(eval(forms[0]), 1);
+  EXPECT_EQ(eval(forms[2]), 2);
+}
+
+TEST(Reader, FinishHandsOverTheRest) {
+  Reader reader;
+  reader.feed("(a) (b");
+  std::string form;
+  EXPECT_TRUE(reader.next(form));
+  EXPECT_NE(reader.finish().find("(b"), std::string::npos);
+  EXPECT_FALSE(reader.partial());
+}
+
+}  // namespace